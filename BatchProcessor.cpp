@@ -0,0 +1,224 @@
+#include "BatchProcessor.h"
+#include "WorkQueue.h"
+#include "FileIO.h"
+#include "Log.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+BatchProcessor::BatchProcessor(const ProcessingOptions &options, unsigned int jobs) : m_options(options), m_jobs(jobs) {
+    if(m_jobs == 0) {
+        m_jobs = std::max(1U, std::thread::hardware_concurrency());
+    }
+}
+
+BatchProcessor::~BatchProcessor() = default;
+
+void BatchProcessor::addJob(BatchJob &&job) {
+    m_batch.emplace_back(std::move(job));
+}
+
+void BatchProcessor::addManifest(const std::filesystem::path &manifest) {
+    std::ifstream stream;
+    stream.exceptions(std::ios::badbit);
+    stream.open(manifest, std::ios::in);
+    if(!stream)
+        throw std::logic_error("unable to open the manifest " + manifest.string());
+
+    std::string line;
+    size_t lineNumber = 0;
+
+    while(std::getline(stream, line)) {
+        lineNumber++;
+
+        if(!line.empty() && line.back() == '\r')
+            line.pop_back();
+
+        if(line.empty() || line[0] == '#')
+            continue;
+
+        std::vector<std::string> fields;
+        std::stringstream lineStream(line);
+        std::string field;
+
+        while(std::getline(lineStream, field, '\t')) {
+            fields.emplace_back(std::move(field));
+        }
+
+        if(fields.size() < 2 || fields.size() > 3 || fields[0].empty() || fields[1].empty()) {
+            std::stringstream error;
+            error << manifest.string() << ":" << lineNumber << ": expected <INPUT>\\t<OUTPUT>[\\t<MSDCM OUTPUT>]";
+            throw std::logic_error(error.str());
+        }
+
+        BatchJob job;
+        job.input = fields[0];
+        job.output = fields[1];
+        if(fields.size() == 3)
+            job.msdcmOutput = fields[2];
+
+        addJob(std::move(job));
+    }
+}
+
+void BatchProcessor::addDirectory(const std::filesystem::path &input,
+                                  const std::filesystem::path &output,
+                                  const std::filesystem::path &msdcmOutput) {
+    std::vector<std::filesystem::path> files;
+
+    for(const auto &entry: std::filesystem::recursive_directory_iterator(input)) {
+        if(entry.is_regular_file())
+            files.emplace_back(entry.path());
+    }
+
+    /*
+     * Directory iteration order is unspecified; sort to make the processing
+     * (and the reporting) order reproducible.
+     */
+    std::sort(files.begin(), files.end());
+
+    for(const auto &file: files) {
+        auto relative = file.lexically_relative(input);
+
+        BatchJob job;
+        job.input = file;
+        job.output = output / relative;
+        if(!msdcmOutput.empty())
+            job.msdcmOutput = msdcmOutput / relative;
+
+        addJob(std::move(job));
+    }
+}
+
+size_t BatchProcessor::run() {
+    /*
+     * There's no use for more workers than images.
+     */
+    m_jobs = std::max<size_t>(1, std::min<size_t>(m_jobs, m_batch.size()));
+
+    /*
+     * Allow every stage to run a little ahead of the next one, but bound the
+     * number of whole images held in memory.
+     */
+    WorkQueue<Item> loaded(2 * m_jobs);
+    WorkQueue<Item> transformed(2 * m_jobs);
+
+    m_statistics.assign(m_batch.size(), ImageStatistics());
+
+    std::thread reader(&BatchProcessor::readStage, this, std::ref(loaded));
+
+    std::vector<std::thread> workers;
+    workers.reserve(m_jobs);
+    for(unsigned int worker = 0; worker < m_jobs; worker++) {
+        workers.emplace_back(&BatchProcessor::transformStage, this, std::ref(loaded), std::ref(transformed));
+    }
+
+    size_t failures = 0;
+    std::thread writer([this, &transformed, &failures]() {
+        failures = writeStage(transformed);
+    });
+
+    reader.join();
+
+    for(auto &worker: workers) {
+        worker.join();
+    }
+
+    transformed.close();
+    writer.join();
+
+    logMessage(LogLevel::Info, "Batch finished: %zu images, %zu failed", m_batch.size(), failures);
+
+    return failures;
+}
+
+void BatchProcessor::readStage(WorkQueue<Item> &output) {
+    for(size_t index = 0, count = m_batch.size(); index < count; index++) {
+        Item item;
+        item.index = index;
+        item.statistics.input = m_batch[index].input.string();
+
+        /*
+         * With mapped I/O, the workers map the inputs themselves and the
+         * kernel does the read-ahead.
+         */
+        if(m_options.mappedIO) {
+            output.push(std::move(item));
+            continue;
+        }
+
+        try {
+            PhaseTimer timer(&item.statistics, "read");
+            item.data = readFile(m_batch[index].input);
+        } catch(const std::exception &e) {
+            item.data.clear();
+            item.error = std::string("unable to read: ") + e.what();
+        }
+
+        output.push(std::move(item));
+    }
+
+    output.close();
+}
+
+void BatchProcessor::transformStage(WorkQueue<Item> &input, WorkQueue<Item> &output) {
+    while(auto item = input.pop()) {
+        if(item->error.empty()) {
+            try {
+                const auto &job = m_batch[item->index];
+
+                if(m_options.mappedIO) {
+                    processImageFile(job.input, job.output, job.msdcmOutput, m_options, &item->statistics);
+                } else {
+                    auto input = std::move(item->data);
+
+                    processImage(std::move(input), m_options, !job.msdcmOutput.empty(), item->data, item->msdcm,
+                                 &item->statistics);
+                }
+            } catch(const std::exception &e) {
+                item->data.clear();
+                item->msdcm.clear();
+                item->error = e.what();
+            }
+        }
+
+        output.push(std::move(*item));
+    }
+}
+
+size_t BatchProcessor::writeStage(WorkQueue<Item> &input) {
+    size_t failures = 0;
+
+    while(auto item = input.pop()) {
+        const auto &job = m_batch[item->index];
+
+        if(item->error.empty() && !m_options.mappedIO) {
+            try {
+                PhaseTimer timer(&item->statistics, "write");
+
+                if(!job.msdcmOutput.empty()) {
+                    writeFile(job.msdcmOutput, item->msdcm);
+                }
+
+                writeFile(job.output, item->data);
+            } catch(const std::exception &e) {
+                item->error = std::string("unable to write: ") + e.what();
+            }
+        }
+
+        if(item->error.empty()) {
+            logMessage(LogLevel::Info, "%s: processed", job.input.string().c_str());
+        } else {
+            logMessage(LogLevel::Error, "%s: failed: %s", job.input.string().c_str(), item->error.c_str());
+            failures++;
+        }
+
+        item->statistics.error = item->error;
+        m_statistics[item->index] = std::move(item->statistics);
+    }
+
+    return failures;
+}
@@ -0,0 +1,84 @@
+#ifndef BATCH_PROCESSOR_H
+#define BATCH_PROCESSOR_H
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "ImageProcessor.h"
+#include "Statistics.h"
+
+template<typename T>
+class WorkQueue;
+
+struct BatchJob {
+    std::filesystem::path input;
+    std::filesystem::path output;
+    std::filesystem::path msdcmOutput; // Empty if MSDCM is not to be extracted
+};
+
+/*
+ * Processes a list of images as a three-stage pipeline: a reader thread
+ * reads the inputs ahead, a pool of workers transforms them, and a writer
+ * thread writes the results behind. With mapped I/O, the reader and the
+ * writer only pass the jobs along, and every worker processes its image from
+ * file to file. A failure of one image is reported and counted, but doesn't
+ * affect the others.
+ */
+class BatchProcessor {
+public:
+    BatchProcessor(const ProcessingOptions &options, unsigned int jobs);
+    ~BatchProcessor();
+
+    BatchProcessor(const BatchProcessor &other) = delete;
+    BatchProcessor &operator =(const BatchProcessor &other) = delete;
+
+    void addJob(BatchJob &&job);
+
+    /*
+     * Manifest lines are: <INPUT>\t<OUTPUT>[\t<MSDCM OUTPUT>]. Empty lines and
+     * lines starting with '#' are ignored.
+     */
+    void addManifest(const std::filesystem::path &manifest);
+
+    /*
+     * Adds every regular file under 'input', mirroring the directory
+     * structure into 'output' (and into 'msdcmOutput', if not empty).
+     */
+    void addDirectory(const std::filesystem::path &input,
+                      const std::filesystem::path &output,
+                      const std::filesystem::path &msdcmOutput);
+
+    /*
+     * Returns the number of images that failed.
+     */
+    size_t run();
+
+    /*
+     * The statistics of every image of the last run, in the order they were
+     * added.
+     */
+    inline const std::vector<ImageStatistics> &statistics() const {
+        return m_statistics;
+    }
+
+private:
+    struct Item {
+        size_t index;
+        std::vector<unsigned char> data;
+        std::vector<unsigned char> msdcm;
+        std::string error;
+        ImageStatistics statistics;
+    };
+
+    void readStage(WorkQueue<Item> &output);
+    void transformStage(WorkQueue<Item> &input, WorkQueue<Item> &output);
+    size_t writeStage(WorkQueue<Item> &input);
+
+    ProcessingOptions m_options;
+    unsigned int m_jobs;
+    std::vector<BatchJob> m_batch;
+    std::vector<ImageStatistics> m_statistics;
+};
+
+#endif
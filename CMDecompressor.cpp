@@ -1,6 +1,12 @@
 #include "CMDecompressor.h"
+#include "CMProfile.h"
+#include "DSDecoder.h"
+#include "ParallelFor.h"
+#include "Log.h"
 
+#include <algorithm>
 #include <memory>
+#include <sstream>
 #include <stdexcept>
 #include <functional>
 
@@ -82,164 +88,426 @@ static void map(x86emu_t *emu, uint32_t baseAddress, std::vector<unsigned char>
     x86emu_set_perm(emu, baseAddress, baseAddress + buf.size(), X86EMU_PERM_R | X86EMU_PERM_W | X86EMU_PERM_X | X86EMU_PERM_VALID);
 }
 
-std::vector<unsigned char> cmDecompress(const unsigned char *data, size_t size) {
-    auto begin = data;
+namespace {
+    struct CMBlock {
+        const unsigned char *data;
+        size_t compressedLength;
+        size_t uncompressedLength;
+        size_t outputOffset;
+        size_t index;
+    };
 
-    auto limit = data + size;
+    static constexpr uint16_t DSSignature = 0x5344;
+    static constexpr size_t DSHeaderSize = 6;
 
-    auto signature = get16(data, limit);
-    if(signature != CMSignature) {
-        throw std::logic_error("'CM' signature is not valid at the beginning of the stream");
-    }
+    /*
+     * The decompressor embedded in the image, loaded into libx86emu.
+     */
+    class CMEmulator {
+    public:
+        CMEmulator(const unsigned char *decompressorCode, size_t decompressorLength, uint16_t decompressorEntry,
+                   uint64_t instructionBudget, bool profile);
+
+        void decompressBlock(const CMBlock &block, unsigned char *output);
 
-    auto startOfDataStream = data;
+        /*
+         * What was collected while profiling.
+         */
+        inline const CMProfile::Samples &samples() const {
+            return m_samples;
+        }
+
+        inline const std::vector<CMProfile::Block> &profiledBlocks() const {
+            return m_profiledBlocks;
+        }
+
+    private:
+        static int codeHandler(x86emu_t *emu);
+        void onInstruction(uint32_t address);
+
+        /*
+         * Our simulated memory is set up as follows:
+         * (seg 0000): 0x00000 - 0x00100 - stack (256 bytes)
+         * (seg 0010): 0x00100 - 0x10000 - decompressor
+         * (seg 1000): 0x10000 - 0x20000 - input buffer
+         * (seg 2000): 0x20000 - 0x30000 - output buffer
+         */
+        static constexpr size_t StackSize = 256;
+
+        static thread_local CMEmulator *m_active;
+
+        X86EMUPointer m_emu;
+        uint16_t m_decompressorEntry;
+        size_t m_decompressorLength;
+        uint64_t m_instructionBudget;
+        std::vector<unsigned char> m_decompressor;
+        std::vector<unsigned char> m_inputBuffer;
+        std::vector<unsigned char> m_outputBuffer;
+
+        CMProfile::Samples m_samples;
+        std::vector<CMProfile::Block> m_profiledBlocks;
+        uint64_t m_blockInstructions = 0;
+        bool m_hasPrevious = false;
+        uint32_t m_previous = 0;
+    };
+
+    thread_local CMEmulator *CMEmulator::m_active = nullptr;
+}
+
+CMEmulator::CMEmulator(const unsigned char *decompressorCode, size_t decompressorLength, uint16_t decompressorEntry,
+                       uint64_t instructionBudget, bool profile) :
+    m_decompressorEntry(decompressorEntry),
+    m_decompressorLength(decompressorLength),
+    m_instructionBudget(instructionBudget),
+    m_decompressor(65536),
+    m_inputBuffer(65536),
+    m_outputBuffer(65536) {
 
     /*
-     * Walk the whole file to get to the decompressor.
+     * Do all the necessary setup for the simulator where we are going to run
+     * the decompressor.
      */
+    auto rawEmu = x86emu_new(0, 0);
+    if(rawEmu == nullptr)
+        throw std::bad_alloc();
 
-    walkCompressedBlocks(data, limit, [](
-        const unsigned char *compressedData,
-        size_t compressedDataLength,
-        size_t uncompressedDataLength) {
+    m_emu.reset(rawEmu);
 
-        (void)compressedData;
-        (void)compressedDataLength;
-        (void)uncompressedDataLength;
-    });
+    if(decompressorLength + StackSize > m_decompressor.size())
+        throw std::logic_error("the decompressor is too long");
+
+    m_decompressor[0] = 0xF4; // HLT, to stop the thing
 
+    map(m_emu.get(), 0x00000, m_decompressor);
+    map(m_emu.get(), 0x10000, m_inputBuffer);
+    map(m_emu.get(), 0x20000, m_outputBuffer);
+
+    memcpy(m_decompressor.data() + StackSize, decompressorCode, decompressorLength);
+
+    x86emu_set_seg_register(m_emu.get(), m_emu->x86.R_SS_SEL, 0);
+    m_emu->x86.R_SP = StackSize;
+
+    if(profile) {
+        m_samples.instructions.resize(decompressorLength);
+        x86emu_set_code_handler(m_emu.get(), codeHandler);
+    }
+}
+
+int CMEmulator::codeHandler(x86emu_t *emu) {
+    m_active->onInstruction((static_cast<uint32_t>(emu->x86.R_CS) << 4) + emu->x86.R_IP);
+
+    return 0;
+}
+
+void CMEmulator::onInstruction(uint32_t address) {
     /*
-     * Align to a paragraph boundary, because the decompressor is always
-     * paragraph-aligned.
+     * The HLT we return onto isn't the decompressor's.
      */
-    auto streamLength = data - begin;
-    if((streamLength % 16) != 0) {
-        get(data, limit, 16 - streamLength % 16);
-    }
+    if(address == 0)
+        return;
 
-    auto startOfDecompressor = data;
-    auto decompressorLength = limit - data;
+    m_blockInstructions++;
 
-    auto signature2 = get16(data, limit);
-    if(signature2 != CMSignature) {
-        throw std::logic_error("'CM' signature is not valid at the beginning of the decompressor");
+    if(address < StackSize || address - StackSize >= m_decompressorLength) {
+        m_samples.outside++;
+        m_hasPrevious = false;
+        return;
     }
 
-    auto decompressorEntry = get16(data, limit);
+    uint32_t offset = address - StackSize;
 
-    auto decompressorLengthParagraphs = get16(data, limit);
-    auto decompressorLengthBytes = 16 * decompressorLengthParagraphs;
+    m_samples.instructions[offset]++;
 
-    if(decompressorLengthBytes > decompressorLength)
-        throw std::logic_error("the decompressor is too long");
+    if(m_hasPrevious && offset <= m_previous)
+        m_samples.backEdges[{ m_previous, offset }]++;
 
-    decompressorLength = decompressorLengthBytes;
+    m_hasPrevious = true;
+    m_previous = offset;
+}
+
+void CMEmulator::decompressBlock(const CMBlock &block, unsigned char *output) {
+    auto emu = m_emu.get();
 
     /*
-     * Do all the necessary setup for the simulator where we are going to run
-     * the decompressor.
+     * Copy in the whole block.
      */
-    auto rawEmu = x86emu_new(0, 0);
-    if(rawEmu == nullptr)
-        throw std::bad_alloc();
 
-    X86EMUPointer emu(rawEmu);
+    auto compressedData = block.data;
+    auto compressedDataBegin = compressedData;
+    auto compressedDataLimit = compressedData + block.compressedLength;
+
+    memcpy(m_inputBuffer.data(), compressedData, compressedDataLimit - compressedData);
+
+    auto signature = get16(compressedData, compressedDataLimit);
+    if(signature != DSSignature)
+        throw std::logic_error("DS' signature is not valid at the beginning of a compressed block");
+
+    (void)get16(compressedData, compressedDataLimit); // appears to be unused
+
+    auto control = get16(compressedData, compressedDataLimit);
+
+    x86emu_set_seg_register(emu, emu->x86.R_CS_SEL, StackSize / 16);
+    emu->x86.R_IP = m_decompressorEntry;
+
+    x86emu_set_seg_register(emu, emu->x86.R_DS_SEL, 0x1000);
+    emu->x86.R_SI = compressedData - compressedDataBegin;
+
+    x86emu_set_seg_register(emu, emu->x86.R_ES_SEL, 0x2000);
+    emu->x86.R_DI = 0;
+
+    emu->x86.R_AX = control;
+    emu->x86.R_BX = 1;
+    emu->x86.R_CX = (block.uncompressedLength + 511) / 512;
+    emu->x86.R_DX = 0;
+
+    // Set up the stack for a far return onto our HLT instruction.
+    x86emu_write_word(emu, 0xFC, 0x0000);
+    x86emu_write_word(emu, 0xFE, 0x0000);
+    emu->x86.R_SP = 0xFC;
 
     /*
-     * Our simulated memory is set up as follows:
-     * (seg 0000): 0x00000 - 0x00100 - stack (256 bytes)
-     * (seg 0010): 0x00100 - 0x10000 - decompressor
-     * (seg 1000): 0x10000 - 0x20000 - input buffer
-     * (seg 2000): 0x20000 - 0x30000 - output buffer
+     * A corrupted stream can send the decompressor into an endless loop, so
+     * only let it run for so long.
      */
-    static constexpr size_t StackSize = 256;
-    std::vector<unsigned char> decompressor(65536);
-    std::vector<unsigned char> inputBuffer(65536);
-    std::vector<unsigned char> outputBuffer(65536);
+    unsigned int flags = 0;
+    if(m_instructionBudget != 0) {
+        emu->x86.R_TSC = 0;
+        emu->max_instr = m_instructionBudget;
+        flags |= X86EMU_RUN_MAX_INSTR;
+    }
 
-    if(decompressorLength + StackSize > decompressor.size())
-        throw std::logic_error("the decompressor is too long");
+    m_blockInstructions = 0;
+    m_hasPrevious = false;
+
+    m_active = this;
+    auto result = x86emu_run(emu, flags);
+    m_active = nullptr;
+
+    if(result & X86EMU_RUN_MAX_INSTR) {
+        std::stringstream error;
+        error << "the decompressor has run out of its budget of " << m_instructionBudget << " instructions on block "
+              << block.index;
+        throw std::logic_error(error.str());
+    }
+
+    if(!m_samples.instructions.empty()) {
+        m_profiledBlocks.push_back(CMProfile::Block{ block.index, block.compressedLength, block.uncompressedLength,
+                                                     m_blockInstructions });
+    }
+
+    if(result != 0 ||
+       emu->x86.R_CS != 0 ||
+       emu->x86.R_IP != 1) {
+        logMessage(LogLevel::Info, "CS %04X IP %04X stop %u", emu->x86.R_CS, emu->x86.R_IP, result);
+        throw std::logic_error("unexpected simulator halt");
+    }
+
+    if((emu->x86.R_FLG & FB_CF) != 0)
+        throw std::logic_error("the decompressor has failed");
+
+    if(emu->x86.R_SI < block.compressedLength)
+        throw std::logic_error("the decompressor didn't consume the expected amount of data");
+
+    if(emu->x86.R_DI != block.uncompressedLength)
+        throw std::logic_error("the decompressor didn't produce the expected amount of data");
+
+    memcpy(output, m_outputBuffer.data(), block.uncompressedLength);
+}
+
+static void nativeDecompressBlock(const CMBlock &block, unsigned char *output) {
+    auto compressedData = block.data;
+    auto compressedDataLimit = compressedData + block.compressedLength;
+
+    auto signature = get16(compressedData, compressedDataLimit);
+    if(signature != DSSignature)
+        throw std::logic_error("DS' signature is not valid at the beginning of a compressed block");
 
-    decompressor[0] = 0xF4; // HLT, to stop the thing
+    auto consumed = dsDecompressBlock(block.data + DSHeaderSize, block.compressedLength - DSHeaderSize,
+                                      output, block.uncompressedLength);
 
-    map(emu.get(), 0x00000, decompressor);
-    map(emu.get(), 0x10000, inputBuffer);
-    map(emu.get(), 0x20000, outputBuffer);
+    /*
+     * Like the emulated decompressor, have the block consumed whole: a
+     * misdecode can still happen to fill the output.
+     */
+    if(consumed != block.compressedLength - DSHeaderSize)
+        throw std::logic_error("'DS' block wasn't consumed exactly");
+}
+
+/*
+ * Every block is decoded from freshly set up state into its own buffers, so
+ * the blocks are independent: decode them concurrently, each straight into
+ * its precomputed place in the output.
+ */
+static void decompressBlocks(
+    const std::vector<CMBlock> &blocks,
+    unsigned char *output,
+    unsigned int workers,
+    const std::function<void(const CMBlock &block, unsigned char *output, unsigned int worker)> &decompressBlock) {
+
+    parallelFor(blocks.size(), workers, [&](size_t index, unsigned int worker) {
+        const auto &block = blocks[index];
+
+        decompressBlock(block, output + block.outputOffset, worker);
+    });
+}
+
+namespace {
+    struct CMStream {
+        std::vector<CMBlock> blocks;
+        size_t totalLength;
+
+        const unsigned char *decompressor;
+        size_t decompressorLength;
+        uint16_t decompressorEntry;
+    };
+}
 
-    memcpy(decompressor.data() + StackSize, startOfDecompressor, decompressorLength);
+static CMStream parseCMStream(const unsigned char *data, size_t size) {
+    CMStream stream;
 
-    x86emu_set_seg_register(emu.get(), emu->x86.R_SS_SEL, 0);
-    emu->x86.R_SP = StackSize;
+    auto begin = data;
+
+    auto limit = data + size;
+
+    auto signature = get16(data, limit);
+    if(signature != CMSignature) {
+        throw std::logic_error("'CM' signature is not valid at the beginning of the stream");
+    }
 
     /*
-     * Now, walk the blocks again, doing decompression.
+     * Walk the whole file to get to the decompressor, noting where the
+     * output of every block goes.
      */
 
-    std::vector<unsigned char> output;
+    stream.totalLength = 0;
 
-    data = startOfDataStream;
-    walkCompressedBlocks(data, limit, [&inputBuffer, &emu, decompressorEntry, &output, &outputBuffer](
+    walkCompressedBlocks(data, limit, [&stream](
         const unsigned char *compressedData,
         size_t compressedDataLength,
         size_t uncompressedDataLength) {
 
-        /*
-         * Copy in the whole block.
-         */
+        if(compressedDataLength < DSHeaderSize)
+            throw std::logic_error("compressed block is too short");
 
-        auto compressedDataBegin = compressedData;
-        auto compressedDataLimit = compressedData + compressedDataLength;
+        stream.blocks.emplace_back(CMBlock{ compressedData, compressedDataLength, uncompressedDataLength, stream.totalLength,
+                                            stream.blocks.size() });
 
-        memcpy(inputBuffer.data(), compressedData, compressedDataLimit - compressedData);
+        stream.totalLength += uncompressedDataLength;
+    });
+
+    /*
+     * Align to a paragraph boundary, because the decompressor is always
+     * paragraph-aligned.
+     */
+    auto streamLength = data - begin;
+    if((streamLength % 16) != 0) {
+        get(data, limit, 16 - streamLength % 16);
+    }
+
+    auto startOfDecompressor = data;
+    size_t decompressorLength = limit - data;
+
+    auto signature2 = get16(data, limit);
+    if(signature2 != CMSignature) {
+        throw std::logic_error("'CM' signature is not valid at the beginning of the decompressor");
+    }
 
-        auto signature = get16(compressedData, compressedDataLimit);
-        if(signature != 0x5344)
-            throw std::logic_error("DS' signature is not valid at the beginning of a compressed block");
+    auto decompressorEntry = get16(data, limit);
 
-        (void)get16(compressedData, compressedDataLimit); // appears to be unused
+    auto decompressorLengthParagraphs = get16(data, limit);
+    size_t decompressorLengthBytes = 16 * decompressorLengthParagraphs;
 
-        auto control = get16(compressedData, compressedDataLimit);
+    if(decompressorLengthBytes > decompressorLength)
+        throw std::logic_error("the decompressor is too long");
 
-        x86emu_set_seg_register(emu.get(), emu->x86.R_CS_SEL, StackSize / 16);
-        emu->x86.R_IP = decompressorEntry;
+    stream.decompressor = startOfDecompressor;
+    stream.decompressorLength = decompressorLengthBytes;
+    stream.decompressorEntry = decompressorEntry;
 
-        x86emu_set_seg_register(emu.get(), emu->x86.R_DS_SEL, 0x1000);
-        emu->x86.R_SI = compressedData - compressedDataBegin;
+    return stream;
+}
 
-        x86emu_set_seg_register(emu.get(), emu->x86.R_ES_SEL, 0x2000);
-        emu->x86.R_DI = 0;
+size_t cmDecompressedSize(const unsigned char *data, size_t size) {
+    return parseCMStream(data, size).totalLength;
+}
 
-        emu->x86.R_AX = control;
-        emu->x86.R_BX = 1;
-        emu->x86.R_CX = (uncompressedDataLength + 511) / 512;
-        emu->x86.R_DX = 0;
+void cmDecompress(const unsigned char *data, size_t size,
+                  unsigned char *output, size_t outputSize,
+                  const CMDecompressionOptions &options) {
+    auto stream = parseCMStream(data, size);
 
-        // Set up the stack for a far return onto our HLT instruction.
-        x86emu_write_word(emu.get(), 0xFC, 0x0000);
-        x86emu_write_word(emu.get(), 0xFE, 0x0000);
-        emu->x86.R_SP = 0xFC;
+    if(outputSize != stream.totalLength)
+        throw std::logic_error("the output buffer doesn't match the decompressed length");
 
-        auto result = x86emu_run(emu.get(), 0);
+    auto workers = parallelWorkerCount(options.threads, stream.blocks.size());
 
-        if(result != 0 ||
-           emu->x86.R_CS != 0 ||
-           emu->x86.R_IP != 1) {
-            printf("CS %04X IP %04X stop %u\n", emu->x86.R_CS, emu->x86.R_IP, result);
-            throw std::logic_error("unexpected simulator halt");
+    auto emulated = [&](unsigned char *output) {
+        /*
+         * One emulator instance, with its own decompressor, input and output
+         * pages, per worker.
+         */
+        std::vector<std::unique_ptr<CMEmulator>> emulators(workers);
+
+        decompressBlocks(stream.blocks, output, workers, [&](const CMBlock &block, unsigned char *output, unsigned int worker) {
+            auto &emulator = emulators[worker];
+            if(!emulator) {
+                emulator = std::make_unique<CMEmulator>(stream.decompressor, stream.decompressorLength, stream.decompressorEntry,
+                                                        options.instructionBudget, options.profile != nullptr);
+            }
+
+            emulator->decompressBlock(block, output);
+        });
+
+        if(options.profile) {
+            for(const auto &emulator: emulators) {
+                if(emulator)
+                    options.profile->add(emulator->samples(), emulator->profiledBlocks());
+            }
         }
+    };
 
-        if((emu->x86.R_FLG & FB_CF) != 0)
-            throw std::logic_error("the decompressor has failed");
+    auto native = [&](unsigned char *output) {
+        decompressBlocks(stream.blocks, output, workers, [](const CMBlock &block, unsigned char *output, unsigned int worker) {
+            (void)worker;
 
-        if(emu->x86.R_SI < compressedDataLength)
-            throw std::logic_error("the decompressor didn't consume the expected amount of data");
+            nativeDecompressBlock(block, output);
+        });
+    };
 
-        if(emu->x86.R_DI != uncompressedDataLength)
-            throw std::logic_error("the decompressor didn't produce the expected amount of data");
+    switch(options.engine) {
+        case CMEngine::Native:
+            try {
+                native(output);
+            } catch(const std::logic_error &e) {
+                logMessage(LogLevel::Info, "The native 'DS' decoder has failed (%s), falling back to the emulator.", e.what());
 
-        output.insert(output.end(), outputBuffer.begin(), outputBuffer.begin() + uncompressedDataLength);
-    });
+                emulated(output);
+            }
+            break;
+
+        case CMEngine::Emulated:
+            emulated(output);
+            break;
 
+        case CMEngine::Verify:
+        {
+            std::vector<unsigned char> reference(outputSize);
+            emulated(reference.data());
+            native(output);
+
+            auto mismatch = std::mismatch(output, output + outputSize, reference.begin());
+            if(mismatch.first != output + outputSize) {
+                std::stringstream error;
+                error << "the native and the emulated 'CM' decompressors disagree at offset "
+                      << (mismatch.first - output);
+                throw std::logic_error(error.str());
+            }
+
+            logMessage(LogLevel::Info, "The native and the emulated 'CM' decompressors agree on %zu bytes.", outputSize);
+            break;
+        }
 
-    return output;
+        default:
+            throw std::logic_error("unexpected CM engine");
+    }
 }
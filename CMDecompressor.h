@@ -2,9 +2,76 @@
 #define CM_DECOMPRESSOR_H
 
 #include <vector>
+#include <cstdint>
 #include <cstring>
 
+enum class CMEngine {
+    /*
+     * Decode the 'DS' blocks natively, falling back to the emulator if the
+     * native decoder rejects the stream.
+     */
+    Native,
+
+    /*
+     * Run the decompressor embedded in the image under libx86emu.
+     */
+    Emulated,
+
+    /*
+     * Decode with both engines and fail unless they produce identical output.
+     */
+    Verify
+};
+
+class CMProfile;
+
+/*
+ * Far more than the embedded decompressor needs for the largest block, so
+ * only a corrupted stream that makes it spin runs into it.
+ */
+static constexpr uint64_t DefaultCMInstructionBudget = 100000000;
+
+struct CMDecompressionOptions {
+    /*
+     * The decompressor of the image itself is what decides what it boots, so
+     * it's the reference; the native decoder is only a faster rendition of
+     * it, to opt into.
+     */
+    CMEngine engine = CMEngine::Emulated;
+
+    /*
+     * Number of threads to decode the blocks on, zero meaning one per CPU.
+     */
+    unsigned int threads = 0;
+
+    /*
+     * Instructions the emulated decompressor may execute on a block before
+     * it's considered stuck, zero meaning no limit.
+     */
+    uint64_t instructionBudget = DefaultCMInstructionBudget;
+
+    /*
+     * If not null, every instruction the emulated decompressor executes is
+     * accounted for in the profile, at a cost in speed.
+     */
+    CMProfile *profile = nullptr;
+};
+
 bool isCMCompressed(const unsigned char *data, size_t size);
-std::vector<unsigned char> cmDecompress(const unsigned char *data, size_t size);
+
+/*
+ * Returns the length the 'CM' stream decompresses to, as recorded in its block
+ * headers, without decompressing anything.
+ */
+size_t cmDecompressedSize(const unsigned char *data, size_t size);
+
+/*
+ * Decompresses the 'CM' stream into 'output', which must be exactly
+ * cmDecompressedSize() bytes long. Every block is decoded directly at its
+ * final offset.
+ */
+void cmDecompress(const unsigned char *data, size_t size,
+                  unsigned char *output, size_t outputSize,
+                  const CMDecompressionOptions &options = CMDecompressionOptions());
 
 #endif
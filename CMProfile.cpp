@@ -0,0 +1,131 @@
+#include "CMProfile.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <numeric>
+
+namespace {
+    uint64_t sum(const std::vector<uint64_t> &instructions, size_t begin, size_t end) {
+        end = std::min(end, instructions.size());
+        if(begin >= end)
+            return 0;
+
+        return std::accumulate(instructions.begin() + begin, instructions.begin() + end, uint64_t(0));
+    }
+
+    std::vector<CMProfile::Loop> findHottestLoops(const CMProfile::Samples &samples, size_t count) {
+        std::vector<CMProfile::Loop> loops;
+
+        for(const auto &[edge, iterations]: samples.backEdges) {
+            CMProfile::Loop loop;
+            loop.start = edge.second;
+            loop.end = edge.first;
+            loop.iterations = iterations;
+            loop.instructions = sum(samples.instructions, loop.start, size_t(loop.end) + 1);
+
+            loops.push_back(loop);
+        }
+
+        std::sort(loops.begin(), loops.end(), [](const CMProfile::Loop &a, const CMProfile::Loop &b) {
+            return a.instructions > b.instructions;
+        });
+
+        if(loops.size() > count)
+            loops.resize(count);
+
+        return loops;
+    }
+
+    double percentage(uint64_t part, uint64_t total) {
+        return total == 0 ? 0 : 100.0 * part / total;
+    }
+}
+
+void CMProfile::add(const Samples &samples, const std::vector<Block> &blocks) {
+    std::unique_lock<std::mutex> locker(m_mutex);
+
+    if(m_samples.instructions.size() < samples.instructions.size())
+        m_samples.instructions.resize(samples.instructions.size());
+
+    for(size_t offset = 0; offset < samples.instructions.size(); offset++) {
+        m_samples.instructions[offset] += samples.instructions[offset];
+    }
+
+    for(const auto &[edge, iterations]: samples.backEdges) {
+        m_samples.backEdges[edge] += iterations;
+    }
+
+    m_samples.outside += samples.outside;
+
+    m_blocks.insert(m_blocks.end(), blocks.begin(), blocks.end());
+}
+
+uint64_t CMProfile::totalInstructions() const {
+    std::unique_lock<std::mutex> locker(m_mutex);
+
+    return sum(m_samples.instructions, 0, m_samples.instructions.size()) + m_samples.outside;
+}
+
+std::vector<CMProfile::Loop> CMProfile::hottestLoops(size_t count) const {
+    std::unique_lock<std::mutex> locker(m_mutex);
+
+    return findHottestLoops(m_samples, count);
+}
+
+void CMProfile::write(std::ostream &stream, size_t top) const {
+    auto total = totalInstructions();
+
+    std::unique_lock<std::mutex> locker(m_mutex);
+
+    char line[160];
+
+    snprintf(line, sizeof(line), "'CM' decompressor profile: %zu blocks, %llu instructions\n",
+             m_blocks.size(), static_cast<unsigned long long>(total));
+    stream << line;
+
+    stream << "\nInstructions per block:\n";
+
+    for(const auto &block: m_blocks) {
+        snprintf(line, sizeof(line), "  block %3zu: %6zu -> %6zu bytes, %12llu instructions, %8.1f per byte\n",
+                 block.index, block.compressedSize, block.size, static_cast<unsigned long long>(block.instructions),
+                 block.size == 0 ? 0.0 : static_cast<double>(block.instructions) / block.size);
+        stream << line;
+    }
+
+    stream << "\nHottest loops (decompressor offsets):\n";
+
+    for(const auto &loop: findHottestLoops(m_samples, top)) {
+        snprintf(line, sizeof(line), "  %04X-%04X: %12llu iterations, %12llu instructions (%5.1f%%)\n",
+                 loop.start, loop.end, static_cast<unsigned long long>(loop.iterations),
+                 static_cast<unsigned long long>(loop.instructions), percentage(loop.instructions, total));
+        stream << line;
+    }
+
+    stream << "\nHottest instructions (decompressor offsets):\n";
+
+    std::vector<uint32_t> offsets;
+    for(uint32_t offset = 0; offset < m_samples.instructions.size(); offset++) {
+        if(m_samples.instructions[offset] != 0)
+            offsets.push_back(offset);
+    }
+
+    std::sort(offsets.begin(), offsets.end(), [this](uint32_t a, uint32_t b) {
+        return m_samples.instructions[a] > m_samples.instructions[b];
+    });
+
+    if(offsets.size() > top)
+        offsets.resize(top);
+
+    for(auto offset: offsets) {
+        snprintf(line, sizeof(line), "  %04X: %12llu (%5.1f%%)\n",
+                 offset, static_cast<unsigned long long>(m_samples.instructions[offset]),
+                 percentage(m_samples.instructions[offset], total));
+        stream << line;
+    }
+
+    if(m_samples.outside != 0) {
+        snprintf(line, sizeof(line), "  outside of the decompressor: %llu (%.1f%%)\n",
+                 static_cast<unsigned long long>(m_samples.outside), percentage(m_samples.outside, total));
+        stream << line;
+    }
+}
@@ -0,0 +1,83 @@
+#ifndef CM_PROFILE_H
+#define CM_PROFILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+/*
+ * What the emulated 'CM' decompressor spent its instructions on, collected
+ * over any number of blocks and images. Addresses are offsets into the
+ * decompressor embedded in the image, counting from its 'CM' header.
+ */
+class CMProfile {
+public:
+    /*
+     * The profile of the blocks one emulator has decompressed.
+     */
+    struct Samples {
+        /*
+         * Instructions executed at every offset.
+         */
+        std::vector<uint64_t> instructions;
+
+        /*
+         * Backward transfers of control, from the offset of the branch to its
+         * target, and how many times they were taken: the loops.
+         */
+        std::map<std::pair<uint32_t, uint32_t>, uint64_t> backEdges;
+
+        /*
+         * Instructions executed outside of the decompressor.
+         */
+        uint64_t outside = 0;
+    };
+
+    struct Block {
+        size_t index;   // In its stream
+        size_t compressedSize;
+        size_t size;
+        uint64_t instructions;
+    };
+
+    struct Loop {
+        uint32_t start;     // The target of the backward branch
+        uint32_t end;       // The branch
+        uint64_t iterations;
+
+        /*
+         * Executed in [start, end], including any nested loops.
+         */
+        uint64_t instructions;
+    };
+
+    /*
+     * Adds the samples and the blocks of one decompression; may be called
+     * from several threads.
+     */
+    void add(const Samples &samples, const std::vector<Block> &blocks);
+
+    uint64_t totalInstructions() const;
+
+    /*
+     * The loops that executed the most instructions, most first.
+     */
+    std::vector<Loop> hottestLoops(size_t count) const;
+
+    /*
+     * Writes a report of the instructions per block, the hottest loops and
+     * the hottest instructions.
+     */
+    void write(std::ostream &stream, size_t top = 20) const;
+
+private:
+    mutable std::mutex m_mutex;
+    Samples m_samples;
+    std::vector<Block> m_blocks;
+};
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef COMPRESSION_OPTIONS_H
+#define COMPRESSION_OPTIONS_H
+
+#include <cstddef>
+#include <string>
+
+/*
+ * The LZ4 decoder embedded into MSLOAD to unpack the payload at boot.
+ */
+enum class LZ4Decoder {
+    Small,  // lz4_decompress_small, with the LZ4_8088 banner
+    Fast    // lz4_decompress_fast: word-wide copies, fast single-byte runs
+};
+
+/*
+ * How the LZ4 codec breaks the payload down into sequences.
+ */
+enum class LZ4Parser {
+    HC,         // LZ4HC at the maximum level: the smallest stream
+    DecodeCost  // Our own optimal parser, trading size for the cycles of the decoder
+};
+
+/*
+ * How the payload codec is chosen for every image.
+ */
+enum class CodecSelection {
+    Fixed,      // CompressionOptions::codec
+    Smallest,   // Whichever codec produces the smallest output
+    Cheapest    // Whichever codec is estimated to unpack the fastest at boot
+};
+
+/*
+ * How the LZ4 level and the block size are chosen for every image.
+ */
+enum class CompressionPolicy {
+    Fixed,      // CompressionOptions::level and blockSize
+    Smallest,   // The smallest stream
+    Boot,       // The least estimated cycles to unpack, plus byteCost per byte of the stream
+    Fastest,    // The least time to compress
+    Balanced    // The best compromise between the three
+};
+
+struct CompressionOptions {
+    /*
+     * Number of threads to compress the blocks on, zero meaning one per CPU.
+     * The output doesn't depend on this.
+     */
+    unsigned int threads = 0;
+
+    /*
+     * Emit linked blocks, which may refer back to the previous 32 KiB of the
+     * payload, instead of independent ones. Needs the linked variant of the
+     * MSLOAD extension, which the image then gets.
+     */
+    bool linkedBlocks = false;
+
+    /*
+     * Lay the stream out to be unpacked in place, from the top of the payload
+     * down, rather than moved out of the way of the output first. Only the LZ4
+     * codec supports it, with independent blocks and its own decoder.
+     */
+    bool inPlace = false;
+
+    /*
+     * Only used by the LZ4 codec.
+     */
+    LZ4Decoder decoder = LZ4Decoder::Small;
+    LZ4Parser parser = LZ4Parser::HC;
+
+    /*
+     * With LZ4Parser::DecodeCost, how many 8088 cycles of unpacking one byte
+     * of the stream is worth: the parser minimizes the estimated cycles plus
+     * this much per byte. The larger, the closer to the smallest stream.
+     */
+    unsigned int byteCost = DefaultByteCost;
+
+    /*
+     * Roughly what reading a byte from a hard disk and moving it out of the
+     * way of the output takes on a 4.77 MHz PC.
+     */
+    static constexpr unsigned int DefaultByteCost = 64;
+
+    /*
+     * The LZ4HC level, with LZ4Parser::HC.
+     */
+    int level = MaxLevel;
+
+    static constexpr int MinLevel = 1;
+    static constexpr int MaxLevel = 12; // LZ4HC_CLEVEL_MAX
+
+    /*
+     * The length of the independent blocks, zero meaning the longest the
+     * extensions support. Linked blocks always have the same length.
+     */
+    size_t blockSize = 0;
+
+    /*
+     * Unless Fixed, every image is compressed with a grid of levels and block
+     * sizes first (see CompressionSearch.h), and then with the one the policy
+     * picks.
+     */
+    CompressionPolicy policy = CompressionPolicy::Fixed;
+
+    CodecSelection codecSelection = CodecSelection::Fixed;
+    std::string codec = "lz4";
+};
+
+#endif
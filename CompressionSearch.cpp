@@ -0,0 +1,261 @@
+#include "CompressionSearch.h"
+#include "ParallelFor.h"
+#include "PayloadCodec.h"
+#include "Statistics.h"
+#include "WinbootError.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+
+namespace {
+    /*
+     * From LZ4HC's fastest hash chain level, through its default, to its
+     * optimal parsers.
+     */
+    static const int searchedLevels[] { 1, 3, 6, 9, 10, 11, 12 };
+
+    static const size_t searchedBlockSizes[] {
+        4 * 1024, 8 * 1024, 16 * 1024, 32 * 1024, PayloadCodec::MaxBlockSize
+    };
+
+    bool dominates(const CompressionTrial &a, const CompressionTrial &b) {
+        bool noWorse = a.size <= b.size && a.cpuSeconds <= b.cpuSeconds && a.decodeCycles <= b.decodeCycles;
+        bool better = a.size < b.size || a.cpuSeconds < b.cpuSeconds || a.decodeCycles < b.decodeCycles;
+
+        return noWorse && better;
+    }
+
+    double bootCost(const CompressionTrial &trial, const CompressionOptions &options) {
+        return static_cast<double>(trial.decodeCycles) + static_cast<double>(options.byteCost) * trial.size;
+    }
+
+    /*
+     * The trial on the front closest to the ideal one, with every objective
+     * scaled to its range over the front.
+     */
+    const CompressionTrial &balancedTrial(const std::vector<CompressionTrial> &trials) {
+        double minimum[3] = {
+            std::numeric_limits<double>::max(), std::numeric_limits<double>::max(), std::numeric_limits<double>::max()
+        };
+        double maximum[3] = { 0, 0, 0 };
+
+        auto objectives = [](const CompressionTrial &trial, double *values) {
+            values[0] = static_cast<double>(trial.size);
+            values[1] = trial.cpuSeconds;
+            values[2] = static_cast<double>(trial.decodeCycles);
+        };
+
+        for(const auto &trial: trials) {
+            if(!trial.paretoOptimal)
+                continue;
+
+            double values[3];
+            objectives(trial, values);
+
+            for(int objective = 0; objective < 3; objective++) {
+                minimum[objective] = std::min(minimum[objective], values[objective]);
+                maximum[objective] = std::max(maximum[objective], values[objective]);
+            }
+        }
+
+        const CompressionTrial *best = nullptr;
+        double bestDistance = std::numeric_limits<double>::max();
+
+        for(const auto &trial: trials) {
+            if(!trial.paretoOptimal)
+                continue;
+
+            double values[3];
+            objectives(trial, values);
+
+            double distance = 0;
+            for(int objective = 0; objective < 3; objective++) {
+                auto range = maximum[objective] - minimum[objective];
+                if(range > 0) {
+                    auto scaled = (values[objective] - minimum[objective]) / range;
+                    distance += scaled * scaled;
+                }
+            }
+
+            if(distance < bestDistance) {
+                best = &trial;
+                bestDistance = distance;
+            }
+        }
+
+        return *best;
+    }
+}
+
+std::vector<CompressionTrial> searchCompression(const PayloadCodec &codec, const unsigned char *payload,
+                                                size_t payloadSize, const CompressionOptions &options) {
+    std::vector<int> levels;
+    if(codec.hasLevels(options)) {
+        levels.assign(std::begin(searchedLevels), std::end(searchedLevels));
+    } else {
+        levels.push_back(options.level);
+    }
+
+    std::vector<size_t> blockSizes;
+    if(options.linkedBlocks) {
+        blockSizes.push_back(0);
+    } else {
+        blockSizes.assign(std::begin(searchedBlockSizes), std::end(searchedBlockSizes));
+    }
+
+    std::vector<CompressionTrial> grid;
+    for(auto level: levels) {
+        for(auto blockSize: blockSizes) {
+            CompressionTrial trial;
+            trial.level = level;
+            trial.blockSize = blockSize;
+            grid.push_back(trial);
+        }
+    }
+
+    std::vector<std::optional<CompressionTrial>> outcomes(grid.size());
+
+    parallelFor(grid.size(), parallelWorkerCount(options.threads, grid.size()), [&](size_t index, unsigned int) {
+        auto trialOptions = options;
+        trialOptions.level = grid[index].level;
+        trialOptions.blockSize = grid[index].blockSize;
+        trialOptions.policy = CompressionPolicy::Fixed;
+        trialOptions.threads = 1;
+
+        Stopwatch stopwatch;
+
+        EncodedPayload encoded;
+
+        try {
+            encoded = codec.encode(payload, payloadSize, trialOptions);
+        } catch(const WinbootError &e) {
+            if(e.code() != WinbootErrorCode::DoesNotFit)
+                throw;
+
+            return;
+        }
+
+        if(encoded.stream.size() > payloadSize)
+            return;
+
+        auto trial = grid[index];
+        trial.size = encoded.stream.size();
+        trial.cpuSeconds = stopwatch.elapsed().cpuSeconds;
+        trial.decodeCycles = encoded.decodeCycles;
+        outcomes[index] = trial;
+    });
+
+    std::vector<CompressionTrial> trials;
+    for(const auto &outcome: outcomes) {
+        if(outcome)
+            trials.push_back(*outcome);
+    }
+
+    for(auto &trial: trials) {
+        trial.paretoOptimal = std::none_of(trials.begin(), trials.end(), [&](const CompressionTrial &other) {
+            return dominates(other, trial);
+        });
+    }
+
+    return trials;
+}
+
+const CompressionTrial &chooseTrial(const std::vector<CompressionTrial> &trials, const CompressionOptions &options) {
+    if(trials.empty())
+        throw std::logic_error("chooseTrial: no trials to choose from");
+
+    /*
+     * Ties go to the smaller stream, and then to the cheaper one to unpack.
+     */
+    auto by = [&](auto key) {
+        return std::min_element(trials.begin(), trials.end(), [&](const CompressionTrial &a, const CompressionTrial &b) {
+            auto keyA = key(a);
+            auto keyB = key(b);
+            if(keyA != keyB)
+                return keyA < keyB;
+
+            if(a.size != b.size)
+                return a.size < b.size;
+
+            return a.decodeCycles < b.decodeCycles;
+        });
+    };
+
+    switch(options.policy) {
+        case CompressionPolicy::Smallest:
+            return *by([](const CompressionTrial &trial) { return static_cast<double>(trial.size); });
+
+        case CompressionPolicy::Boot:
+            return *by([&](const CompressionTrial &trial) { return bootCost(trial, options); });
+
+        case CompressionPolicy::Fastest:
+            return *by([](const CompressionTrial &trial) { return trial.cpuSeconds; });
+
+        case CompressionPolicy::Balanced:
+            return balancedTrial(trials);
+
+        default:
+            throw std::logic_error("chooseTrial: no policy to choose by");
+    }
+}
+
+const char *policyName(CompressionPolicy policy) {
+    switch(policy) {
+        case CompressionPolicy::Smallest:
+            return "smallest";
+
+        case CompressionPolicy::Boot:
+            return "boot";
+
+        case CompressionPolicy::Fastest:
+            return "fastest";
+
+        case CompressionPolicy::Balanced:
+            return "balanced";
+
+        default:
+            return "fixed";
+    }
+}
+
+void writeSearchReport(std::ostream &stream, const std::vector<CompressionTrial> &trials,
+                       const CompressionOptions &options) {
+    char line[160];
+
+    snprintf(line, sizeof(line), "%5s %10s %10s %12s %15s %15s\n",
+             "level", "block size", "bytes", "compress ms", "unpack Mcycles", "boot Mcycles");
+    stream << line;
+
+    for(const auto &trial: trials) {
+        char blockSize[24];
+        if(trial.blockSize == 0) {
+            snprintf(blockSize, sizeof(blockSize), "linked");
+        } else {
+            snprintf(blockSize, sizeof(blockSize), "%zu", trial.blockSize);
+        }
+
+        snprintf(line, sizeof(line), "%5d %10s %10zu %12.2f %15.3f %15.3f %s\n",
+                 trial.level, blockSize, trial.size, trial.cpuSeconds * 1e3, trial.decodeCycles / 1e6,
+                 bootCost(trial, options) / 1e6, trial.paretoOptimal ? "*" : "");
+        stream << line;
+    }
+
+    snprintf(line, sizeof(line), "\n* Pareto-optimal in size, compression time and unpacking cycles.\n"
+             "Boot cycles add %u cycles per byte of the stream (--byte-cost).\n", options.byteCost);
+    stream << line;
+
+    if(options.policy != CompressionPolicy::Fixed && !trials.empty()) {
+        const auto &chosen = chooseTrial(trials, options);
+
+        if(chosen.blockSize == 0) {
+            snprintf(line, sizeof(line), "--policy=%s picks level %d.\n", policyName(options.policy), chosen.level);
+        } else {
+            snprintf(line, sizeof(line), "--policy=%s picks level %d, block size %zu.\n",
+                     policyName(options.policy), chosen.level, chosen.blockSize);
+        }
+        stream << line;
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef COMPRESSION_SEARCH_H
+#define COMPRESSION_SEARCH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+#include "CompressionOptions.h"
+
+class PayloadCodec;
+
+/*
+ * The outcome of compressing a payload with one level and block size.
+ */
+struct CompressionTrial {
+    int level;
+    size_t blockSize;
+
+    size_t size;            // Of the stream
+    double cpuSeconds;      // Taken to compress it, on one thread
+    uint64_t decodeCycles;  // Estimated to unpack it at boot
+
+    /*
+     * Whether no other trial is at least as good in all three, and better
+     * in one of them.
+     */
+    bool paretoOptimal = false;
+};
+
+/*
+ * Compresses the payload with every combination of a grid of LZ4 levels and
+ * block sizes, on options.threads threads. Every trial runs on a single
+ * thread, so that it's timed on its own. The level axis is only searched if
+ * the codec has levels, and the block size axis only for independent
+ * blocks; otherwise, the options give the only value. Trials whose stream
+ * doesn't fit in place of the payload are left out. The Pareto front is
+ * marked.
+ */
+std::vector<CompressionTrial> searchCompression(const PayloadCodec &codec, const unsigned char *payload,
+                                                size_t payloadSize, const CompressionOptions &options);
+
+/*
+ * Returns the trial options.policy prefers; 'trials' must not be empty. The
+ * Fastest and Balanced policies depend on timing, so their choice may vary
+ * from run to run.
+ */
+const CompressionTrial &chooseTrial(const std::vector<CompressionTrial> &trials, const CompressionOptions &options);
+
+const char *policyName(CompressionPolicy policy);
+
+/*
+ * Writes a table of the trials, marking the Pareto front, and the choice of
+ * the policy, if there is one.
+ */
+void writeSearchReport(std::ostream &stream, const std::vector<CompressionTrial> &trials,
+                       const CompressionOptions &options);
+
+#endif
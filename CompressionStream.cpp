@@ -2,39 +2,40 @@
 
 #include <stdexcept>
 
-CompressionStream::CompressionStream() : m_size(0) {
+StreamBuffer::StreamBuffer() : m_size(0) {
 
 }
 
-CompressionStream::~CompressionStream() = default;
+StreamBuffer::StreamBuffer(std::unique_ptr<unsigned char[]> &&data, size_t size) : m_data(std::move(data)), m_size(size) {
 
-size_t CompressionStream::reservedSize() const {
-    return m_data.size() - m_size;
 }
 
-void CompressionStream::reserveOutputBytes(size_t size) {
-    if(reservedSize() < size) {
-        m_data.resize(m_size + size);
-    }
+CompressionStream::CompressionStream(size_t capacity) :
+    m_data(std::make_unique_for_overwrite<unsigned char[]>(capacity)), m_capacity(capacity), m_size(0) {
+
 }
 
-size_t CompressionStream::getAvailableArea(unsigned char *&data) {
-    data = m_data.data() + m_size;
+CompressionStream::~CompressionStream() = default;
+
+unsigned char *CompressionStream::reserveOutputBytes(size_t size) {
+    if(size > m_capacity - m_size)
+        throw std::logic_error("CompressionStream::reserveOutputBytes: the stream exceeds its bound");
 
-    return m_data.size() - m_size;
+    return m_data.get() + m_size;
 }
 
 void CompressionStream::advanceOutputPointer(size_t size) {
-    if(size > reservedSize())
+    if(size > m_capacity - m_size)
         throw std::logic_error("CompressionStream::advanceOutputPointer: overrun");
 
     m_size += size;
 }
 
-std::vector<unsigned char> &&CompressionStream::finish() {
-    m_data.resize(m_size);
-    m_data.shrink_to_fit();
+StreamBuffer CompressionStream::finish() {
+    auto size = m_size;
 
-    return std::move(m_data);
-}
+    m_capacity = 0;
+    m_size = 0;
 
+    return StreamBuffer(std::move(m_data), size);
+}
@@ -1,28 +1,82 @@
 #ifndef COMPRESSION_STREAM_H
 #define COMPRESSION_STREAM_H
 
-#include <vector>
+#include <memory>
 #include <cstring>
 
+/*
+ * A compressed stream, handed over by CompressionStream::finish() without
+ * copying. The buffer may extend past size(), up to the bound it was
+ * allocated for.
+ */
+class StreamBuffer {
+public:
+    StreamBuffer();
+    StreamBuffer(std::unique_ptr<unsigned char[]> &&data, size_t size);
+
+    inline unsigned char *data() {
+        return m_data.get();
+    }
+
+    inline const unsigned char *data() const {
+        return m_data.get();
+    }
+
+    inline size_t size() const {
+        return m_size;
+    }
+
+    inline bool empty() const {
+        return m_size == 0;
+    }
+
+private:
+    std::unique_ptr<unsigned char[]> m_data;
+    size_t m_size;
+};
+
+/*
+ * Writes a stream into a buffer allocated once, for a bound on its length
+ * known up front, and never cleared: every byte up to the output pointer is
+ * written before it's advanced past it. Running past the bound is a bug, not
+ * a reason to grow.
+ */
 class CompressionStream {
 public:
-    CompressionStream();
+    explicit CompressionStream(size_t capacity);
     ~CompressionStream();
 
     CompressionStream(const CompressionStream &other) = delete;
     CompressionStream &operator =(const CompressionStream &other) = delete;
 
-    void reserveOutputBytes(size_t size);
-
-    size_t getAvailableArea(unsigned char *&data);
+    /*
+     * Returns where the next 'size' bytes go, which the caller fills in and
+     * then passes with advanceOutputPointer().
+     */
+    unsigned char *reserveOutputBytes(size_t size);
     void advanceOutputPointer(size_t size);
 
-    std::vector<unsigned char> &&finish();
+    /*
+     * The whole buffer, for producers that write ahead of the output pointer
+     * and move their output down into place later.
+     */
+    inline unsigned char *buffer() {
+        return m_data.get();
+    }
 
-private:
-    size_t reservedSize() const;
+    inline size_t capacity() const {
+        return m_capacity;
+    }
 
-    std::vector<unsigned char> m_data;
+    inline size_t size() const {
+        return m_size;
+    }
+
+    StreamBuffer finish();
+
+private:
+    std::unique_ptr<unsigned char[]> m_data;
+    size_t m_capacity;
     size_t m_size;
 };
 
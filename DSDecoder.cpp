@@ -0,0 +1,135 @@
+#include "DSDecoder.h"
+
+#include <cstdint>
+#include <stdexcept>
+
+/*
+ * The 'DS' bitstream is the DriveSpace (MRCI-style) LZ77 encoding. Bits are
+ * consumed least significant first. Every token starts with a two-bit
+ * selector:
+ *
+ *   00  match, 6-bit offset (1 - 63)
+ *   01  literal 0x00 - 0x7F, 7 bits follow
+ *   10  literal 0x80 - 0xFF, 7 bits follow
+ *   11  match; one more bit selects an 8-bit offset biased by 64, or a 12-bit
+ *       offset biased by 320. The 12-bit offset 0xFFF is not a match, but a
+ *       marker that ends every 512-byte sector of output.
+ *
+ * A match offset is followed by the match length: N zero bits terminated by
+ * a one bit, then N more bits, giving a length of 2^N + 1 + value.
+ */
+
+namespace {
+
+    class BitReader {
+    public:
+        BitReader(const unsigned char *data, size_t size) : m_data(data), m_size(size), m_position(0), m_buffer(0), m_bits(0) {
+
+        }
+
+        unsigned int get(unsigned int bits) {
+            while(m_bits < bits) {
+                if(m_position >= m_size)
+                    throw std::logic_error("'DS' bitstream overrun");
+
+                m_buffer |= static_cast<uint32_t>(m_data[m_position++]) << m_bits;
+                m_bits += 8;
+            }
+
+            auto value = m_buffer & ((1U << bits) - 1);
+            m_buffer >>= bits;
+            m_bits -= bits;
+
+            return value;
+        }
+
+        size_t consumedBytes() const {
+            return m_position;
+        }
+
+    private:
+        const unsigned char *m_data;
+        size_t m_size;
+        size_t m_position;
+        uint32_t m_buffer;
+        unsigned int m_bits;
+    };
+
+    static constexpr size_t SectorSize = 512;
+    static constexpr unsigned int SectorMarker = 0xFFF + 320;
+    static constexpr unsigned int MaxLengthBits = 9;
+}
+
+size_t dsDecompressBlock(const unsigned char *data, size_t size,
+                         unsigned char *output, size_t outputSize) {
+    BitReader reader(data, size);
+
+    size_t produced = 0;
+
+    while(produced < outputSize) {
+        unsigned int offset;
+
+        switch(reader.get(2)) {
+            case 1:
+                output[produced++] = reader.get(7);
+                continue;
+
+            case 2:
+                output[produced++] = 0x80 | reader.get(7);
+                continue;
+
+            case 0:
+                offset = reader.get(6);
+                break;
+
+            default:
+                if(reader.get(1) == 0) {
+                    offset = reader.get(8) + 64;
+                } else {
+                    offset = reader.get(12) + 320;
+                }
+                break;
+        }
+
+        if(offset == SectorMarker) {
+            if(produced == 0 || produced % SectorSize != 0)
+                throw std::logic_error("'DS' sector marker is not at a sector boundary");
+
+            continue;
+        }
+
+        unsigned int lengthBits = 0;
+        while(reader.get(1) == 0) {
+            if(++lengthBits > MaxLengthBits)
+                throw std::logic_error("'DS' match length is too long");
+        }
+
+        size_t length = (1U << lengthBits) + 1 + reader.get(lengthBits);
+
+        if(offset == 0 || offset > produced)
+            throw std::logic_error("'DS' match offset points before the beginning of the block");
+
+        if(length > outputSize - produced)
+            throw std::logic_error("'DS' match overruns the block");
+
+        /*
+         * Matches may overlap their own output, so copy byte by byte.
+         */
+        auto source = output + produced - offset;
+        for(size_t index = 0; index < length; index++) {
+            output[produced + index] = source[index];
+        }
+
+        produced += length;
+    }
+
+    /*
+     * The last sector has its marker too, if the block ends with a whole one.
+     */
+    if(produced % SectorSize == 0) {
+        if(reader.get(2) != 3 || reader.get(1) != 1 || reader.get(12) + 320 != SectorMarker)
+            throw std::logic_error("'DS' block doesn't end with a sector marker");
+    }
+
+    return reader.consumedBytes();
+}
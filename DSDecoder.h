@@ -0,0 +1,18 @@
+#ifndef DS_DECODER_H
+#define DS_DECODER_H
+
+#include <cstddef>
+
+/*
+ * Native decoder for the 'DS' blocks of a 'CM'-compressed MS-DOS 8 payload.
+ *
+ * 'data' points to the block bitstream, just past the 6-byte block header
+ * ('DS' signature, an unused word and the control word). Exactly
+ * 'outputSize' bytes are produced into 'output'. Throws std::logic_error
+ * if the stream is malformed. Returns the number of input bytes consumed,
+ * including the marker that ends the last sector, if the block ends with one.
+ */
+size_t dsDecompressBlock(const unsigned char *data, size_t size,
+                         unsigned char *output, size_t outputSize);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef DECODER_MODELS_H
+#define DECODER_MODELS_H
+
+#include <cstdint>
+
+/*
+ * Models of the 8088 cycles the decoders of msload_extension.asm take to
+ * unpack a block, which the encoders weigh their choices with and report as
+ * the estimated decoding cost. The figures are fitted to the cycle estimates
+ * trim-winboot-bench takes from running the extensions under the emulator, so
+ * refit them whenever a decoder changes.
+ */
+
+/*
+ * lz4_decompress_small and lz4_decompress_fast: per sequence, per byte of
+ * literals and of matches, and per extra count byte.
+ */
+struct LZ4DecoderModel {
+    uint64_t sequence;
+    uint64_t literalByte;
+    uint64_t matchByte;
+    uint64_t runByte; // Of matches at offset 1
+    uint64_t countByte;
+};
+
+static constexpr LZ4DecoderModel smallLZ4DecoderModel{ 382, 17, 17, 17, 28 };
+static constexpr LZ4DecoderModel fastLZ4DecoderModel{ 293, 24, 12, 7, 59 };
+
+/*
+ * lze_decompress: per control bit, per token and per byte copied.
+ */
+struct LZEDecoderModel {
+    uint64_t bit;
+    uint64_t literalRun;
+    uint64_t repeatMatch;
+    uint64_t newMatch;
+    uint64_t literalByte;
+    uint64_t matchByte;
+};
+
+static constexpr LZEDecoderModel lzeDecoderModel{ 42, 73, 143, 274, 17, 17 };
+
+#endif
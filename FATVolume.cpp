@@ -0,0 +1,549 @@
+#include "FATVolume.h"
+#include "WinbootError.h"
+
+#include <algorithm>
+#include <cstring>
+#include <system_error>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+    uint16_t readWord(const unsigned char *data) {
+        return data[0] | (data[1] << 8);
+    }
+
+    uint32_t readDword(const unsigned char *data) {
+        return readWord(data) | (static_cast<uint32_t>(readWord(data + 2)) << 16);
+    }
+
+    void writeDword(unsigned char *data, uint32_t value) {
+        data[0] = value;
+        data[1] = value >> 8;
+        data[2] = value >> 16;
+        data[3] = value >> 24;
+    }
+
+    static constexpr size_t SectorSize = 512; // Of the MBR, and the minimum of the volume
+    static constexpr size_t DirectoryEntrySize = 32;
+
+    /*
+     * Partition types of FAT file systems, in the MBR.
+     */
+    bool isFATPartition(unsigned char type) {
+        return type == 0x01 || type == 0x04 || type == 0x06 || type == 0x0B || type == 0x0C || type == 0x0E;
+    }
+
+    /*
+     * "WINBOOT.SYS" into "WINBOOT SYS", the way it is in the directory entry.
+     */
+    std::string directoryName(const char *name) {
+        std::string base(name);
+        std::string extension;
+
+        auto dot = base.find('.');
+        if(dot != std::string::npos) {
+            extension = base.substr(dot + 1);
+            base.resize(dot);
+        }
+
+        if(base.empty() || base.size() > 8 || extension.size() > 3)
+            throw std::logic_error(std::string("not an 8.3 name: ") + name);
+
+        base.resize(8, ' ');
+        extension.resize(3, ' ');
+
+        auto entryName = base + extension;
+        std::transform(entryName.begin(), entryName.end(), entryName.begin(), [](unsigned char ch) {
+            return ch >= 'a' && ch <= 'z' ? ch - 'a' + 'A' : ch;
+        });
+
+        return entryName;
+    }
+}
+
+FATVolume::FATVolume(const std::filesystem::path &path) {
+    m_fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if(m_fd < 0)
+        throw std::system_error(errno, std::generic_category(), "unable to open " + path.string());
+
+    try {
+        if(parseBootSector(0))
+            return;
+
+        /*
+         * Not a file system by itself, so look for one in the partitions of
+         * the disk, preferring the active one, which is what the BIOS boots.
+         */
+        unsigned char mbr[SectorSize];
+        readAt(0, mbr, sizeof(mbr));
+
+        if(mbr[510] == 0x55 && mbr[511] == 0xAA) {
+            for(bool active: { true, false }) {
+                for(size_t index = 0; index < 4; index++) {
+                    auto partition = mbr + 0x1BE + 16 * index;
+
+                    if(!isFATPartition(partition[4]) || (active && partition[0] != 0x80))
+                        continue;
+
+                    if(parseBootSector(static_cast<uint64_t>(readDword(partition + 8)) * SectorSize))
+                        return;
+                }
+            }
+        }
+
+        throw WinbootError(WinbootErrorCode::InvalidImage, "no FAT file system found in " + path.string());
+    } catch(...) {
+        close(m_fd);
+        throw;
+    }
+}
+
+FATVolume::~FATVolume() {
+    close(m_fd);
+}
+
+void FATVolume::readAt(uint64_t offset, void *data, size_t size) {
+    auto bytes = static_cast<unsigned char *>(data);
+
+    while(size > 0) {
+        auto transferred = pread(m_fd, bytes, size, offset);
+        if(transferred < 0) {
+            if(errno == EINTR)
+                continue;
+
+            throw std::system_error(errno, std::generic_category(), "read failed");
+        }
+
+        if(transferred == 0)
+            throw WinbootError(WinbootErrorCode::InvalidImage, "the file system extends past the end of the disk image");
+
+        bytes += transferred;
+        offset += transferred;
+        size -= transferred;
+    }
+}
+
+void FATVolume::writeAt(uint64_t offset, const void *data, size_t size) {
+    auto bytes = static_cast<const unsigned char *>(data);
+
+    while(size > 0) {
+        auto transferred = pwrite(m_fd, bytes, size, offset);
+        if(transferred < 0) {
+            if(errno == EINTR)
+                continue;
+
+            throw std::system_error(errno, std::generic_category(), "write failed");
+        }
+
+        bytes += transferred;
+        offset += transferred;
+        size -= transferred;
+    }
+}
+
+bool FATVolume::parseBootSector(uint64_t offset) {
+    unsigned char sector[SectorSize];
+
+    try {
+        readAt(offset, sector, sizeof(sector));
+    } catch(const WinbootError &) {
+        return false;
+    }
+
+    if((sector[0] != 0xEB && sector[0] != 0xE9) || sector[510] != 0x55 || sector[511] != 0xAA)
+        return false;
+
+    m_bytesPerSector = readWord(sector + 11);
+    m_sectorsPerCluster = sector[13];
+    m_reservedSectors = readWord(sector + 14);
+    m_fatCount = sector[16];
+    m_rootEntries = readWord(sector + 17);
+
+    uint32_t totalSectors = readWord(sector + 19);
+    if(totalSectors == 0)
+        totalSectors = readDword(sector + 32);
+
+    m_sectorsPerFAT = readWord(sector + 22);
+    bool extendedBPB = m_sectorsPerFAT == 0;
+    if(extendedBPB)
+        m_sectorsPerFAT = readDword(sector + 36);
+
+    if(m_bytesPerSector < SectorSize || m_bytesPerSector > 4096 || (m_bytesPerSector & (m_bytesPerSector - 1)) != 0 ||
+       m_sectorsPerCluster == 0 || (m_sectorsPerCluster & (m_sectorsPerCluster - 1)) != 0 ||
+       m_reservedSectors == 0 || m_fatCount == 0 || m_sectorsPerFAT == 0)
+        return false;
+
+    uint32_t rootSectors = (m_rootEntries * DirectoryEntrySize + m_bytesPerSector - 1) / m_bytesPerSector;
+    m_firstDataSector = m_reservedSectors + m_fatCount * m_sectorsPerFAT + rootSectors;
+
+    if(totalSectors <= m_firstDataSector)
+        return false;
+
+    m_clusterCount = (totalSectors - m_firstDataSector) / m_sectorsPerCluster;
+
+    /*
+     * The type only depends on the number of clusters.
+     */
+    if(m_clusterCount < 4085) {
+        m_type = Type::FAT12;
+    } else if(m_clusterCount < 65525) {
+        m_type = Type::FAT16;
+    } else {
+        m_type = Type::FAT32;
+    }
+
+    m_mirrored = true;
+    m_activeFAT = 0;
+    m_rootCluster = 0;
+    m_fsInfoSector = 0;
+
+    if(m_type == Type::FAT32) {
+        if(!extendedBPB || m_rootEntries != 0)
+            return false;
+
+        uint16_t extendedFlags = readWord(sector + 40);
+        m_mirrored = (extendedFlags & 0x80) == 0;
+
+        /*
+         * The number of the active FAT only means something when mirroring
+         * is off; otherwise, the first FAT is the one that counts.
+         */
+        m_activeFAT = m_mirrored ? 0 : extendedFlags & 0x0F;
+        m_rootCluster = readDword(sector + 44);
+        m_fsInfoSector = readWord(sector + 48);
+
+        if(m_activeFAT >= m_fatCount)
+            return false;
+    } else if(m_rootEntries == 0) {
+        return false;
+    }
+
+    /*
+     * The FAT has to have an entry for every cluster.
+     */
+    uint64_t fatEntries;
+    switch(m_type) {
+        case Type::FAT12:
+            fatEntries = static_cast<uint64_t>(m_sectorsPerFAT) * m_bytesPerSector * 2 / 3;
+            break;
+
+        case Type::FAT16:
+            fatEntries = static_cast<uint64_t>(m_sectorsPerFAT) * m_bytesPerSector / 2;
+            break;
+
+        default:
+            fatEntries = static_cast<uint64_t>(m_sectorsPerFAT) * m_bytesPerSector / 4;
+            break;
+    }
+
+    if(fatEntries < m_clusterCount + 2)
+        return false;
+
+    m_volumeOffset = offset;
+    m_fatCache.clear();
+
+    return true;
+}
+
+uint64_t FATVolume::clusterOffset(uint32_t cluster) const {
+    return m_volumeOffset +
+        (m_firstDataSector + static_cast<uint64_t>(cluster - 2) * m_sectorsPerCluster) * m_bytesPerSector;
+}
+
+unsigned char &FATVolume::fatByte(size_t offset, bool modify) {
+    uint32_t sectorIndex = offset / m_bytesPerSector;
+
+    if(sectorIndex >= m_sectorsPerFAT)
+        throw WinbootError(WinbootErrorCode::InvalidImage, "FAT entry out of range");
+
+    auto &sector = m_fatCache[sectorIndex];
+    if(sector.data.empty()) {
+        sector.data.resize(m_bytesPerSector);
+
+        uint64_t fatOffset = m_volumeOffset +
+            (m_reservedSectors + static_cast<uint64_t>(m_activeFAT) * m_sectorsPerFAT + sectorIndex) * m_bytesPerSector;
+        readAt(fatOffset, sector.data.data(), sector.data.size());
+    }
+
+    if(modify)
+        sector.dirty = true;
+
+    return sector.data[offset % m_bytesPerSector];
+}
+
+uint32_t FATVolume::fatEntry(uint32_t cluster) {
+    switch(m_type) {
+        case Type::FAT12:
+        {
+            size_t offset = cluster + cluster / 2;
+            uint16_t pair = fatByte(offset, false) | (fatByte(offset + 1, false) << 8);
+
+            return (cluster & 1) ? pair >> 4 : pair & 0xFFF;
+        }
+
+        case Type::FAT16:
+            return fatByte(2 * cluster, false) | (fatByte(2 * cluster + 1, false) << 8);
+
+        default:
+        {
+            uint32_t value = 0;
+            for(size_t index = 0; index < 4; index++) {
+                value |= static_cast<uint32_t>(fatByte(4 * cluster + index, false)) << (8 * index);
+            }
+
+            return value & 0x0FFFFFFF;
+        }
+    }
+}
+
+void FATVolume::setFATEntry(uint32_t cluster, uint32_t value) {
+    switch(m_type) {
+        case Type::FAT12:
+        {
+            size_t offset = cluster + cluster / 2;
+            auto &low = fatByte(offset, true);
+            auto &high = fatByte(offset + 1, true);
+
+            if(cluster & 1) {
+                low = (low & 0x0F) | ((value << 4) & 0xF0);
+                high = value >> 4;
+            } else {
+                low = value;
+                high = (high & 0xF0) | ((value >> 8) & 0x0F);
+            }
+            break;
+        }
+
+        case Type::FAT16:
+            fatByte(2 * cluster, true) = value;
+            fatByte(2 * cluster + 1, true) = value >> 8;
+            break;
+
+        default:
+        {
+            /*
+             * The top four bits are reserved, and have to be preserved.
+             */
+            auto &top = fatByte(4 * cluster + 3, true);
+            value = (value & 0x0FFFFFFF) | (static_cast<uint32_t>(top & 0xF0) << 24);
+
+            for(size_t index = 0; index < 4; index++) {
+                fatByte(4 * cluster + index, true) = value >> (8 * index);
+            }
+            break;
+        }
+    }
+}
+
+void FATVolume::flushFAT() {
+    for(auto &[sectorIndex, sector]: m_fatCache) {
+        if(!sector.dirty)
+            continue;
+
+        for(uint32_t fat = 0; fat < m_fatCount; fat++) {
+            if(!m_mirrored && fat != m_activeFAT)
+                continue;
+
+            uint64_t fatOffset = m_volumeOffset +
+                (m_reservedSectors + static_cast<uint64_t>(fat) * m_sectorsPerFAT + sectorIndex) * m_bytesPerSector;
+            writeAt(fatOffset, sector.data.data(), sector.data.size());
+        }
+
+        sector.dirty = false;
+    }
+}
+
+std::vector<uint32_t> FATVolume::clusterChain(uint32_t firstCluster) {
+    uint32_t endOfChain;
+    switch(m_type) {
+        case Type::FAT12:
+            endOfChain = 0xFF8;
+            break;
+
+        case Type::FAT16:
+            endOfChain = 0xFFF8;
+            break;
+
+        default:
+            endOfChain = 0x0FFFFFF8;
+            break;
+    }
+
+    std::vector<uint32_t> chain;
+
+    for(uint32_t cluster = firstCluster; cluster < endOfChain; cluster = fatEntry(cluster)) {
+        if(cluster < 2 || cluster >= m_clusterCount + 2 || chain.size() >= m_clusterCount)
+            throw WinbootError(WinbootErrorCode::InvalidImage, "the FAT cluster chain is broken");
+
+        chain.push_back(cluster);
+    }
+
+    return chain;
+}
+
+void FATVolume::transferClusters(const std::vector<uint32_t> &clusters, unsigned char *data, size_t size, bool write) {
+    size_t clusterSize = static_cast<size_t>(m_sectorsPerCluster) * m_bytesPerSector;
+
+    for(size_t index = 0, position = 0; position < size;) {
+        /*
+         * Files are often contiguous, so transfer runs of clusters at once.
+         */
+        size_t run = 1;
+        while(index + run < clusters.size() && clusters[index + run] == clusters[index] + run &&
+              position + run * clusterSize < size)
+            run++;
+
+        auto length = std::min(run * clusterSize, size - position);
+
+        if(write) {
+            writeAt(clusterOffset(clusters[index]), data + position, length);
+        } else {
+            readAt(clusterOffset(clusters[index]), data + position, length);
+        }
+
+        index += run;
+        position += length;
+    }
+}
+
+bool FATVolume::findRootFile(const char *name, RootFile &file) {
+    auto entryName = directoryName(name);
+
+    /*
+     * The root directory is a fixed area before the data area, except on
+     * FAT32, where it is a cluster chain like any other directory.
+     */
+    std::vector<std::pair<uint64_t, size_t>> areas;
+
+    if(m_type == Type::FAT32) {
+        size_t clusterSize = static_cast<size_t>(m_sectorsPerCluster) * m_bytesPerSector;
+
+        for(auto cluster: clusterChain(m_rootCluster)) {
+            areas.emplace_back(clusterOffset(cluster), clusterSize);
+        }
+    } else {
+        uint64_t rootOffset = m_volumeOffset +
+            (m_reservedSectors + static_cast<uint64_t>(m_fatCount) * m_sectorsPerFAT) * m_bytesPerSector;
+
+        areas.emplace_back(rootOffset, m_rootEntries * DirectoryEntrySize);
+    }
+
+    std::vector<unsigned char> directory;
+
+    for(const auto &[offset, size]: areas) {
+        directory.resize(size);
+        readAt(offset, directory.data(), directory.size());
+
+        for(size_t position = 0; position + DirectoryEntrySize <= directory.size(); position += DirectoryEntrySize) {
+            auto entry = directory.data() + position;
+
+            if(entry[0] == 0x00)
+                return false; // The end of the directory
+
+            auto attributes = entry[11];
+
+            /*
+             * Skip the deleted entries, the long name entries, the volume
+             * label and the directories.
+             */
+            if(entry[0] == 0xE5 || (attributes & 0x0F) == 0x0F || (attributes & 0x18) != 0)
+                continue;
+
+            if(memcmp(entry, entryName.data(), entryName.size()) != 0)
+                continue;
+
+            file.name = name;
+            file.entryOffset = offset + position;
+            file.firstCluster = readWord(entry + 26);
+            if(m_type == Type::FAT32)
+                file.firstCluster |= static_cast<uint32_t>(readWord(entry + 20)) << 16;
+            file.size = readDword(entry + 28);
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+std::vector<unsigned char> FATVolume::readFile(const RootFile &file) {
+    std::vector<unsigned char> data(file.size);
+    if(data.empty())
+        return data;
+
+    auto clusters = clusterChain(file.firstCluster);
+
+    size_t clusterSize = static_cast<size_t>(m_sectorsPerCluster) * m_bytesPerSector;
+    if(clusters.size() * clusterSize < data.size())
+        throw WinbootError(WinbootErrorCode::InvalidImage, file.name + " is longer than its cluster chain");
+
+    transferClusters(clusters, data.data(), data.size(), false);
+
+    return data;
+}
+
+void FATVolume::shrinkFile(RootFile &file, const std::vector<unsigned char> &data) {
+    if(data.size() > file.size)
+        throw WinbootError(WinbootErrorCode::DoesNotFit, file.name + " has grown, which is not supported on disk images");
+
+    if(data.empty())
+        throw std::logic_error("FATVolume::shrinkFile: the file can't be emptied");
+
+    auto clusters = clusterChain(file.firstCluster);
+
+    size_t clusterSize = static_cast<size_t>(m_sectorsPerCluster) * m_bytesPerSector;
+    size_t keptClusters = (data.size() + clusterSize - 1) / clusterSize;
+
+    if(clusters.size() < keptClusters)
+        throw WinbootError(WinbootErrorCode::InvalidImage, file.name + " is longer than its cluster chain");
+
+    /*
+     * Write the new contents first, and zero the rest of the last cluster,
+     * then update the size, and only then cut the chain, so that the file
+     * is never longer than its chain.
+     */
+    std::vector<unsigned char> padded(keptClusters * clusterSize);
+    memcpy(padded.data(), data.data(), data.size());
+    transferClusters(clusters, padded.data(), padded.size(), true);
+
+    unsigned char size[4];
+    writeDword(size, data.size());
+    writeAt(file.entryOffset + 28, size, sizeof(size));
+    file.size = data.size();
+
+    uint32_t endOfChain = m_type == Type::FAT12 ? 0xFFF : m_type == Type::FAT16 ? 0xFFFF : 0x0FFFFFFF;
+
+    setFATEntry(clusters[keptClusters - 1], endOfChain);
+    for(size_t index = keptClusters; index < clusters.size(); index++) {
+        setFATEntry(clusters[index], 0);
+    }
+
+    flushFAT();
+
+    updateFreeClusterCount(clusters.size() - keptClusters);
+}
+
+void FATVolume::updateFreeClusterCount(uint32_t freed) {
+    if(m_type != Type::FAT32 || m_fsInfoSector == 0 || m_fsInfoSector == 0xFFFF || freed == 0)
+        return;
+
+    /*
+     * The FSInfo sector of FAT32 caches the number of free clusters, unless
+     * it is unknown (all ones).
+     */
+    unsigned char fsInfo[SectorSize];
+    uint64_t fsInfoOffset = m_volumeOffset + static_cast<uint64_t>(m_fsInfoSector) * m_bytesPerSector;
+    readAt(fsInfoOffset, fsInfo, sizeof(fsInfo));
+
+    if(readDword(fsInfo) != 0x41615252 || readDword(fsInfo + 484) != 0x61417272)
+        return;
+
+    uint32_t freeClusters = readDword(fsInfo + 488);
+    if(freeClusters == 0xFFFFFFFF)
+        return;
+
+    writeDword(fsInfo + 488, std::min(freeClusters + freed, m_clusterCount));
+    writeAt(fsInfoOffset + 488, fsInfo + 488, 4);
+}
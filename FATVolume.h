@@ -0,0 +1,107 @@
+#ifndef FAT_VOLUME_H
+#define FAT_VOLUME_H
+
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <string>
+#include <vector>
+
+/*
+ * A FAT12, FAT16 or FAT32 file system in a raw disk image file, either
+ * unpartitioned or in a partition of an MBR-partitioned disk, opened for
+ * patching the files in its root directory in place. Only the sectors
+ * involved are read and written: the boot sector, the root directory, the
+ * FAT sectors holding the chain of the file, and its clusters.
+ */
+class FATVolume {
+public:
+    explicit FATVolume(const std::filesystem::path &path);
+    ~FATVolume();
+
+    FATVolume(const FATVolume &other) = delete;
+    FATVolume &operator =(const FATVolume &other) = delete;
+
+    struct RootFile {
+        std::string name;
+        uint64_t entryOffset;   // Of the directory entry, in the disk image
+        uint32_t firstCluster;
+        uint32_t size;
+    };
+
+    /*
+     * Looks up a file by its 8.3 name, such as "WINBOOT.SYS", in the root
+     * directory. Returns false if there is no such file.
+     */
+    bool findRootFile(const char *name, RootFile &file);
+
+    std::vector<unsigned char> readFile(const RootFile &file);
+
+    /*
+     * Rewrites the file with 'data', which can't be longer than it: growing
+     * the file would take allocating clusters, which is not supported. The
+     * clusters past the new end of the file are freed.
+     */
+    void shrinkFile(RootFile &file, const std::vector<unsigned char> &data);
+
+private:
+    enum class Type {
+        FAT12,
+        FAT16,
+        FAT32
+    };
+
+    void readAt(uint64_t offset, void *data, size_t size);
+    void writeAt(uint64_t offset, const void *data, size_t size);
+
+    bool parseBootSector(uint64_t offset);
+
+    uint64_t clusterOffset(uint32_t cluster) const;
+    std::vector<uint32_t> clusterChain(uint32_t firstCluster);
+
+    /*
+     * Reads or writes the first 'size' bytes of the file whose clusters are
+     * 'clusters', coalescing the contiguous ones.
+     */
+    void transferClusters(const std::vector<uint32_t> &clusters, unsigned char *data, size_t size, bool write);
+
+    uint32_t fatEntry(uint32_t cluster);
+    void setFATEntry(uint32_t cluster, uint32_t value);
+    unsigned char &fatByte(size_t offset, bool modify);
+    void flushFAT();
+    void updateFreeClusterCount(uint32_t freed);
+
+    int m_fd;
+
+    Type m_type;
+    uint64_t m_volumeOffset;
+    uint32_t m_bytesPerSector;
+    uint32_t m_sectorsPerCluster;
+    uint32_t m_reservedSectors;
+    uint32_t m_fatCount;
+    uint32_t m_sectorsPerFAT;
+    uint32_t m_rootEntries;
+    uint32_t m_rootCluster;
+    uint32_t m_firstDataSector;
+    uint32_t m_clusterCount;
+    uint32_t m_fsInfoSector;
+
+    /*
+     * FAT32 may keep only one of the FATs up to date, instead of mirroring.
+     */
+    bool m_mirrored;
+    uint32_t m_activeFAT;
+
+    /*
+     * The sectors of the FAT read so far, by their index in the FAT, and
+     * whether they have been modified since.
+     */
+    struct FATSector {
+        std::vector<unsigned char> data;
+        bool dirty = false;
+    };
+
+    std::map<uint32_t, FATSector> m_fatCache;
+};
+
+#endif
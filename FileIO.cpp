@@ -0,0 +1,134 @@
+#include "FileIO.h"
+
+#include <atomic>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <system_error>
+#include <thread>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+std::vector<unsigned char> readFile(const std::filesystem::path &path) {
+    std::ifstream stream;
+    stream.exceptions(std::ios::failbit | std::ios::eofbit | std::ios::badbit);
+    stream.open(path, std::ios::in | std::ios::binary);
+
+    stream.seekg(0, std::ios::end);
+    std::vector<unsigned char> data(static_cast<size_t>(stream.tellg()));
+    stream.seekg(0);
+
+    stream.read(reinterpret_cast<char *>(data.data()), data.size());
+
+    return data;
+}
+
+void writeFile(const std::filesystem::path &path, const std::vector<unsigned char> &data) {
+    if(path.has_parent_path())
+        std::filesystem::create_directories(path.parent_path());
+
+    std::ofstream stream;
+    stream.exceptions(std::ios::failbit | std::ios::eofbit | std::ios::badbit);
+    stream.open(path, std::ios::out | std::ios::trunc | std::ios::binary);
+    stream.write(reinterpret_cast<const char *>(data.data()), data.size());
+}
+
+static std::filesystem::path temporaryPathFor(const std::filesystem::path &path) {
+    static std::atomic<unsigned int> counter(0);
+
+    std::stringstream suffix;
+    suffix << ".tmp." << getpid() << "." << std::hash<std::thread::id>()(std::this_thread::get_id())
+           << "." << counter.fetch_add(1);
+
+    auto temporaryPath = path;
+    temporaryPath += suffix.str();
+
+    return temporaryPath;
+}
+
+/*
+ * Gives the temporary file that replaces 'path' the permissions of the file
+ * it replaces, if there is one, rather than the defaults of a new file.
+ */
+static void keepPermissions(const std::filesystem::path &path, const std::filesystem::path &temporaryPath) {
+    std::error_code error;
+    auto status = std::filesystem::status(path, error);
+    if(error || !std::filesystem::exists(status))
+        return;
+
+    std::filesystem::permissions(temporaryPath, status.permissions(), std::filesystem::perm_options::replace);
+}
+
+void writeFileAtomically(const std::filesystem::path &path, const std::vector<unsigned char> &data) {
+    auto temporaryPath = temporaryPathFor(path);
+
+    try {
+        writeFile(temporaryPath, data);
+        keepPermissions(path, temporaryPath);
+        std::filesystem::rename(temporaryPath, path);
+    } catch(...) {
+        std::error_code ignored;
+        std::filesystem::remove(temporaryPath, ignored);
+        throw;
+    }
+}
+
+void writeAll(int fd, const void *data, size_t size) {
+    auto bytes = static_cast<const unsigned char *>(data);
+
+    while(size > 0) {
+        auto written = write(fd, bytes, size);
+        if(written < 0) {
+            if(errno == EINTR)
+                continue;
+
+            throw std::system_error(errno, std::generic_category(), "write failed");
+        }
+
+        bytes += written;
+        size -= written;
+    }
+}
+
+OutputFile::OutputFile(const std::filesystem::path &path) : m_path(path), m_temporaryPath(temporaryPathFor(path)) {
+    if(path.has_parent_path())
+        std::filesystem::create_directories(path.parent_path());
+
+    m_fd = open(m_temporaryPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if(m_fd < 0)
+        throw std::system_error(errno, std::generic_category(), "unable to create " + m_temporaryPath.string());
+}
+
+OutputFile::~OutputFile() {
+    if(m_fd >= 0) {
+        close(m_fd);
+
+        std::error_code ignored;
+        std::filesystem::remove(m_temporaryPath, ignored);
+    }
+}
+
+void OutputFile::commit() {
+    auto fd = m_fd;
+    m_fd = -1;
+
+    if(close(fd) != 0) {
+        auto error = errno;
+
+        std::error_code ignored;
+        std::filesystem::remove(m_temporaryPath, ignored);
+
+        throw std::system_error(error, std::generic_category(), "unable to write " + m_temporaryPath.string());
+    }
+
+    try {
+        keepPermissions(m_path, m_temporaryPath);
+        std::filesystem::rename(m_temporaryPath, m_path);
+    } catch(...) {
+        std::error_code ignored;
+        std::filesystem::remove(m_temporaryPath, ignored);
+        throw;
+    }
+}
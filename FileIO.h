@@ -0,0 +1,54 @@
+#ifndef FILE_IO_H
+#define FILE_IO_H
+
+#include <filesystem>
+#include <vector>
+
+std::vector<unsigned char> readFile(const std::filesystem::path &path);
+
+/*
+ * Writes the file, creating the parent directories if necessary.
+ */
+void writeFile(const std::filesystem::path &path, const std::vector<unsigned char> &data);
+
+/*
+ * Writes the data into a uniquely named temporary file next to 'path' and
+ * renames it into place, so that concurrent readers only ever observe either
+ * no file or the complete one. A file it replaces keeps its permissions.
+ */
+void writeFileAtomically(const std::filesystem::path &path, const std::vector<unsigned char> &data);
+
+/*
+ * A file opened for writing at the POSIX level, for the writers that need a
+ * file descriptor. It is written as a uniquely named temporary file next to
+ * 'path' (creating the parent directories), which commit() renames into
+ * place; the file being replaced, which may well be what the writer is
+ * reading from, stays intact until then, and passes its permissions on to
+ * it. Uncommitted, the temporary file is removed.
+ */
+class OutputFile {
+public:
+    explicit OutputFile(const std::filesystem::path &path);
+    ~OutputFile();
+
+    OutputFile(const OutputFile &other) = delete;
+    OutputFile &operator =(const OutputFile &other) = delete;
+
+    inline int fd() const {
+        return m_fd;
+    }
+
+    void commit();
+
+private:
+    std::filesystem::path m_path;
+    std::filesystem::path m_temporaryPath;
+    int m_fd;
+};
+
+/*
+ * Writes the whole buffer to a file descriptor, retrying short writes.
+ */
+void writeAll(int fd, const void *data, size_t size);
+
+#endif
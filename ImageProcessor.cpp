@@ -0,0 +1,349 @@
+#include "ImageProcessor.h"
+#include "CompressionSearch.h"
+#include "FATVolume.h"
+#include "FileIO.h"
+#include "Log.h"
+#include "MappedFile.h"
+#include "PayloadCodec.h"
+#include "ResultCache.h"
+#include "Sha256.h"
+#include "Statistics.h"
+#include "WinbootError.h"
+#include "WinbootImage.h"
+
+#include <memory>
+#include <sstream>
+
+void transformImage(WinbootImage &image, const ProcessingOptions &options) {
+    image.setMSLOADScanning(options.scanMSLOAD);
+
+    if(options.removeMSDCM) {
+        image.removeMSDCM();
+    }
+
+    if(options.removeLogo) {
+        image.removeLogo();
+    }
+
+    if(options.compress) {
+        image.compress(options.compression);
+    }
+}
+
+static std::string codecDescription(const CompressionOptions &options) {
+    switch(options.codecSelection) {
+        case CodecSelection::Smallest:
+            return "smallest";
+
+        case CodecSelection::Cheapest:
+            return "cheapest";
+
+        default:
+            return options.codec;
+    }
+}
+
+static std::string parserDescription(const CompressionOptions &options) {
+    if(options.parser == LZ4Parser::DecodeCost)
+        return "decode-cost:" + std::to_string(options.byteCost);
+
+    return "hc";
+}
+
+static std::string levelDescription(const CompressionOptions &options) {
+    if(options.policy != CompressionPolicy::Fixed)
+        return std::string("policy:") + policyName(options.policy);
+
+    return std::to_string(options.level) + ";block-size=" + std::to_string(options.blockSize);
+}
+
+static const char *cmEngineDescription(CMEngine engine) {
+    switch(engine) {
+        case CMEngine::Emulated:
+            return "emulated";
+
+        case CMEngine::Verify:
+            return "verify";
+
+        default:
+            return "native";
+    }
+}
+
+/*
+ * Verifying the 'CM' engines against each other, or profiling the emulated
+ * one, is the whole point of running those, so a cached result won't do.
+ */
+static bool mustDecompressCM(const ProcessingOptions &options) {
+    return options.cm.engine == CMEngine::Verify || options.cm.profile != nullptr;
+}
+
+/*
+ * Bump whenever a change to the transformations can make the same input and
+ * options give a different output, so that the results cached by earlier
+ * builds aren't taken for current ones.
+ */
+static constexpr unsigned int OutputFormatVersion = 1;
+
+/*
+ * The extensions are assembled separately from the code, so a rebuilt
+ * extension changes the output without anything else changing.
+ */
+static const std::string &extensionsDigest() {
+    static const std::string digest = [] {
+        Sha256 hash;
+
+        for(auto codec: payloadCodecs()) {
+            for(const auto &extension: codec->extensions()) {
+                hash.update(extension.code, extension.size);
+            }
+        }
+
+        return Sha256::toHex(hash.finish());
+    }();
+
+    return digest;
+}
+
+std::string describeOutputOptions(const ProcessingOptions &options, bool extractMSDCM) {
+    std::stringstream description;
+
+    description << "trim-winboot " << TRIM_WINBOOT_VERSION
+                << ";format=" << OutputFormatVersion
+                << ";extensions=" << extensionsDigest()
+                << ";compress=" << options.compress
+                << ";linked-blocks=" << options.compression.linkedBlocks
+                << ";decoder=" << (options.compression.decoder == LZ4Decoder::Fast ? "fast" : "small")
+                << ";parser=" << parserDescription(options.compression)
+                << ";level=" << levelDescription(options.compression)
+                << ";codec=" << codecDescription(options.compression)
+                << ";in-place=" << options.compression.inPlace
+                << ";remove-logo=" << options.removeLogo
+                << ";remove-msdcm=" << options.removeMSDCM
+                << ";scan-msload=" << options.scanMSLOAD
+                << ";extract-msdcm=" << extractMSDCM
+                << ";cm-engine=" << cmEngineDescription(options.cm.engine)
+                << ";cm-budget=" << options.cm.instructionBudget;
+
+    return description.str();
+}
+
+void processImage(std::vector<unsigned char> &&input,
+                  const ProcessingOptions &options,
+                  bool extractMSDCM,
+                  std::vector<unsigned char> &output,
+                  std::vector<unsigned char> &msdcm,
+                  ImageStatistics *statistics) {
+    std::unique_ptr<ResultCache> cache;
+    std::string key;
+
+    if(statistics) {
+        statistics->inputSize = input.size();
+    }
+
+    if(!options.cacheDirectory.empty()) {
+        cache = std::make_unique<ResultCache>(options.cacheDirectory);
+        key = ResultCache::key(input.data(), input.size(), describeOutputOptions(options, extractMSDCM));
+
+        if(!mustDecompressCM(options) && cache->lookup(key, output, extractMSDCM ? &msdcm : nullptr)) {
+            logMessage(LogLevel::Info, "Found in the result cache: %s", key.c_str());
+
+            if(statistics) {
+                statistics->cached = true;
+                statistics->outputSize = output.size();
+            }
+
+            return;
+        }
+    }
+
+    WinbootImage image;
+    image.setCMDecompressionOptions(options.cm);
+    image.setStatistics(statistics);
+
+    {
+        PhaseTimer timer(statistics, "load");
+        image.load(std::move(input));
+    }
+
+    if(extractMSDCM) {
+        image.extractMSDCM(msdcm);
+    }
+
+    transformImage(image, options);
+
+    {
+        PhaseTimer timer(statistics, "save");
+        image.save(output);
+    }
+
+    if(statistics) {
+        statistics->outputSize = output.size();
+    }
+
+    if(cache) {
+        cache->store(key, output, extractMSDCM ? &msdcm : nullptr);
+    }
+}
+
+void processImageFile(const std::filesystem::path &input,
+                      const std::filesystem::path &output,
+                      const std::filesystem::path &msdcmOutput,
+                      const ProcessingOptions &options,
+                      ImageStatistics *statistics) {
+    bool extractMSDCM = !msdcmOutput.empty();
+
+    std::vector<unsigned char> outputData;
+    std::vector<unsigned char> msdcmData;
+
+    if(!options.mappedIO) {
+        std::vector<unsigned char> inputData;
+
+        {
+            PhaseTimer timer(statistics, "read");
+            inputData = readFile(input);
+        }
+
+        processImage(std::move(inputData), options, extractMSDCM, outputData, msdcmData, statistics);
+    } else if(options.cacheDirectory.empty()) {
+        WinbootImage image;
+        image.setCMDecompressionOptions(options.cm);
+        image.setStatistics(statistics);
+
+        if(statistics) {
+            statistics->inputSize = std::filesystem::file_size(input);
+        }
+
+        {
+            PhaseTimer timer(statistics, "load");
+            image.loadMapped(input);
+        }
+
+        if(extractMSDCM) {
+            image.extractMSDCM(msdcmOutput);
+        }
+
+        transformImage(image, options);
+
+        {
+            PhaseTimer timer(statistics, "save");
+            image.save(output);
+        }
+
+        if(statistics) {
+            statistics->outputSize = std::filesystem::file_size(output);
+        }
+
+        return;
+    } else {
+        /*
+         * The cache needs the results in memory anyway, so kernel-side copies
+         * are only used when it's disabled.
+         */
+        ResultCache cache(options.cacheDirectory);
+        std::string key;
+
+        {
+            PhaseTimer timer(statistics, "read");
+            MappedFile mapping(input);
+            key = ResultCache::key(mapping.data(), mapping.size(), describeOutputOptions(options, extractMSDCM));
+
+            if(statistics) {
+                statistics->inputSize = mapping.size();
+            }
+        }
+
+        if(!mustDecompressCM(options) && cache.lookup(key, outputData, extractMSDCM ? &msdcmData : nullptr)) {
+            logMessage(LogLevel::Info, "Found in the result cache: %s", key.c_str());
+
+            if(statistics) {
+                statistics->cached = true;
+            }
+        } else {
+            WinbootImage image;
+            image.setCMDecompressionOptions(options.cm);
+            image.setStatistics(statistics);
+
+            {
+                PhaseTimer timer(statistics, "load");
+                image.loadMapped(input);
+            }
+
+            if(extractMSDCM) {
+                image.extractMSDCM(msdcmData);
+            }
+
+            transformImage(image, options);
+
+            {
+                PhaseTimer timer(statistics, "save");
+                image.save(outputData);
+            }
+
+            cache.store(key, outputData, extractMSDCM ? &msdcmData : nullptr);
+        }
+
+        if(statistics) {
+            statistics->outputSize = outputData.size();
+        }
+    }
+
+    PhaseTimer timer(statistics, "write");
+
+    if(extractMSDCM) {
+        writeFile(msdcmOutput, msdcmData);
+    }
+
+    writeFile(output, outputData);
+}
+
+void processDiskImage(const std::filesystem::path &diskImage,
+                      const std::filesystem::path &msdcmOutput,
+                      const ProcessingOptions &options,
+                      ImageStatistics *statistics) {
+    bool extractMSDCM = !msdcmOutput.empty();
+
+    FATVolume volume(diskImage);
+    FATVolume::RootFile file;
+
+    if(!volume.findRootFile("WINBOOT.SYS", file) && !volume.findRootFile("IO.SYS", file))
+        throw WinbootError(WinbootErrorCode::InvalidImage,
+                           "neither WINBOOT.SYS nor IO.SYS found in the root directory of " + diskImage.string());
+
+    std::vector<unsigned char> inputData;
+
+    {
+        PhaseTimer timer(statistics, "read");
+        inputData = volume.readFile(file);
+    }
+
+    std::vector<unsigned char> outputData;
+    std::vector<unsigned char> msdcmData;
+
+    processImage(std::move(inputData), options, extractMSDCM, outputData, msdcmData, statistics);
+
+    PhaseTimer timer(statistics, "write");
+
+    if(extractMSDCM) {
+        writeFile(msdcmOutput, msdcmData);
+    }
+
+    volume.shrinkFile(file, outputData);
+
+    logMessage(LogLevel::Info, "%s: %s is now %zu bytes", diskImage.c_str(), file.name.c_str(), outputData.size());
+}
+
+void searchImageFile(const std::filesystem::path &input, const ProcessingOptions &options, std::ostream &report) {
+    WinbootImage image;
+    image.setCMDecompressionOptions(options.cm);
+    image.load(input);
+
+    /*
+     * Everything but the compression itself, which is what is searched.
+     */
+    auto transformations = options;
+    transformations.compress = false;
+    transformImage(image, transformations);
+
+    writeSearchReport(report, image.searchCompression(options.compression), options.compression);
+}
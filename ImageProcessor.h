@@ -0,0 +1,101 @@
+#ifndef IMAGE_PROCESSOR_H
+#define IMAGE_PROCESSOR_H
+
+#include <filesystem>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "CompressionOptions.h"
+#include "CMDecompressor.h"
+
+class WinbootImage;
+struct ImageStatistics;
+
+/*
+ * The set of transformations requested on the command line. MSDCM extraction
+ * is not included, because its destination is specific to each image.
+ */
+struct ProcessingOptions {
+    bool removeMSDCM = false;
+    bool compress = false;
+    bool removeLogo = false;
+    CompressionOptions compression;
+    CMDecompressionOptions cm;
+
+    /*
+     * See WinbootImage::setMSLOADScanning().
+     */
+    bool scanMSLOAD = false;
+
+    /*
+     * Map the input files instead of reading them, and let the kernel copy
+     * the unmodified parts into the output files.
+     */
+    bool mappedIO = false;
+
+    /*
+     * If not empty, finished images are looked up in and stored into the
+     * result cache in this directory.
+     */
+    std::filesystem::path cacheDirectory;
+};
+
+/*
+ * Applies the requested transformations to a loaded image, in the order
+ * the tool has always applied them.
+ */
+void transformImage(WinbootImage &image, const ProcessingOptions &options);
+
+/*
+ * Describes everything in the options (and the tool itself) that affects the
+ * output bytes. Options that only affect how the output is computed, such as
+ * the thread counts, are deliberately left out. The 'CM' engine and its
+ * budget are in, as they decide which payloads are accepted, and so are the
+ * version of the output format and a digest of the MSLOAD extensions.
+ */
+std::string describeOutputOptions(const ProcessingOptions &options, bool extractMSDCM);
+
+/*
+ * Loads the image from memory, extracts MSDCM into 'msdcm' if requested,
+ * transforms it and saves it into 'output', going through the result cache
+ * if one is configured. If 'statistics' is not null, the sizes and the time
+ * taken by every phase are recorded into it.
+ */
+void processImage(std::vector<unsigned char> &&input,
+                  const ProcessingOptions &options,
+                  bool extractMSDCM,
+                  std::vector<unsigned char> &output,
+                  std::vector<unsigned char> &msdcm,
+                  ImageStatistics *statistics = nullptr);
+
+/*
+ * Processes the input file into the output file (and into the MSDCM file, if
+ * 'msdcmOutput' is not empty).
+ */
+void processImageFile(const std::filesystem::path &input,
+                      const std::filesystem::path &output,
+                      const std::filesystem::path &msdcmOutput,
+                      const ProcessingOptions &options,
+                      ImageStatistics *statistics = nullptr);
+
+/*
+ * Processes WINBOOT.SYS (or IO.SYS, if there is no WINBOOT.SYS) in the root
+ * directory of the FAT file system in a raw disk image, rewriting it in
+ * place. The file can only shrink, so the transformations that grow it are
+ * refused. MSDCM is extracted into 'msdcmOutput' if it is not empty.
+ */
+void processDiskImage(const std::filesystem::path &diskImage,
+                      const std::filesystem::path &msdcmOutput,
+                      const ProcessingOptions &options,
+                      ImageStatistics *statistics = nullptr);
+
+/*
+ * Transforms the image like processImageFile() would, but instead of
+ * compressing it, compresses its payload with a grid of levels and block
+ * sizes, and writes a report of the outcomes and their Pareto front. Nothing
+ * is written to disk.
+ */
+void searchImageFile(const std::filesystem::path &input, const ProcessingOptions &options, std::ostream &report);
+
+#endif
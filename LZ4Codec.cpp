@@ -0,0 +1,921 @@
+#include "LZ4Codec.h"
+#include "DecoderModels.h"
+#include "ParallelFor.h"
+#include "WinbootError.h"
+#include "msload_extension.h"
+#include "msload_extension_linked.h"
+#include "msload_extension_fast.h"
+#include "msload_extension_fast_linked.h"
+#include "msload_extension_in_place.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+#include <lz4hc.h>
+
+static_assert(sizeof(msload_extension) <= PayloadCodec::MaxExtensionSize, "MSLOAD extension doesn't fit into MSLOAD");
+static_assert(sizeof(msload_extension_linked) <= PayloadCodec::MaxExtensionSize, "MSLOAD extension doesn't fit into MSLOAD");
+static_assert(sizeof(msload_extension_fast) <= PayloadCodec::MaxExtensionSize, "MSLOAD extension doesn't fit into MSLOAD");
+static_assert(sizeof(msload_extension_fast_linked) <= PayloadCodec::MaxExtensionSize, "MSLOAD extension doesn't fit into MSLOAD");
+static_assert(sizeof(msload_extension_in_place) <= PayloadCodec::MaxExtensionSize, "MSLOAD extension doesn't fit into MSLOAD");
+
+namespace {
+    uint64_t estimateBlockCycles(const unsigned char *block, size_t length, const LZ4DecoderModel &model) {
+        auto end = block + length;
+        uint64_t cycles = 0;
+
+        while(block < end) {
+            auto token = *block++;
+            cycles += model.sequence;
+
+            size_t literals = token >> 4;
+            if(literals == 15) {
+                unsigned char byte;
+                do {
+                    byte = *block++;
+                    literals += byte;
+                    cycles += model.countByte;
+                } while(byte == 255 && block < end);
+            }
+
+            block += literals;
+            cycles += model.literalByte * literals;
+
+            if(block >= end)
+                break;
+
+            auto offset = block[0] | (block[1] << 8);
+            block += 2;
+
+            size_t match = token & 15;
+            if(match == 15) {
+                unsigned char byte;
+                do {
+                    byte = *block++;
+                    match += byte;
+                    cycles += model.countByte;
+                } while(byte == 255 && block < end);
+            }
+
+            match += 4;
+            cycles += (offset == 1 ? model.runByte : model.matchByte) * match;
+        }
+
+        return cycles;
+    }
+
+    /*
+     * Compresses the block into 'output', returning its length, or zero if it
+     * doesn't fit into 'capacity' bytes.
+     */
+    size_t compressBlock(std::vector<char> &state, int level, const unsigned char *block, size_t length,
+                         size_t dictionarySize, bool linked, unsigned char *output, size_t capacity) {
+        if(state.empty())
+            state.resize(LZ4_sizeofStateHC());
+
+        int result;
+
+        if(linked) {
+            auto stream = LZ4_initStreamHC(state.data(), state.size());
+            LZ4_resetStreamHC_fast(stream, level);
+
+            if(dictionarySize != 0) {
+                LZ4_loadDictHC(stream, reinterpret_cast<const char *>(block - dictionarySize), dictionarySize);
+            }
+
+            result = LZ4_compress_HC_continue(
+                stream,
+                reinterpret_cast<const char *>(block),
+                reinterpret_cast<char *>(output),
+                length,
+                capacity
+            );
+        } else {
+            result = LZ4_compress_HC_extStateHC(
+                state.data(),
+                reinterpret_cast<const char *>(block),
+                reinterpret_cast<char *>(output),
+                length,
+                capacity,
+                level
+            );
+        }
+        if(result < 0)
+            throw std::logic_error("LZ4_compress_HC failed");
+
+        return result;
+    }
+
+    /*
+     * Optimal parser for LZ4 blocks that minimizes the decoder's estimated
+     * cycles plus CompressionOptions::byteCost per byte of the block, rather
+     * than its size alone: every sequence costs the decoder a token parse, a
+     * count build and a segment swap, which is worth a few bytes of literals.
+     * For every position, it keeps the cheapest way to arrive there with a
+     * literal run and with a match. The only approximation is that the
+     * literal run arriving at a position is either extended or restarted
+     * after the cheapest match. The block follows the LZ4 block format to the
+     * letter, ending with at least five literals, so that any LZ4 decoder
+     * accepts it.
+     */
+    class SequenceParser {
+    public:
+        SequenceParser(const LZ4DecoderModel &model, uint64_t byteCost);
+
+        /*
+         * Writes the block into 'output', returning its length, or zero if it
+         * doesn't fit into 'capacity' bytes.
+         */
+        size_t encode(const unsigned char *block, size_t length, size_t dictionarySize,
+                      unsigned char *output, size_t capacity);
+
+    private:
+        static constexpr size_t MinMatch = 4;
+        static constexpr size_t MaxOffset = 0xFFFF;
+        static constexpr size_t LastLiterals = 5;   // LZ4's LASTLITERALS
+        static constexpr size_t MatchFindLimit = 12; // LZ4's MFLIMIT
+
+        /*
+         * Like in the LZE parser: the hash chains are followed at most
+         * MaxChainDepth links deep, up to the first match of NiceLength
+         * bytes, and every length of a match is considered up to
+         * EnumeratedLengths, but only the full length of longer ones.
+         */
+        static constexpr unsigned int MaxChainDepth = 256;
+        static constexpr size_t NiceLength = 256;
+        static constexpr size_t EnumeratedLengths = 256;
+
+        struct Candidate {
+            size_t length;
+            size_t offset;
+        };
+
+        struct Arrival {
+            uint64_t cost = std::numeric_limits<uint64_t>::max();
+            uint32_t length = 0;
+            uint32_t offset = 0;         // Matches only
+            bool afterLiterals = false;  // Matches only
+
+            inline bool reached() const {
+                return cost != std::numeric_limits<uint64_t>::max();
+            }
+        };
+
+        static inline size_t countBytes(size_t count) {
+            return count < 15 ? 0 : 1 + (count - 15) / 255;
+        }
+
+        inline uint64_t literalsCost(size_t count) const {
+            return count * (m_byteCost + m_model.literalByte) + countBytes(count) * (m_byteCost + m_model.countByte);
+        }
+
+        inline uint64_t matchCost(size_t length, size_t offset) const {
+            return 2 * m_byteCost + countBytes(length - MinMatch) * (m_byteCost + m_model.countByte) +
+                   length * (offset == 1 ? m_model.runByte : m_model.matchByte);
+        }
+
+        inline uint32_t hash(size_t position) const {
+            uint32_t bytes;
+            memcpy(&bytes, m_window + position, sizeof(bytes));
+            return (bytes * 2654435761u) >> 16;
+        }
+
+        void findMatches(size_t position);
+        size_t matchLength(size_t position, size_t offset, size_t limit) const;
+        void arriveWithMatch(size_t index, size_t length, size_t offset, uint64_t cost, bool afterLiterals);
+
+        LZ4DecoderModel m_model;
+        uint64_t m_byteCost;
+
+        const unsigned char *m_window;
+        size_t m_windowSize;
+        size_t m_matchLimit;
+
+        std::vector<int32_t> m_head;
+        std::vector<int32_t> m_previous;
+        std::vector<Candidate> m_candidates;
+        Candidate m_longest;
+
+        std::vector<Arrival> m_literals;
+        std::vector<Arrival> m_matches;
+    };
+
+    SequenceParser::SequenceParser(const LZ4DecoderModel &model, uint64_t byteCost) :
+        m_model(model), m_byteCost(byteCost) {
+
+    }
+
+    size_t SequenceParser::matchLength(size_t position, size_t offset, size_t limit) const {
+        auto current = m_window + position;
+        auto reference = current - offset;
+
+        size_t length = 0;
+        while(length < limit && current[length] == reference[length])
+            length++;
+
+        return length;
+    }
+
+    void SequenceParser::findMatches(size_t position) {
+        m_candidates.clear();
+
+        /*
+         * No match may start in the last MatchFindLimit bytes, nor reach into
+         * the last literals.
+         */
+        if(position + MatchFindLimit > m_windowSize || position + MinMatch > m_matchLimit)
+            return;
+
+        auto limit = m_matchLimit - position;
+
+        /*
+         * Within a long match, the next position matches at the same offset,
+         * only a byte shorter.
+         */
+        if(m_longest.length > NiceLength) {
+            m_longest.length = std::min(m_longest.length - 1, limit);
+            m_candidates.push_back(m_longest);
+            return;
+        }
+
+        m_longest.length = 0;
+
+        size_t best = MinMatch - 1;
+        unsigned int depth = 0;
+
+        for(auto link = m_head[hash(position)]; link >= 0 && depth < MaxChainDepth; link = m_previous[link], depth++) {
+            auto offset = position - link;
+            if(offset > MaxOffset)
+                break;
+
+            if(best < limit && m_window[link + best] != m_window[position + best])
+                continue;
+
+            auto length = matchLength(position, offset, limit);
+            if(length > best) {
+                best = length;
+                m_candidates.push_back(Candidate{ length, offset });
+
+                if(length >= NiceLength || length == limit)
+                    break;
+            }
+        }
+
+        if(!m_candidates.empty())
+            m_longest = m_candidates.back();
+    }
+
+    void SequenceParser::arriveWithMatch(size_t index, size_t length, size_t offset, uint64_t cost, bool afterLiterals) {
+        auto &arrival = m_matches[index];
+        if(cost < arrival.cost) {
+            arrival.cost = cost;
+            arrival.length = length;
+            arrival.offset = offset;
+            arrival.afterLiterals = afterLiterals;
+        }
+    }
+
+    size_t SequenceParser::encode(const unsigned char *block, size_t length, size_t dictionarySize,
+                                  unsigned char *output, size_t capacity) {
+        m_window = block - dictionarySize;
+        m_windowSize = dictionarySize + length;
+        m_matchLimit = length >= MatchFindLimit + 1 ? m_windowSize - LastLiterals : 0;
+
+        m_head.assign(65536, -1);
+        m_previous.resize(m_windowSize);
+        m_longest = Candidate{ 0, 0 };
+
+        auto insert = [this](size_t position) {
+            if(position + sizeof(uint32_t) <= m_windowSize) {
+                auto &head = m_head[hash(position)];
+                m_previous[position] = head;
+                head = static_cast<int32_t>(position);
+            }
+        };
+
+        for(size_t position = 0; position < dictionarySize; position++)
+            insert(position);
+
+        m_literals.assign(length + 1, Arrival());
+        m_matches.assign(length + 1, Arrival());
+
+        /*
+         * The start of the block behaves like the end of a match.
+         */
+        m_matches[0].cost = 0;
+
+        auto sequenceCost = m_byteCost + m_model.sequence;
+
+        for(size_t index = 0; index < length; index++) {
+            auto position = dictionarySize + index;
+            const auto &literals = m_literals[index];
+            const auto &matches = m_matches[index];
+
+            /*
+             * Literals, extending the run or starting a sequence
+             */
+            if(literals.reached()) {
+                auto &next = m_literals[index + 1];
+                auto cost = literals.cost + literalsCost(literals.length + 1) - literalsCost(literals.length);
+                if(cost < next.cost) {
+                    next.cost = cost;
+                    next.length = literals.length + 1;
+                }
+            }
+
+            if(matches.reached()) {
+                auto &next = m_literals[index + 1];
+                auto cost = matches.cost + sequenceCost + literalsCost(1);
+                if(cost < next.cost) {
+                    next.cost = cost;
+                    next.length = 1;
+                }
+            }
+
+            findMatches(position);
+            insert(position);
+
+            /*
+             * Matches, ending the sequence of the literal run, or making up
+             * one without literals
+             */
+            if(m_candidates.empty())
+                continue;
+
+            bool afterLiterals = literals.reached() && (!matches.reached() || literals.cost < matches.cost + sequenceCost);
+            auto baseCost = afterLiterals ? literals.cost : matches.cost + sequenceCost;
+
+            size_t match = MinMatch;
+
+            for(const auto &candidate: m_candidates) {
+                for(; match <= candidate.length; match++) {
+                    if(match > EnumeratedLengths && match != candidate.length)
+                        match = candidate.length;
+
+                    arriveWithMatch(index + match, match, candidate.offset,
+                                    baseCost + matchCost(match, candidate.offset), afterLiterals);
+                }
+            }
+        }
+
+        /*
+         * Walk the cheapest path back, then write it out forwards. The block
+         * always ends with literals, as no match reaches into the last ones.
+         */
+        struct Sequence {
+            size_t literals;
+            size_t match; // Zero for the last sequence
+            size_t offset;
+        };
+
+        std::vector<Sequence> sequences;
+        sequences.push_back(Sequence{ m_literals[length].length, 0, 0 });
+
+        for(size_t index = length - m_literals[length].length; index != 0;) {
+            const auto &arrival = m_matches[index];
+            index -= arrival.length;
+
+            size_t literals = arrival.afterLiterals ? m_literals[index].length : 0;
+            sequences.push_back(Sequence{ literals, arrival.length, arrival.offset });
+            index -= literals;
+        }
+
+        auto out = output;
+        auto end = output + capacity;
+        size_t position = 0;
+
+        auto writeCount = [&](size_t count) {
+            if(count < 15)
+                return true;
+
+            for(count -= 15; count >= 255; count -= 255) {
+                if(out == end)
+                    return false;
+
+                *out++ = 255;
+            }
+
+            if(out == end)
+                return false;
+
+            *out++ = static_cast<unsigned char>(count);
+            return true;
+        };
+
+        for(auto sequence = sequences.rbegin(); sequence != sequences.rend(); ++sequence) {
+            if(out == end)
+                return 0;
+
+            auto matchCount = sequence->match == 0 ? 0 : sequence->match - MinMatch;
+            *out++ = static_cast<unsigned char>((std::min<size_t>(sequence->literals, 15) << 4) |
+                                                std::min<size_t>(matchCount, 15));
+
+            if(!writeCount(sequence->literals) || static_cast<size_t>(end - out) < sequence->literals)
+                return 0;
+
+            memcpy(out, block + position, sequence->literals);
+            out += sequence->literals;
+            position += sequence->literals;
+
+            if(sequence->match == 0)
+                break;
+
+            if(end - out < 2)
+                return 0;
+
+            *out++ = static_cast<unsigned char>(sequence->offset);
+            *out++ = static_cast<unsigned char>(sequence->offset >> 8);
+
+            if(!writeCount(matchCount))
+                return 0;
+
+            position += sequence->match;
+        }
+
+        if(position != length)
+            throw std::logic_error("SequenceParser::encode: the sequences don't cover the block");
+
+        return out - output;
+    }
+
+    /*
+     * The state of whichever parser the options select, for one thread.
+     */
+    class BlockCompressor {
+    public:
+        BlockCompressor(const CompressionOptions &options, const LZ4DecoderModel &model) :
+            m_parser(options.parser), m_level(options.level), m_sequenceParser(model, options.byteCost) {
+        }
+
+        size_t compress(const unsigned char *block, size_t length, size_t dictionarySize, bool linked,
+                        unsigned char *output, size_t capacity) {
+            if(m_parser == LZ4Parser::DecodeCost)
+                return m_sequenceParser.encode(block, length, dictionarySize, output, capacity);
+
+            return compressBlock(m_state, m_level, block, length, dictionarySize, linked, output, capacity);
+        }
+
+    private:
+        LZ4Parser m_parser;
+        int m_level;
+        std::vector<char> m_state;
+        SequenceParser m_sequenceParser;
+    };
+
+    static constexpr size_t inPlaceHeaderSize = 12;
+
+    /*
+     * The extension puts the displaced start of the payload aside right past
+     * the padding, where the start of the copy must not overlap its end.
+     */
+    static constexpr size_t maxDisplacedSize = 512;
+
+    /*
+     * Lays a block out for lz4_decompress_back, which reads it from the top
+     * down: the bytes go in the reverse order, except for the match offsets,
+     * which it reads a word at a time, and so have to keep their low byte
+     * below the high one. 'turned' takes as many bytes as the block.
+     */
+    void turnAround(const unsigned char *block, size_t length, unsigned char *turned) {
+        auto output = turned + length;
+        auto input = block;
+        auto end = block + length;
+
+        auto copyCount = [&](size_t count) {
+            if(count == 15) {
+                unsigned char byte;
+                do {
+                    byte = *input++;
+                    *--output = byte;
+                    count += byte;
+                } while(byte == 255);
+            }
+
+            return count;
+        };
+
+        while(input < end) {
+            auto token = *input++;
+            *--output = token;
+
+            auto literals = copyCount(token >> 4);
+            for(size_t index = 0; index < literals; index++) {
+                *--output = *input++;
+            }
+
+            if(input >= end)
+                break;
+
+            *--output = input[1];
+            *--output = input[0];
+            input += 2;
+
+            copyCount(token & 15);
+        }
+    }
+
+    void writeWord(unsigned char *data, uint16_t word) {
+        data[0] = static_cast<unsigned char>(word);
+        data[1] = static_cast<unsigned char>(word >> 8);
+    }
+
+    uint16_t readWord(const unsigned char *data) {
+        return data[0] | (data[1] << 8);
+    }
+
+    /*
+     * Unpacks an in-place stream, loaded at the start of 'memory', byte by
+     * byte in the same order as msload_extension_in_place does. Returns false
+     * if the extension would overwrite a byte of the stream before reading it,
+     * with how much lower the stream would have to start not to in
+     * 'shortfall'.
+     */
+    bool unpackInPlace(std::vector<unsigned char> &memory, size_t &shortfall) {
+        auto corrupt = []() {
+            return WinbootError(WinbootErrorCode::CorruptStream, "the compressed stream is corrupt");
+        };
+
+        size_t payloadSize = 16 * static_cast<size_t>(readWord(memory.data() + 2));
+        size_t top = 16 * static_cast<size_t>(readWord(memory.data() + 4)) + readWord(memory.data() + 6);
+        size_t blockCount = readWord(memory.data() + 8);
+        size_t displacedSize = readWord(memory.data() + 10);
+
+        /*
+         * The extension pads the payload right away, so the blocks have to be
+         * below its end.
+         */
+        if(top < inPlaceHeaderSize || top > payloadSize || top + displacedSize > memory.size() ||
+           displacedSize < inPlaceHeaderSize || displacedSize > maxDisplacedSize)
+            throw corrupt();
+
+        std::vector<unsigned char> displaced(memory.begin() + top, memory.begin() + top + displacedSize);
+
+        ptrdiff_t read = top - 1;
+        ptrdiff_t write = payloadSize - 1;
+
+        auto readByte = [&]() -> unsigned char {
+            if(read < 0)
+                throw corrupt();
+
+            return memory[read--];
+        };
+
+        auto readCount = [&](size_t count) {
+            if(count == 15) {
+                unsigned char byte;
+                do {
+                    byte = readByte();
+                    count += byte;
+                } while(byte == 255);
+            }
+
+            return count;
+        };
+
+        auto readOffset = [&]() -> size_t {
+            auto high = readByte();
+            return readByte() | (high << 8);
+        };
+
+        auto writeByte = [&](unsigned char byte) {
+            if(write < static_cast<ptrdiff_t>(displacedSize))
+                throw corrupt();
+
+            if(write <= read) {
+                shortfall = read - write + 1;
+                return false;
+            }
+
+            memory[write--] = byte;
+            return true;
+        };
+
+        for(size_t index = 0; index < blockCount; index++) {
+            size_t length = readOffset();
+            bool stored = length == PayloadCodec::StoredBlock;
+            if(stored)
+                length = readOffset();
+
+            if(static_cast<ptrdiff_t>(length) > read + 1)
+                throw corrupt();
+
+            auto end = read - static_cast<ptrdiff_t>(length);
+
+            if(stored) {
+                while(read > end) {
+                    if(!writeByte(readByte()))
+                        return false;
+                }
+
+                continue;
+            }
+
+            while(true) {
+                auto token = readByte();
+
+                for(auto literals = readCount(token >> 4); literals != 0; literals--) {
+                    if(!writeByte(readByte()))
+                        return false;
+                }
+
+                if(read == end)
+                    break;
+
+                if(read < end)
+                    throw corrupt();
+
+                auto offset = readOffset();
+                auto match = readCount(token & 15) + 4;
+
+                if(offset == 0 || write + offset >= payloadSize)
+                    throw corrupt();
+
+                for(; match != 0; match--) {
+                    if(!writeByte(memory[write + offset]))
+                        return false;
+                }
+            }
+        }
+
+        if(write + 1 != static_cast<ptrdiff_t>(displacedSize))
+            throw corrupt();
+
+        memcpy(memory.data(), displaced.data(), displacedSize);
+
+        return true;
+    }
+}
+
+const char *LZ4Codec::name() const {
+    return "lz4";
+}
+
+bool LZ4Codec::recognizes(uint16_t magic) const {
+    return magic == Magic || magic == LinkedMagic || magic == InPlaceMagic;
+}
+
+std::vector<PayloadCodec::Extension> LZ4Codec::extensions() const {
+    return {
+        { msload_extension, sizeof(msload_extension) },
+        { msload_extension_linked, sizeof(msload_extension_linked) },
+        { msload_extension_fast, sizeof(msload_extension_fast) },
+        { msload_extension_fast_linked, sizeof(msload_extension_fast_linked) },
+        { msload_extension_in_place, sizeof(msload_extension_in_place) }
+    };
+}
+
+bool LZ4Codec::unpacksInPlace() const {
+    return true;
+}
+
+bool LZ4Codec::hasLevels(const CompressionOptions &options) const {
+    return options.parser == LZ4Parser::HC;
+}
+
+EncodedPayload LZ4Codec::encode(const unsigned char *payload, size_t payloadSize,
+                                const CompressionOptions &options) const {
+    if(options.level < CompressionOptions::MinLevel || options.level > CompressionOptions::MaxLevel)
+        throw WinbootError(WinbootErrorCode::InvalidOptions, "the LZ4 level has to be from 1 to 12");
+
+    if(options.inPlace)
+        return encodeInPlace(payload, payloadSize, options);
+
+    bool linked = useLinkedBlocks(payloadSize, options);
+    auto blockSize = PayloadCodec::blockSize(options, linked);
+    auto workers = parallelWorkerCount(options.threads, (payloadSize + blockSize - 1) / blockSize);
+
+    /*
+     * Each thread reuses its own LZ4HC state or parser.
+     * LZ4_compress_HC_extStateHC produces exactly the same output as
+     * LZ4_compress_HC, so the result doesn't depend on the thread count.
+     *
+     * Linked blocks only depend on the uncompressed payload preceding them,
+     * which is loaded as the dictionary, so they can be compressed
+     * concurrently just the same.
+     */
+    const auto &model = options.decoder == LZ4Decoder::Fast ? fastLZ4DecoderModel : smallLZ4DecoderModel;
+
+    std::vector<BlockCompressor> compressors(workers, BlockCompressor(options, model));
+
+    EncodedPayload encoded;
+
+    encoded.stream = encodeBlocks(linked ? LinkedMagic : Magic, payload, payloadSize, blockSize, linked, workers,
+        [&](const unsigned char *block, size_t length, size_t dictionarySize,
+            unsigned char *output, size_t capacity, unsigned int worker) {
+            EncodedBlock compressed;
+            compressed.size = compressors[worker].compress(block, length, dictionarySize, linked, output, capacity);
+            compressed.decodeCycles = estimateBlockCycles(output, compressed.size, model);
+
+            return compressed;
+        }, encoded.decodeCycles, encoded.blocks);
+
+    if(options.decoder == LZ4Decoder::Fast) {
+        encoded.extension = linked ? msload_extension_fast_linked : msload_extension_fast;
+        encoded.extensionSize = linked ? sizeof(msload_extension_fast_linked) : sizeof(msload_extension_fast);
+    } else {
+        encoded.extension = linked ? msload_extension_linked : msload_extension;
+        encoded.extensionSize = linked ? sizeof(msload_extension_linked) : sizeof(msload_extension);
+    }
+
+    return encoded;
+}
+
+EncodedPayload LZ4Codec::encodeInPlace(const unsigned char *payload, size_t payloadSize,
+                                       const CompressionOptions &options) const {
+    if(options.linkedBlocks || options.decoder != LZ4Decoder::Small)
+        throw WinbootError(WinbootErrorCode::InvalidOptions, "in-place unpacking doesn't support linked blocks or the fast decoder");
+
+    /*
+     * The extension unpacks the payload from the top down, so it is
+     * compressed back to front: a block of the reversed payload decodes
+     * forwards into the reversed block.
+     */
+    std::vector<unsigned char> reversed(payload, payload + payloadSize);
+    std::reverse(reversed.begin(), reversed.end());
+
+    auto blockSize = PayloadCodec::blockSize(options, false);
+    auto workers = parallelWorkerCount(options.threads, (payloadSize + blockSize - 1) / blockSize);
+    std::vector<BlockCompressor> compressors(workers, BlockCompressor(options, smallLZ4DecoderModel));
+
+    /*
+     * The blocks are compressed into a scratch buffer of each thread, and
+     * turned around from there right into their slots in the stream, which
+     * are laid out like in encodeBlocks().
+     */
+    std::vector<std::vector<unsigned char>> scratch(workers);
+
+    /*
+     * The stream starts right after the header, and the output of its blocks
+     * has to start higher up by enough for the output never to overtake the
+     * input. Start with no margin at all and add whatever falls short, until
+     * nothing does.
+     */
+    size_t displacedSize = inPlaceHeaderSize;
+
+    while(true) {
+        if(displacedSize > maxDisplacedSize || displacedSize >= payloadSize)
+            throw WinbootError(WinbootErrorCode::DoesNotFit, "the payload can't be unpacked in place");
+
+        auto blockCount = (payloadSize - displacedSize + blockSize - 1) / blockSize;
+        std::vector<EncodedBlock> blocks(blockCount);
+        std::vector<BlockStatistics> blockStatistics(blockCount);
+
+        CompressionStream stream(inPlaceHeaderSize + payloadSize + 4 * blockCount);
+
+        auto slotPosition = [&](size_t index) {
+            return inPlaceHeaderSize + index * (blockSize + 4);
+        };
+
+        parallelFor(blockCount, workers, [&](size_t index, unsigned int worker) {
+            Stopwatch stopwatch;
+
+            auto pos = displacedSize + index * blockSize;
+            auto chunk = std::min<size_t>(blockSize, payloadSize - pos);
+
+            auto &compressed = scratch[worker];
+            if(compressed.size() < chunk + 1)
+                compressed.resize(blockSize + 1);
+
+            auto compressedSize = compressors[worker].compress(reversed.data() + payloadSize - pos - chunk, chunk, 0, false,
+                                                               compressed.data(), chunk + 1);
+
+            auto &block = blocks[index];
+            if(compressedSize == 0) {
+                block.decodeCycles = StoredCyclesPerByte * chunk;
+            } else {
+                block.decodeCycles = estimateBlockCycles(compressed.data(), compressedSize, smallLZ4DecoderModel);
+                block.size = compressedSize;
+                turnAround(compressed.data(), compressedSize, stream.buffer() + slotPosition(index));
+            }
+
+            auto &statistics = blockStatistics[index];
+            statistics.size = chunk;
+            statistics.stored = block.size == 0;
+            statistics.compressedSize = statistics.stored ? chunk + 4 : block.size + 2;
+            statistics.timing = stopwatch.elapsed();
+            statistics.onHelperThread = worker != 0;
+        });
+
+        EncodedPayload encoded;
+
+        stream.advanceOutputPointer(inPlaceHeaderSize);
+
+        for(size_t index = 0; index < blockCount; index++) {
+            const auto &block = blocks[index];
+
+            encoded.decodeCycles += block.decodeCycles;
+
+            if(block.size == 0) {
+                auto pos = displacedSize + index * blockSize;
+                auto chunk = std::min<size_t>(blockSize, payloadSize - pos);
+
+                auto blockData = stream.reserveOutputBytes(chunk + 4);
+
+                memcpy(blockData, payload + pos, chunk);
+                writeWord(blockData + chunk, static_cast<uint16_t>(chunk));
+                writeWord(blockData + chunk + 2, StoredBlock);
+
+                stream.advanceOutputPointer(chunk + 4);
+            } else {
+                auto blockData = stream.reserveOutputBytes(block.size + 2);
+
+                memmove(blockData, stream.buffer() + slotPosition(index), block.size);
+                writeWord(blockData + block.size, static_cast<uint16_t>(block.size));
+
+                stream.advanceOutputPointer(block.size + 2);
+            }
+        }
+
+        auto top = stream.size();
+
+        memcpy(stream.reserveOutputBytes(displacedSize), payload, displacedSize);
+        stream.advanceOutputPointer(displacedSize);
+
+        auto header = reinterpret_cast<uint16_t *>(stream.buffer());
+        header[0] = InPlaceMagic;
+        header[1] = payloadSize / 16;
+        header[2] = top / 16;
+        header[3] = top % 16;
+        header[4] = blockCount;
+        header[5] = displacedSize;
+
+        /*
+         * Try it.
+         */
+        std::vector<unsigned char> memory(stream.buffer(), stream.buffer() + stream.size());
+        memory.resize(std::max(stream.size(), payloadSize));
+
+        size_t shortfall;
+        if(top <= payloadSize && unpackInPlace(memory, shortfall)) {
+            if(memcmp(memory.data(), payload, payloadSize) != 0)
+                throw std::logic_error("the in-place stream doesn't unpack to the payload");
+
+            encoded.stream = stream.finish();
+            encoded.extension = msload_extension_in_place;
+            encoded.extensionSize = sizeof(msload_extension_in_place);
+            encoded.blocks = std::move(blockStatistics);
+
+            return encoded;
+        }
+
+        if(top > payloadSize)
+            throw WinbootError(WinbootErrorCode::DoesNotFit, "the payload can't be unpacked in place");
+
+        /*
+         * Keeping the blocks even, as the extension copies the stored ones a
+         * word at a time.
+         */
+        displacedSize += (shortfall + 1) & ~static_cast<size_t>(1);
+    }
+}
+
+size_t LZ4Codec::decodeInPlace(const unsigned char *data, size_t size, std::vector<unsigned char> &payload) const {
+    if(size < inPlaceHeaderSize)
+        throw WinbootError(WinbootErrorCode::CorruptStream, "the compressed stream is truncated");
+
+    size_t payloadSize = 16 * static_cast<size_t>(readWord(data + 2));
+    size_t end = 16 * static_cast<size_t>(readWord(data + 4)) + readWord(data + 6) + readWord(data + 10);
+
+    if(end > size)
+        throw WinbootError(WinbootErrorCode::CorruptStream, "the compressed stream is truncated");
+
+    payload.assign(data, data + end);
+    payload.resize(std::max(end, payloadSize));
+
+    size_t shortfall;
+    if(!unpackInPlace(payload, shortfall))
+        throw WinbootError(WinbootErrorCode::CorruptStream, "the compressed stream can't be unpacked in place");
+
+    payload.resize(payloadSize);
+
+    return end;
+}
+
+size_t LZ4Codec::decode(const unsigned char *data, size_t size, std::vector<unsigned char> &payload) const {
+    if(size >= 2 && *reinterpret_cast<const uint16_t *>(data) == InPlaceMagic)
+        return decodeInPlace(data, size, payload);
+
+    bool linked = size >= 2 && *reinterpret_cast<const uint16_t *>(data) == LinkedMagic;
+
+    return decodeBlocks(data, size, payload, [&](const unsigned char *block, size_t length, size_t produced) -> size_t {
+        auto source = reinterpret_cast<const char *>(block);
+        auto destination = reinterpret_cast<char *>(payload.data() + produced);
+        int result;
+
+        if(linked) {
+            auto dictionarySize = std::min(produced, LinkedWindow);
+
+            result = LZ4_decompress_safe_usingDict(source, destination, length, payload.size() - produced,
+                                                   destination - dictionarySize, dictionarySize);
+        } else {
+            result = LZ4_decompress_safe(source, destination, length, payload.size() - produced);
+        }
+
+        if(result < 0)
+            throw WinbootError(WinbootErrorCode::CorruptStream, "the compressed stream is corrupt");
+
+        return result;
+    });
+}
@@ -0,0 +1,56 @@
+#ifndef LZ4_CODEC_H
+#define LZ4_CODEC_H
+
+#include "PayloadCodec.h"
+
+/*
+ * LZ4HC, at the maximum level unless CompressionOptions::level says
+ * otherwise, or our own parser minimizing the cost to unpack
+ * (CompressionOptions::parser), decoded by lz4_decompress_small or
+ * lz4_decompress_fast. Stream magic: 'LZ', or 'LK' for linked blocks.
+ *
+ * With CompressionOptions::inPlace, the stream is laid out to be unpacked
+ * backwards, right where MSLOAD loads it, by lz4_decompress_back instead.
+ * Stream magic: 'LI'. Such a stream doesn't use the common framing:
+ * 2 bytes: stream magic
+ * 2 bytes: source size, paragraphs
+ * 2 bytes: top of the blocks, paragraphs from the start of the stream
+ * 2 bytes: and bytes past that paragraph
+ * 2 bytes: number of blocks
+ * 2 bytes: number of bytes displaced from the start of the payload
+ * the blocks of the rest of the payload, from the bottom up:
+ *   the block, turned around (see turnAround in LZ4Codec.cpp)
+ *   2 bytes: its length, bytes
+ * or, for blocks that don't compress:
+ *   the payload, as is
+ *   2 bytes: its length, bytes
+ *   2 bytes: 0xFFFF
+ * the displaced start of the payload
+ *
+ * The extension reads the blocks from the top down, and writes the payload
+ * from its top down over them. The output of the blocks starts above their
+ * input by as much as it takes for it never to overtake the input, and the
+ * header and that margin are displaced to the top.
+ */
+class LZ4Codec final : public PayloadCodec {
+public:
+    const char *name() const override;
+    bool recognizes(uint16_t magic) const override;
+    EncodedPayload encode(const unsigned char *payload, size_t payloadSize,
+                          const CompressionOptions &options) const override;
+    size_t decode(const unsigned char *data, size_t size, std::vector<unsigned char> &payload) const override;
+    std::vector<Extension> extensions() const override;
+    bool unpacksInPlace() const override;
+    bool hasLevels(const CompressionOptions &options) const override;
+
+    static constexpr uint16_t Magic = 0x5A4C; // 'LZ'
+    static constexpr uint16_t LinkedMagic = 0x4B4C; // 'LK'
+    static constexpr uint16_t InPlaceMagic = 0x494C; // 'LI'
+
+private:
+    EncodedPayload encodeInPlace(const unsigned char *payload, size_t payloadSize,
+                                 const CompressionOptions &options) const;
+    size_t decodeInPlace(const unsigned char *data, size_t size, std::vector<unsigned char> &payload) const;
+};
+
+#endif
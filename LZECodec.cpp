@@ -0,0 +1,551 @@
+#include "LZECodec.h"
+#include "DecoderModels.h"
+#include "ParallelFor.h"
+#include "WinbootError.h"
+#include "msload_extension_lze.h"
+#include "msload_extension_lze_linked.h"
+
+#include <bit>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+static_assert(sizeof(msload_extension_lze) <= PayloadCodec::MaxExtensionSize, "MSLOAD extension doesn't fit into MSLOAD");
+static_assert(sizeof(msload_extension_lze_linked) <= PayloadCodec::MaxExtensionSize, "MSLOAD extension doesn't fit into MSLOAD");
+
+namespace {
+    static constexpr size_t MinMatch = 2;
+    static constexpr size_t MaxOffset = 0xFFFF;
+    static constexpr size_t EndMarker = 257;
+
+    /*
+     * The match finder follows hash chains of the two leading bytes at most
+     * MaxChainDepth links deep, and stops at the first match of NiceLength
+     * bytes. The parser considers every length of a match up to
+     * EnumeratedLengths, and only the full length of longer ones.
+     */
+    static constexpr unsigned int MaxChainDepth = 256;
+    static constexpr size_t NiceLength = 256;
+    static constexpr size_t EnumeratedLengths = 256;
+
+    inline unsigned int gammaBits(size_t value) {
+        return 2 * std::bit_width(value) - 1;
+    }
+
+    class BitWriter {
+    public:
+        explicit BitWriter(std::vector<unsigned char> &output) : m_output(output) {
+        }
+
+        void bit(bool value) {
+            if(m_bitsLeft == 0) {
+                m_bitsPosition = m_output.size();
+                m_output.push_back(0);
+                m_bitsLeft = 8;
+            }
+
+            m_bitsLeft--;
+            m_bitsWritten++;
+
+            if(value)
+                m_output[m_bitsPosition] |= 1 << m_bitsLeft;
+        }
+
+        void byte(unsigned char value) {
+            m_output.push_back(value);
+        }
+
+        void gamma(size_t value) {
+            for(int bit = std::bit_width(value) - 2; bit >= 0; bit--) {
+                this->bit(false);
+                this->bit((value >> bit) & 1);
+            }
+
+            this->bit(true);
+        }
+
+        inline uint64_t bitsWritten() const {
+            return m_bitsWritten;
+        }
+
+    private:
+        std::vector<unsigned char> &m_output;
+        size_t m_bitsPosition = 0;
+        unsigned int m_bitsLeft = 0;
+        uint64_t m_bitsWritten = 0;
+    };
+
+    class BitReader {
+    public:
+        BitReader(const unsigned char *data, size_t size) : m_data(data), m_end(data + size) {
+        }
+
+        bool bit() {
+            if(m_bitsLeft == 0) {
+                m_bits = byte();
+                m_bitsLeft = 8;
+            }
+
+            m_bitsLeft--;
+
+            return (m_bits >> m_bitsLeft) & 1;
+        }
+
+        unsigned char byte() {
+            if(m_data == m_end)
+                throw WinbootError(WinbootErrorCode::CorruptStream, "the compressed stream is corrupt");
+
+            return *m_data++;
+        }
+
+        size_t gamma() {
+            size_t value = 1;
+
+            while(!bit()) {
+                value = 2 * value + bit();
+
+                if(value > 0xFFFF)
+                    throw WinbootError(WinbootErrorCode::CorruptStream, "the compressed stream is corrupt");
+            }
+
+            return value;
+        }
+
+        inline bool atEnd() const {
+            return m_data == m_end;
+        }
+
+    private:
+        const unsigned char *m_data;
+        const unsigned char *m_end;
+        unsigned char m_bits = 0;
+        unsigned int m_bitsLeft = 0;
+    };
+
+    /*
+     * Optimal parser over the matches the hash chains find. For every
+     * position, it keeps the cheapest way, in bits, to arrive there with a
+     * literal run and with a match, which is enough to account for the token
+     * that may follow each. The only approximation is that the literal run
+     * arriving at a position is either extended or restarted after the
+     * cheapest match, and that the repeat offset is the one that comes with
+     * the cheapest arrival.
+     */
+    class BlockParser {
+    public:
+        /*
+         * Returns the encoded block, which stays valid until the next call.
+         */
+        const std::vector<unsigned char> &encode(const unsigned char *block, size_t length, size_t dictionarySize,
+                                                 uint64_t &cycles);
+
+    private:
+        struct Candidate {
+            size_t length;
+            size_t offset;
+        };
+
+        struct Arrival {
+            uint32_t cost = std::numeric_limits<uint32_t>::max();
+
+            /*
+             * For a literal run, the offset of the match preceding it; for a
+             * match, its own.
+             */
+            uint32_t offset = 1;
+            uint32_t length = 0;
+
+            bool afterLiterals = false; // Matches only
+            bool repeat = false; // Matches only
+
+            inline bool reached() const {
+                return cost != std::numeric_limits<uint32_t>::max();
+            }
+        };
+
+        void findMatches(size_t position);
+        size_t matchLength(size_t position, size_t offset) const;
+        void arriveWithMatch(size_t position, size_t length, size_t offset, uint32_t cost, bool afterLiterals,
+                             bool repeat);
+
+        const unsigned char *m_window;
+        size_t m_windowSize;
+
+        std::vector<int32_t> m_head;
+        std::vector<int32_t> m_previous;
+        std::vector<Candidate> m_candidates;
+        Candidate m_longest;
+
+        std::vector<Arrival> m_literals;
+        std::vector<Arrival> m_matches;
+
+        std::vector<unsigned char> m_output;
+    };
+
+    size_t BlockParser::matchLength(size_t position, size_t offset) const {
+        auto current = m_window + position;
+        auto reference = current - offset;
+        auto limit = m_windowSize - position;
+
+        size_t length = 0;
+        while(length < limit && current[length] == reference[length])
+            length++;
+
+        return length;
+    }
+
+    void BlockParser::findMatches(size_t position) {
+        m_candidates.clear();
+
+        /*
+         * Within a long match, the next position matches at the same offset,
+         * only a byte shorter; that is plenty, and saves going down the
+         * chains through every position of a long run.
+         */
+        if(m_longest.length > NiceLength) {
+            m_longest.length--;
+            m_candidates.push_back(m_longest);
+            return;
+        }
+
+        m_longest.length = 0;
+
+        if(position + MinMatch > m_windowSize)
+            return;
+
+        size_t best = MinMatch - 1;
+        unsigned int depth = 0;
+
+        for(auto link = m_head[m_window[position] | (m_window[position + 1] << 8)];
+            link >= 0 && depth < MaxChainDepth;
+            link = m_previous[link], depth++) {
+
+            auto offset = position - link;
+            if(offset > MaxOffset)
+                break;
+
+            if(position + best < m_windowSize && m_window[link + best] != m_window[position + best])
+                continue;
+
+            auto length = matchLength(position, offset);
+            if(length > best) {
+                best = length;
+                m_candidates.push_back(Candidate{ length, offset });
+
+                if(length >= NiceLength)
+                    break;
+            }
+        }
+
+        if(!m_candidates.empty())
+            m_longest = m_candidates.back();
+    }
+
+    void BlockParser::arriveWithMatch(size_t position, size_t length, size_t offset, uint32_t cost,
+                                       bool afterLiterals, bool repeat) {
+        auto &arrival = m_matches[position];
+        if(cost < arrival.cost) {
+            arrival.cost = cost;
+            arrival.offset = offset;
+            arrival.length = length;
+            arrival.afterLiterals = afterLiterals;
+            arrival.repeat = repeat;
+        }
+    }
+
+    const std::vector<unsigned char> &BlockParser::encode(const unsigned char *block, size_t length,
+                                                           size_t dictionarySize, uint64_t &cycles) {
+        m_window = block - dictionarySize;
+        m_windowSize = dictionarySize + length;
+
+        m_head.assign(65536, -1);
+        m_previous.resize(m_windowSize);
+        m_longest = Candidate{ 0, 0 };
+
+        auto insert = [this](size_t position) {
+            if(position + 1 < m_windowSize) {
+                auto &head = m_head[m_window[position] | (m_window[position + 1] << 8)];
+                m_previous[position] = head;
+                head = static_cast<int32_t>(position);
+            }
+        };
+
+        for(size_t position = 0; position < dictionarySize; position++)
+            insert(position);
+
+        m_literals.assign(length + 1, Arrival());
+        m_matches.assign(length + 1, Arrival());
+
+        /*
+         * The start of the block behaves like the end of a match at offset
+         * 1, except that the first literal run takes no control bit.
+         */
+        m_matches[0].cost = 0;
+        m_matches[0].offset = 1;
+
+        size_t repeatPosition = 0;
+        size_t repeatOffset = 0;
+        size_t repeatLength = 0;
+
+        for(size_t index = 0; index < length; index++) {
+            auto position = dictionarySize + index;
+            const auto &literals = m_literals[index];
+            const auto &matches = m_matches[index];
+
+            /*
+             * Literals
+             */
+            if(literals.reached()) {
+                auto &next = m_literals[index + 1];
+                uint32_t cost = literals.cost + 8 - gammaBits(literals.length) + gammaBits(literals.length + 1);
+                if(cost < next.cost) {
+                    next.cost = cost;
+                    next.offset = literals.offset;
+                    next.length = literals.length + 1;
+                }
+            }
+
+            if(matches.reached()) {
+                auto &next = m_literals[index + 1];
+                uint32_t cost = matches.cost + (index == 0 ? 0 : 1) + gammaBits(1) + 8;
+                if(cost < next.cost) {
+                    next.cost = cost;
+                    next.offset = matches.offset;
+                    next.length = 1;
+                }
+            }
+
+            findMatches(position);
+            insert(position);
+
+            if(index == 0)
+                continue;
+
+            /*
+             * Match at the last offset
+             */
+            if(literals.reached()) {
+                if(repeatOffset == literals.offset && repeatPosition + 1 == position && repeatLength != 0) {
+                    repeatLength--;
+                } else {
+                    repeatOffset = literals.offset;
+                    repeatLength = repeatOffset <= position ? matchLength(position, repeatOffset) : 0;
+                }
+                repeatPosition = position;
+
+                for(size_t match = 1; match <= repeatLength; match++) {
+                    if(match > EnumeratedLengths && match != repeatLength)
+                        match = repeatLength;
+
+                    arriveWithMatch(index + match, match, repeatOffset,
+                                    literals.cost + 1 + gammaBits(match), true, true);
+                }
+            }
+
+            /*
+             * Matches at a new offset
+             */
+            if(m_candidates.empty())
+                continue;
+
+            bool afterLiterals = literals.reached() && (!matches.reached() || literals.cost < matches.cost);
+            auto baseCost = (afterLiterals ? literals.cost : matches.cost) + 1;
+
+            size_t match = MinMatch;
+
+            for(const auto &candidate: m_candidates) {
+                auto offsetCost = baseCost + gammaBits(((candidate.offset - 1) >> 8) + 1) + 8;
+
+                for(; match <= candidate.length; match++) {
+                    if(match > EnumeratedLengths && match != candidate.length)
+                        match = candidate.length;
+
+                    arriveWithMatch(index + match, match, candidate.offset,
+                                    offsetCost + gammaBits(match - 1), afterLiterals, false);
+                }
+            }
+        }
+
+        /*
+         * Walk the cheapest path back, then write it out forwards.
+         */
+        struct Token {
+            size_t length;
+            size_t offset; // Zero for literal runs
+            bool repeat;
+        };
+
+        std::vector<Token> tokens;
+
+        bool atLiterals = m_literals[length].cost <= m_matches[length].cost;
+
+        for(size_t index = length; index != 0;) {
+            if(atLiterals) {
+                const auto &arrival = m_literals[index];
+                tokens.push_back(Token{ arrival.length, 0, false });
+                index -= arrival.length;
+                atLiterals = false;
+            } else {
+                const auto &arrival = m_matches[index];
+                tokens.push_back(Token{ arrival.length, arrival.offset, arrival.repeat });
+                index -= arrival.length;
+                atLiterals = arrival.afterLiterals;
+            }
+        }
+
+        m_output.clear();
+        m_output.reserve(length + length / 8 + 16);
+
+        BitWriter writer(m_output);
+        uint64_t tokenCycles = 0;
+        size_t position = 0;
+        bool first = true;
+
+        for(auto token = tokens.rbegin(); token != tokens.rend(); ++token) {
+            if(token->offset == 0) {
+                if(!first)
+                    writer.bit(false);
+
+                writer.gamma(token->length);
+
+                for(size_t byte = 0; byte < token->length; byte++)
+                    writer.byte(block[position + byte]);
+
+                tokenCycles += lzeDecoderModel.literalRun + lzeDecoderModel.literalByte * token->length;
+            } else if(token->repeat) {
+                writer.bit(false);
+                writer.gamma(token->length);
+
+                tokenCycles += lzeDecoderModel.repeatMatch + lzeDecoderModel.matchByte * token->length;
+            } else {
+                writer.bit(true);
+                writer.gamma(((token->offset - 1) >> 8) + 1);
+                writer.byte((token->offset - 1) & 0xFF);
+                writer.gamma(token->length - 1);
+
+                tokenCycles += lzeDecoderModel.newMatch + lzeDecoderModel.matchByte * token->length;
+            }
+
+            position += token->length;
+            first = false;
+        }
+
+        writer.bit(true);
+        writer.gamma(EndMarker);
+
+        cycles = tokenCycles + lzeDecoderModel.bit * writer.bitsWritten();
+
+        return m_output;
+    }
+}
+
+const char *LZECodec::name() const {
+    return "lze";
+}
+
+bool LZECodec::recognizes(uint16_t magic) const {
+    return magic == Magic || magic == LinkedMagic;
+}
+
+std::vector<PayloadCodec::Extension> LZECodec::extensions() const {
+    return {
+        { msload_extension_lze, sizeof(msload_extension_lze) },
+        { msload_extension_lze_linked, sizeof(msload_extension_lze_linked) }
+    };
+}
+
+EncodedPayload LZECodec::encode(const unsigned char *payload, size_t payloadSize,
+                                const CompressionOptions &options) const {
+    bool linked = useLinkedBlocks(payloadSize, options);
+    auto blockSize = PayloadCodec::blockSize(options, linked);
+    auto workers = parallelWorkerCount(options.threads, (payloadSize + blockSize - 1) / blockSize);
+
+    /*
+     * Every thread reuses its own parser; blocks only depend on the payload,
+     * so the output doesn't depend on the thread count.
+     */
+    std::vector<BlockParser> parsers(workers);
+
+    EncodedPayload encoded;
+
+    encoded.stream = encodeBlocks(linked ? LinkedMagic : Magic, payload, payloadSize, blockSize, linked, workers,
+        [&](const unsigned char *block, size_t length, size_t dictionarySize,
+            unsigned char *output, size_t capacity, unsigned int worker) {
+            EncodedBlock compressed;
+            const auto &data = parsers[worker].encode(block, length, dictionarySize, compressed.decodeCycles);
+
+            if(data.size() <= capacity) {
+                memcpy(output, data.data(), data.size());
+                compressed.size = data.size();
+            }
+
+            return compressed;
+        }, encoded.decodeCycles, encoded.blocks);
+
+    encoded.extension = linked ? msload_extension_lze_linked : msload_extension_lze;
+    encoded.extensionSize = linked ? sizeof(msload_extension_lze_linked) : sizeof(msload_extension_lze);
+
+    return encoded;
+}
+
+size_t LZECodec::decode(const unsigned char *data, size_t size, std::vector<unsigned char> &payload) const {
+    bool linked = size >= 2 && *reinterpret_cast<const uint16_t *>(data) == LinkedMagic;
+
+    return decodeBlocks(data, size, payload, [&](const unsigned char *block, size_t length, size_t produced) -> size_t {
+        BitReader reader(block, length);
+
+        auto start = produced;
+        auto base = linked ? start - std::min(start, LinkedWindow) : start;
+        size_t offset = 1;
+        bool afterLiterals = true;
+
+        auto copyMatch = [&](size_t count) {
+            if(offset > produced - base || count > payload.size() - produced)
+                throw WinbootError(WinbootErrorCode::CorruptStream, "the compressed stream is corrupt");
+
+            for(size_t byte = 0; byte < count; byte++, produced++)
+                payload[produced] = payload[produced - offset];
+        };
+
+        auto copyLiterals = [&]() {
+            auto count = reader.gamma();
+            if(count > payload.size() - produced)
+                throw WinbootError(WinbootErrorCode::CorruptStream, "the compressed stream is corrupt");
+
+            for(size_t byte = 0; byte < count; byte++)
+                payload[produced++] = reader.byte();
+        };
+
+        copyLiterals();
+
+        while(true) {
+            if(!reader.bit()) {
+                if(afterLiterals) {
+                    copyMatch(reader.gamma());
+                    afterLiterals = false;
+                } else {
+                    copyLiterals();
+                    afterLiterals = true;
+                }
+
+                continue;
+            }
+
+            auto high = reader.gamma() - 1;
+            if(high == EndMarker - 1)
+                break;
+
+            if(high > 255)
+                throw WinbootError(WinbootErrorCode::CorruptStream, "the compressed stream is corrupt");
+
+            offset = (high << 8 | reader.byte()) + 1;
+            copyMatch(reader.gamma() + 1);
+            afterLiterals = false;
+        }
+
+        if(!reader.atEnd())
+            throw WinbootError(WinbootErrorCode::CorruptStream, "the compressed stream is corrupt");
+
+        return produced - start;
+    });
+}
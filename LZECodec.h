@@ -0,0 +1,33 @@
+#ifndef LZE_CODEC_H
+#define LZE_CODEC_H
+
+#include "PayloadCodec.h"
+
+/*
+ * LZE: LZ77 with interlaced Elias gamma coded counts and a repeat offset, in
+ * the style of ZX0. The control bits are packed into bytes interleaved with
+ * the literals and the offsets, so the decoder never has to shift anything
+ * but its bit buffer. Denser than LZ4, slower to decode. Stream magic: 'EZ',
+ * or 'EK' for linked blocks.
+ *
+ * A block is a literal run, followed by any number of:
+ *   0 <len>                   - match at the last offset (only after literals)
+ *   1 <hi + 1> <lo> <len - 1> - match at offset (hi * 256 + lo) + 1
+ *   0 <len> <literals>        - literal run (only after a match)
+ * and is terminated by a new match with hi + 1 = 257. The last offset starts
+ * out as 1 in every block.
+ */
+class LZECodec final : public PayloadCodec {
+public:
+    const char *name() const override;
+    bool recognizes(uint16_t magic) const override;
+    EncodedPayload encode(const unsigned char *payload, size_t payloadSize,
+                          const CompressionOptions &options) const override;
+    size_t decode(const unsigned char *data, size_t size, std::vector<unsigned char> &payload) const override;
+    std::vector<Extension> extensions() const override;
+
+    static constexpr uint16_t Magic = 0x5A45; // 'EZ'
+    static constexpr uint16_t LinkedMagic = 0x4B45; // 'EK'
+};
+
+#endif
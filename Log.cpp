@@ -0,0 +1,71 @@
+#include "Log.h"
+
+#include <cstdarg>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+namespace {
+    void defaultSink(LogLevel level, const char *message) {
+        if(level == LogLevel::Error) {
+            fprintf(stderr, "%s\n", message);
+        } else {
+            printf("%s\n", message);
+        }
+    }
+
+    std::mutex sinkMutex;
+    LogSink processSink = defaultSink;
+
+    thread_local const LogSink *threadSink = nullptr;
+}
+
+void setLogSink(LogSink sink) {
+    std::unique_lock<std::mutex> lock(sinkMutex);
+    processSink = std::move(sink);
+}
+
+ScopedLogSink::ScopedLogSink(const LogSink *sink) : m_previous(threadSink) {
+    threadSink = sink;
+}
+
+ScopedLogSink::~ScopedLogSink() {
+    threadSink = m_previous;
+}
+
+const LogSink *threadLogSink() {
+    return threadSink;
+}
+
+void logMessage(LogLevel level, const char *format, ...) {
+    va_list args;
+
+    va_start(args, format);
+    int length = vsnprintf(nullptr, 0, format, args);
+    va_end(args);
+
+    if(length < 0)
+        return;
+
+    std::vector<char> message(length + 1);
+
+    va_start(args, format);
+    vsnprintf(message.data(), message.size(), format, args);
+    va_end(args);
+
+    /*
+     * The sink of the thread is the caller's own business, so it's called
+     * without holding up the threads that log elsewhere.
+     */
+    if(auto sink = threadSink) {
+        if(*sink)
+            (*sink)(level, message.data());
+
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(sinkMutex);
+
+    if(processSink)
+        processSink(level, message.data());
+}
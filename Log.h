@@ -0,0 +1,49 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <functional>
+
+enum class LogLevel {
+    Info,
+    Error
+};
+
+/*
+ * Receives the messages one line at a time, without the line break.
+ */
+using LogSink = std::function<void(LogLevel level, const char *message)>;
+
+/*
+ * Replaces the sink of the threads that don't have one of their own. The
+ * default one prints the informational messages to the standard output, and
+ * the errors to the standard error. An empty sink discards the messages. The
+ * sink is only ever called by one thread at a time.
+ */
+void setLogSink(LogSink sink);
+
+/*
+ * Directs the messages of the calling thread into 'sink' for as long as the
+ * object exists. parallelFor() passes it on to its workers, which call it
+ * without any locking, so it has to cope with being called concurrently.
+ */
+class ScopedLogSink {
+public:
+    explicit ScopedLogSink(const LogSink *sink);
+    ~ScopedLogSink();
+
+    ScopedLogSink(const ScopedLogSink &other) = delete;
+    ScopedLogSink &operator =(const ScopedLogSink &other) = delete;
+
+private:
+    const LogSink *m_previous;
+};
+
+/*
+ * Returns the sink of the calling thread, or nullptr if it uses the
+ * process-wide one.
+ */
+const LogSink *threadLogSink();
+
+void logMessage(LogLevel level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+#endif
@@ -0,0 +1,80 @@
+#include "MappedFile.h"
+#include "FileIO.h"
+
+#include <stdexcept>
+#include <system_error>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const std::filesystem::path &path) : m_fd(-1), m_data(nullptr), m_size(0) {
+    m_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(m_fd < 0)
+        throw std::system_error(errno, std::generic_category(), "unable to open " + path.string());
+
+    struct stat st;
+    if(fstat(m_fd, &st) < 0) {
+        auto error = errno;
+        close(m_fd);
+        throw std::system_error(error, std::generic_category(), "fstat failed");
+    }
+
+    m_size = static_cast<size_t>(st.st_size);
+
+    /*
+     * mmap doesn't accept empty mappings.
+     */
+    if(m_size != 0) {
+        auto data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+        if(data == MAP_FAILED) {
+            auto error = errno;
+            close(m_fd);
+            throw std::system_error(error, std::generic_category(), "mmap failed");
+        }
+
+        m_data = static_cast<const unsigned char *>(data);
+    }
+}
+
+MappedFile::~MappedFile() {
+    if(m_data)
+        munmap(const_cast<unsigned char *>(m_data), m_size);
+
+    close(m_fd);
+}
+
+void MappedFile::copyTo(int fd, size_t offset, size_t length) const {
+    if(offset > m_size || length > m_size - offset)
+        throw std::logic_error("MappedFile::copyTo: range exceeds the file");
+
+    auto inputOffset = static_cast<off_t>(offset);
+
+    while(length > 0) {
+        auto copied = copy_file_range(m_fd, &inputOffset, fd, nullptr, length, 0);
+
+        if(copied < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+            copied = sendfile(fd, m_fd, &inputOffset, length);
+
+            if(copied < 0 && (errno == ENOSYS || errno == EINVAL)) {
+                writeAll(fd, m_data + inputOffset, length);
+                return;
+            }
+        }
+
+        if(copied < 0) {
+            if(errno == EINTR)
+                continue;
+
+            throw std::system_error(errno, std::generic_category(), "copying file data failed");
+        }
+
+        if(copied == 0)
+            throw std::logic_error("MappedFile::copyTo: unexpected end of file");
+
+        length -= copied;
+    }
+}
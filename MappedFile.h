@@ -0,0 +1,40 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <filesystem>
+
+/*
+ * A read-only memory mapping of a whole file. The file descriptor is kept
+ * open, so that ranges of the file can also be copied into other files by
+ * the kernel, without passing through user space.
+ */
+class MappedFile {
+public:
+    explicit MappedFile(const std::filesystem::path &path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile &other) = delete;
+    MappedFile &operator =(const MappedFile &other) = delete;
+
+    inline const unsigned char *data() const {
+        return m_data;
+    }
+
+    inline size_t size() const {
+        return m_size;
+    }
+
+    /*
+     * Appends 'length' bytes starting at 'offset' of this file to the
+     * current position of 'fd', using copy_file_range or sendfile where the
+     * kernel supports it, and plain writes from the mapping otherwise.
+     */
+    void copyTo(int fd, size_t offset, size_t length) const;
+
+private:
+    int m_fd;
+    const unsigned char *m_data;
+    size_t m_size;
+};
+
+#endif
@@ -0,0 +1,75 @@
+#include "ParallelFor.h"
+#include "Log.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+unsigned int parallelWorkerCount(unsigned int threads, size_t count) {
+    if(threads == 0) {
+        threads = std::max(1U, std::thread::hardware_concurrency());
+    }
+
+    return static_cast<unsigned int>(std::max<size_t>(1, std::min<size_t>(threads, count)));
+}
+
+void parallelFor(size_t count, unsigned int workers,
+                 const std::function<void(size_t index, unsigned int worker)> &body) {
+    if(workers <= 1) {
+        for(size_t index = 0; index < count; index++) {
+            body(index, 0);
+        }
+
+        return;
+    }
+
+    std::atomic<size_t> nextIndex(0);
+    std::atomic<bool> failed(false);
+    std::exception_ptr firstException;
+    std::mutex exceptionMutex;
+
+    /*
+     * The messages of the workers go wherever the caller's do.
+     */
+    auto sink = threadLogSink();
+
+    auto worker = [&](unsigned int workerIndex) {
+        ScopedLogSink log(sink);
+
+        while(!failed.load(std::memory_order_relaxed)) {
+            auto index = nextIndex.fetch_add(1, std::memory_order_relaxed);
+            if(index >= count)
+                break;
+
+            try {
+                body(index, workerIndex);
+            } catch(...) {
+                std::unique_lock<std::mutex> lock(exceptionMutex);
+
+                if(!firstException)
+                    firstException = std::current_exception();
+
+                failed.store(true, std::memory_order_relaxed);
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(workers - 1);
+
+    for(unsigned int workerIndex = 1; workerIndex < workers; workerIndex++) {
+        threads.emplace_back(worker, workerIndex);
+    }
+
+    worker(0);
+
+    for(auto &thread: threads) {
+        thread.join();
+    }
+
+    if(firstException)
+        std::rethrow_exception(firstException);
+}
@@ -0,0 +1,23 @@
+#ifndef PARALLEL_FOR_H
+#define PARALLEL_FOR_H
+
+#include <cstddef>
+#include <functional>
+
+/*
+ * Returns the number of workers parallelFor will use to process 'count'
+ * items with at most 'threads' threads (zero meaning one per CPU).
+ */
+unsigned int parallelWorkerCount(unsigned int threads, size_t count);
+
+/*
+ * Calls body(index, worker) for every index in [0, count), distributing the
+ * indices dynamically over 'workers' threads. 'worker' identifies the calling
+ * thread and is below 'workers', so that the body can keep per-thread state
+ * in a plain array. If the body throws, the remaining indices are skipped and
+ * the first exception is rethrown once all threads have stopped.
+ */
+void parallelFor(size_t count, unsigned int workers,
+                 const std::function<void(size_t index, unsigned int worker)> &body);
+
+#endif
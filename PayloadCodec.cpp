@@ -0,0 +1,229 @@
+#include "PayloadCodec.h"
+#include "CompressionStream.h"
+#include "ParallelFor.h"
+#include "LZ4Codec.h"
+#include "LZECodec.h"
+#include "WinbootError.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+PayloadCodec::~PayloadCodec() = default;
+
+bool PayloadCodec::useLinkedBlocks(size_t payloadSize, const CompressionOptions &options) {
+    return options.linkedBlocks && payloadSize > LinkedBlockSize;
+}
+
+size_t PayloadCodec::blockSize(const CompressionOptions &options, bool linked) {
+    if(linked) {
+        if(options.blockSize != 0)
+            throw WinbootError(WinbootErrorCode::InvalidOptions, "the length of linked blocks can't be changed");
+
+        return LinkedBlockSize;
+    }
+
+    if(options.blockSize == 0)
+        return IndependentBlockSize;
+
+    if(options.blockSize < MinBlockSize || options.blockSize > MaxBlockSize || options.blockSize % 16 != 0)
+        throw WinbootError(WinbootErrorCode::InvalidOptions, "the block size has to be a multiple of 16 from 1024 to 64512");
+
+    return options.blockSize;
+}
+
+bool PayloadCodec::unpacksInPlace() const {
+    return false;
+}
+
+bool PayloadCodec::hasLevels(const CompressionOptions &) const {
+    return false;
+}
+
+namespace {
+    /*
+     * 8088 cycles the extensions spend per byte of the stream moving it out
+     * of the way of the output (REP MOVSB).
+     */
+    static constexpr uint64_t relocationCyclesPerByte = 17;
+}
+
+StreamBuffer PayloadCodec::encodeBlocks(uint16_t magic, const unsigned char *payload, size_t payloadSize,
+                                        size_t blockSize, bool linked, unsigned int workers, const BlockEncoder &encodeBlock,
+                                        uint64_t &decodeCycles, std::vector<BlockStatistics> &blockStatistics) {
+    auto blockCount = (payloadSize + blockSize - 1) / blockSize;
+
+    /*
+     * A stored block takes two more bytes of framing, but is much faster to
+     * unpack, so a block is stored unless it compresses into less than two
+     * bytes more than its chunk of the payload. Either way, it takes at most
+     * four bytes more than the chunk with its framing, which bounds the
+     * stream. Every block is encoded right into a slot that large in the
+     * stream, at the latest position it can end up at, concurrently, and
+     * moved down into place once they're all done.
+     */
+    CompressionStream outputStream(4 + payloadSize + 4 * blockCount + 2);
+
+    auto slotPosition = [&](size_t index) {
+        return 4 + index * (blockSize + 4);
+    };
+
+    std::vector<EncodedBlock> blocks(blockCount);
+    blockStatistics.assign(blockCount, BlockStatistics());
+
+    parallelFor(blockCount, workers, [&](size_t index, unsigned int worker) {
+        Stopwatch stopwatch;
+
+        auto pos = index * blockSize;
+        auto chunk = std::min<size_t>(blockSize, payloadSize - pos);
+        auto dictionarySize = linked ? std::min(pos, LinkedWindow) : 0;
+
+        auto &block = blocks[index];
+        block = encodeBlock(payload + pos, chunk, dictionarySize,
+                            outputStream.buffer() + slotPosition(index) + 2, chunk + 1, worker);
+
+        if(block.size == 0)
+            block.decodeCycles = StoredCyclesPerByte * chunk;
+
+        auto &statistics = blockStatistics[index];
+        statistics.size = chunk;
+        statistics.stored = block.size == 0;
+        statistics.compressedSize = statistics.stored ? 4 + chunk : 2 + block.size;
+        statistics.timing = stopwatch.elapsed();
+        statistics.onHelperThread = worker != 0;
+    });
+
+    decodeCycles = 0;
+
+    /*
+     * Stream header
+     */
+    auto headerData = outputStream.reserveOutputBytes(4);
+
+    reinterpret_cast<uint16_t *>(headerData)[0] = magic;
+    reinterpret_cast<uint16_t *>(headerData)[1] = payloadSize / 16;
+
+    outputStream.advanceOutputPointer(4);
+
+    for(size_t index = 0; index < blockCount; index++) {
+        const auto &block = blocks[index];
+
+        decodeCycles += block.decodeCycles;
+
+        if(block.size == 0) {
+            auto pos = index * blockSize;
+            auto chunk = std::min<size_t>(blockSize, payloadSize - pos);
+
+            auto blockData = outputStream.reserveOutputBytes(4 + chunk);
+
+            reinterpret_cast<uint16_t *>(blockData)[0] = StoredBlock;
+            reinterpret_cast<uint16_t *>(blockData)[1] = static_cast<uint16_t>(chunk);
+            memcpy(blockData + 4, payload + pos, chunk);
+
+            outputStream.advanceOutputPointer(4 + chunk);
+        } else {
+            auto blockData = outputStream.reserveOutputBytes(2 + block.size);
+
+            /*
+             * The slot is never below the output pointer, but may overlap it.
+             */
+            memmove(blockData + 2, outputStream.buffer() + slotPosition(index) + 2, block.size);
+            *reinterpret_cast<uint16_t *>(blockData) = static_cast<uint16_t>(block.size);
+
+            outputStream.advanceOutputPointer(2 + block.size);
+        }
+    }
+
+    /*
+     * Stream terminator
+     */
+    auto terminatorData = outputStream.reserveOutputBytes(2);
+
+    reinterpret_cast<uint16_t *>(terminatorData)[0] = 0;
+    outputStream.advanceOutputPointer(2);
+
+    decodeCycles += relocationCyclesPerByte * outputStream.size();
+
+    return outputStream.finish();
+}
+
+size_t PayloadCodec::decodeBlocks(const unsigned char *data, size_t size, std::vector<unsigned char> &payload,
+                                  const BlockDecoder &decodeBlock) {
+    if(size < 4)
+        throw WinbootError(WinbootErrorCode::CorruptStream, "the compressed stream is truncated");
+
+    payload.resize(16 * static_cast<size_t>(*reinterpret_cast<const uint16_t *>(data + 2)));
+
+    size_t position = 4;
+    size_t produced = 0;
+
+    while(true) {
+        if(position + 2 > size)
+            throw WinbootError(WinbootErrorCode::CorruptStream, "the compressed stream is truncated");
+
+        size_t length = *reinterpret_cast<const uint16_t *>(data + position);
+        position += 2;
+
+        if(length == 0)
+            break;
+
+        bool stored = length == StoredBlock;
+        if(stored) {
+            if(position + 2 > size)
+                throw WinbootError(WinbootErrorCode::CorruptStream, "the compressed stream is truncated");
+
+            length = *reinterpret_cast<const uint16_t *>(data + position);
+            position += 2;
+        }
+
+        if(position + length > size)
+            throw WinbootError(WinbootErrorCode::CorruptStream, "the compressed stream is truncated");
+
+        if(stored) {
+            if(length > payload.size() - produced)
+                throw WinbootError(WinbootErrorCode::CorruptStream, "the compressed stream is corrupt");
+
+            memcpy(payload.data() + produced, data + position, length);
+            produced += length;
+        } else {
+            produced += decodeBlock(data + position, length, produced);
+        }
+
+        position += length;
+    }
+
+    if(produced != payload.size())
+        throw WinbootError(WinbootErrorCode::CorruptStream, "the compressed stream doesn't decode to the declared size");
+
+    return position;
+}
+
+const std::vector<const PayloadCodec *> &payloadCodecs() {
+    static const LZ4Codec lz4;
+    static const LZECodec lze;
+    static const std::vector<const PayloadCodec *> codecs{ &lz4, &lze };
+
+    return codecs;
+}
+
+const PayloadCodec *findPayloadCodec(const std::string &name) {
+    for(auto codec: payloadCodecs()) {
+        if(name == codec->name())
+            return codec;
+    }
+
+    return nullptr;
+}
+
+const PayloadCodec *identifyPayloadCodec(const unsigned char *data, size_t size) {
+    if(size < 2)
+        return nullptr;
+
+    auto magic = *reinterpret_cast<const uint16_t *>(data);
+
+    for(auto codec: payloadCodecs()) {
+        if(codec->recognizes(magic))
+            return codec;
+    }
+
+    return nullptr;
+}
@@ -0,0 +1,189 @@
+#ifndef PAYLOAD_CODEC_H
+#define PAYLOAD_CODEC_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "CompressionOptions.h"
+#include "CompressionStream.h"
+#include "Statistics.h"
+
+/*
+ * All the codecs share the framing the MSLOAD extensions expect:
+ * 2 bytes: stream magic, identifying the codec and whether the blocks are linked
+ * 2 bytes: source size, paragraphs
+ * zero or more blocks:
+ *   2 bytes: compressed length, bytes
+ *   the specified number of bytes
+ * or, for blocks that don't compress:
+ *   2 bytes: 0xFFFF
+ *   2 bytes: length, bytes
+ *   the specified number of bytes of the payload, stored
+ * 2 bytes: zero
+ *
+ * Independent blocks are at most 63 KiB long. Linked blocks are limited to
+ * 0x7FF0 bytes, and may refer back to up to 32 KiB of the preceding payload,
+ * which the linked extensions keep addressable below the output pointer. The
+ * extensions rely on the first linked block being full, so shorter payloads
+ * are never linked; there would be nothing to link them to, anyway.
+ */
+struct EncodedPayload {
+    StreamBuffer stream;
+
+    /*
+     * The MSLOAD extension that unpacks the stream.
+     */
+    const unsigned char *extension = nullptr;
+    size_t extensionSize = 0;
+
+    /*
+     * Estimated 8088 cycles the extension spends relocating and unpacking
+     * the stream, from a model of its decoder.
+     */
+    uint64_t decodeCycles = 0;
+
+    /*
+     * The sizes of the blocks, and how long each took to compress.
+     */
+    std::vector<BlockStatistics> blocks;
+};
+
+class PayloadCodec {
+public:
+    virtual ~PayloadCodec();
+
+    virtual const char *name() const = 0;
+
+    /*
+     * Whether the stream magic is one of this codec's.
+     */
+    virtual bool recognizes(uint16_t magic) const = 0;
+
+    virtual EncodedPayload encode(const unsigned char *payload, size_t payloadSize,
+                                  const CompressionOptions &options) const = 0;
+
+    /*
+     * Decodes a framed stream into 'payload'. Returns the length of the
+     * stream.
+     */
+    virtual size_t decode(const unsigned char *data, size_t size, std::vector<unsigned char> &payload) const = 0;
+
+    struct Extension {
+        const unsigned char *code;
+        size_t size;
+    };
+
+    /*
+     * Every MSLOAD extension encode() may pick.
+     */
+    virtual std::vector<Extension> extensions() const = 0;
+
+    /*
+     * Whether encode() can lay the stream out to be unpacked in place, as
+     * requested by CompressionOptions::inPlace.
+     */
+    virtual bool unpacksInPlace() const;
+
+    /*
+     * Whether CompressionOptions::level means anything to encode() with
+     * these options.
+     */
+    virtual bool hasLevels(const CompressionOptions &options) const;
+
+    /*
+     * The extensions go into the slack at the end of MSLOAD, from 0x701 on in
+     * MS-DOS 7. MS-DOS 8 MSLOAD may have less room, which compress() checks.
+     */
+    static constexpr size_t MaxExtensionSize = 0x800 - 0x701;
+
+    /*
+     * The length word that marks a stored block.
+     */
+    static constexpr uint16_t StoredBlock = 0xFFFF;
+
+    /*
+     * The range of CompressionOptions::blockSize. The length has to be a
+     * whole number of paragraphs.
+     */
+    static constexpr size_t MinBlockSize = 1024;
+    static constexpr size_t MaxBlockSize = 63 * 1024;
+
+protected:
+    static constexpr size_t IndependentBlockSize = MaxBlockSize;
+    static constexpr size_t LinkedBlockSize = 0x7FF0;
+    static constexpr size_t LinkedWindow = 32 * 1024;
+
+    static bool useLinkedBlocks(size_t payloadSize, const CompressionOptions &options);
+
+    /*
+     * The length of the blocks to split the payload into. Throws if the
+     * options ask for a length the extensions can't unpack.
+     */
+    static size_t blockSize(const CompressionOptions &options, bool linked);
+
+    /*
+     * 8088 cycles the extensions spend per byte of a stored block copying it
+     * into place (REP MOVSW).
+     */
+    static constexpr uint64_t StoredCyclesPerByte = 13;
+
+    struct EncodedBlock {
+        /*
+         * Bytes written into the output area, or zero if the block didn't fit
+         * into it, and is to be stored instead.
+         */
+        size_t size = 0;
+
+        /*
+         * Estimated 8088 cycles to unpack the block, once relocated.
+         */
+        uint64_t decodeCycles = 0;
+    };
+
+    /*
+     * Splits the payload into blocks of 'blockSize' and calls encodeBlock on
+     * them concurrently, on 'workers' threads. 'block' is preceded by
+     * 'dictionarySize' bytes of the payload the block may refer back into,
+     * which is always zero for independent blocks. encodeBlock writes the
+     * block right into the stream, at 'output', which has room for
+     * 'capacity' bytes: exactly as many as a block may take without being
+     * worth storing. The blocks that don't fit are stored instead. Returns
+     * the stream, framed under 'magic', its total estimated decoding cost in
+     * 'decodeCycles', and the statistics of its blocks in 'blockStatistics'.
+     */
+    using BlockEncoder = std::function<EncodedBlock(const unsigned char *block, size_t length, size_t dictionarySize,
+                                                    unsigned char *output, size_t capacity, unsigned int worker)>;
+
+    static StreamBuffer encodeBlocks(uint16_t magic, const unsigned char *payload, size_t payloadSize,
+                                     size_t blockSize, bool linked, unsigned int workers, const BlockEncoder &encodeBlock,
+                                     uint64_t &decodeCycles, std::vector<BlockStatistics> &blockStatistics);
+
+    /*
+     * Walks the blocks of a framed stream, sizing 'payload' from its header,
+     * copies in the stored blocks, and calls decodeBlock on every other block
+     * with the offset in 'payload' it decodes to; decodeBlock returns the
+     * number of bytes it produced. Returns the length of the stream.
+     */
+    using BlockDecoder = std::function<size_t(const unsigned char *block, size_t length, size_t produced)>;
+
+    static size_t decodeBlocks(const unsigned char *data, size_t size, std::vector<unsigned char> &payload,
+                               const BlockDecoder &decodeBlock);
+
+};
+
+const std::vector<const PayloadCodec *> &payloadCodecs();
+
+/*
+ * Returns nullptr if there is no such codec.
+ */
+const PayloadCodec *findPayloadCodec(const std::string &name);
+
+/*
+ * Returns the codec of the framed stream, or nullptr if the data is not a
+ * stream of any of them.
+ */
+const PayloadCodec *identifyPayloadCodec(const unsigned char *data, size_t size);
+
+#endif
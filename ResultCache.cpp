@@ -0,0 +1,74 @@
+#include "ResultCache.h"
+#include "FileIO.h"
+#include "Sha256.h"
+#include "Log.h"
+
+ResultCache::ResultCache(const std::filesystem::path &directory) : m_directory(directory) {
+
+}
+
+ResultCache::~ResultCache() = default;
+
+std::string ResultCache::key(const unsigned char *input, size_t inputSize, const std::string &description) {
+    Sha256 hash;
+
+    /*
+     * Length-prefix the description, so that it can't run into the input.
+     */
+    auto descriptionLength = static_cast<uint64_t>(description.size());
+    hash.update(&descriptionLength, sizeof(descriptionLength));
+    hash.update(description.data(), description.size());
+    hash.update(input, inputSize);
+
+    return Sha256::toHex(hash.finish());
+}
+
+std::filesystem::path ResultCache::entryPath(const std::string &key, const char *extension) const {
+    return m_directory / key.substr(0, 2) / (key + extension);
+}
+
+bool ResultCache::lookup(const std::string &key,
+                         std::vector<unsigned char> &output,
+                         std::vector<unsigned char> *msdcm) {
+    /*
+     * The output is always stored last, so once it exists, the whole entry
+     * does.
+     */
+    auto outputPath = entryPath(key, ".img");
+
+    std::error_code error;
+    if(!std::filesystem::is_regular_file(outputPath, error))
+        return false;
+
+    try {
+        if(msdcm) {
+            *msdcm = readFile(entryPath(key, ".msdcm"));
+        }
+
+        output = readFile(outputPath);
+    } catch(const std::exception &e) {
+        logMessage(LogLevel::Error, "Unable to read the cache entry %s: %s", key.c_str(), e.what());
+
+        return false;
+    }
+
+    return true;
+}
+
+void ResultCache::store(const std::string &key,
+                        const std::vector<unsigned char> &output,
+                        const std::vector<unsigned char> *msdcm) {
+    try {
+        if(msdcm) {
+            writeFileAtomically(entryPath(key, ".msdcm"), *msdcm);
+        }
+
+        writeFileAtomically(entryPath(key, ".img"), output);
+    } catch(const std::exception &e) {
+        /*
+         * The cache is an optimization only: failing to fill it shouldn't
+         * fail the image.
+         */
+        logMessage(LogLevel::Error, "Unable to store the cache entry %s: %s", key.c_str(), e.what());
+    }
+}
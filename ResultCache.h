@@ -0,0 +1,42 @@
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+/*
+ * A content-addressed on-disk cache of finished images. The key is a hash of
+ * the input image and of a description of everything that affects the output,
+ * and the value is the output image plus, optionally, the extracted MSDCM.
+ * Entries are only ever renamed into place complete, so any number of
+ * processes can share one cache directory.
+ */
+class ResultCache {
+public:
+    explicit ResultCache(const std::filesystem::path &directory);
+    ~ResultCache();
+
+    ResultCache(const ResultCache &other) = delete;
+    ResultCache &operator =(const ResultCache &other) = delete;
+
+    static std::string key(const unsigned char *input, size_t inputSize, const std::string &description);
+
+    /*
+     * Returns false on a miss. 'msdcm' is only looked up if not null.
+     */
+    bool lookup(const std::string &key,
+                std::vector<unsigned char> &output,
+                std::vector<unsigned char> *msdcm);
+
+    void store(const std::string &key,
+               const std::vector<unsigned char> &output,
+               const std::vector<unsigned char> *msdcm);
+
+private:
+    std::filesystem::path entryPath(const std::string &key, const char *extension) const;
+
+    std::filesystem::path m_directory;
+};
+
+#endif
@@ -0,0 +1,139 @@
+#include "Sha256.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+static constexpr uint32_t roundConstants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+Sha256::Sha256() :
+    m_state{ 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 },
+    m_bufferSize(0),
+    m_totalSize(0) {
+
+}
+
+Sha256::~Sha256() = default;
+
+void Sha256::update(const void *data, size_t size) {
+    auto bytes = static_cast<const uint8_t *>(data);
+
+    m_totalSize += size;
+
+    if(m_bufferSize != 0) {
+        auto chunk = std::min(size, m_buffer.size() - m_bufferSize);
+        memcpy(m_buffer.data() + m_bufferSize, bytes, chunk);
+        m_bufferSize += chunk;
+        bytes += chunk;
+        size -= chunk;
+
+        if(m_bufferSize < m_buffer.size())
+            return;
+
+        processBlock(m_buffer.data());
+        m_bufferSize = 0;
+    }
+
+    while(size >= m_buffer.size()) {
+        processBlock(bytes);
+        bytes += m_buffer.size();
+        size -= m_buffer.size();
+    }
+
+    memcpy(m_buffer.data(), bytes, size);
+    m_bufferSize = size;
+}
+
+Sha256::Digest Sha256::finish() {
+    uint64_t totalBits = m_totalSize * 8;
+
+    static const uint8_t padding[64] = { 0x80 };
+    auto paddingSize = (m_bufferSize < 56 ? 56 : 120) - m_bufferSize;
+    update(padding, paddingSize);
+
+    uint8_t length[8];
+    for(size_t index = 0; index < 8; index++) {
+        length[index] = static_cast<uint8_t>(totalBits >> (56 - 8 * index));
+    }
+    update(length, sizeof(length));
+
+    Digest digest;
+    for(size_t index = 0; index < m_state.size(); index++) {
+        digest[4 * index + 0] = static_cast<uint8_t>(m_state[index] >> 24);
+        digest[4 * index + 1] = static_cast<uint8_t>(m_state[index] >> 16);
+        digest[4 * index + 2] = static_cast<uint8_t>(m_state[index] >> 8);
+        digest[4 * index + 3] = static_cast<uint8_t>(m_state[index]);
+    }
+
+    return digest;
+}
+
+std::string Sha256::toHex(const Digest &digest) {
+    static const char digits[] = "0123456789abcdef";
+
+    std::string hex;
+    hex.reserve(2 * digest.size());
+
+    for(auto byte: digest) {
+        hex.push_back(digits[byte >> 4]);
+        hex.push_back(digits[byte & 15]);
+    }
+
+    return hex;
+}
+
+void Sha256::processBlock(const uint8_t *block) {
+    uint32_t w[64];
+
+    for(size_t index = 0; index < 16; index++) {
+        w[index] = (static_cast<uint32_t>(block[4 * index]) << 24) |
+                   (static_cast<uint32_t>(block[4 * index + 1]) << 16) |
+                   (static_cast<uint32_t>(block[4 * index + 2]) << 8) |
+                    static_cast<uint32_t>(block[4 * index + 3]);
+    }
+
+    for(size_t index = 16; index < 64; index++) {
+        auto s0 = std::rotr(w[index - 15], 7) ^ std::rotr(w[index - 15], 18) ^ (w[index - 15] >> 3);
+        auto s1 = std::rotr(w[index - 2], 17) ^ std::rotr(w[index - 2], 19) ^ (w[index - 2] >> 10);
+        w[index] = w[index - 16] + s0 + w[index - 7] + s1;
+    }
+
+    auto a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3];
+    auto e = m_state[4], f = m_state[5], g = m_state[6], h = m_state[7];
+
+    for(size_t index = 0; index < 64; index++) {
+        auto s1 = std::rotr(e, 6) ^ std::rotr(e, 11) ^ std::rotr(e, 25);
+        auto ch = (e & f) ^ (~e & g);
+        auto temp1 = h + s1 + ch + roundConstants[index] + w[index];
+        auto s0 = std::rotr(a, 2) ^ std::rotr(a, 13) ^ std::rotr(a, 22);
+        auto maj = (a & b) ^ (a & c) ^ (b & c);
+        auto temp2 = s0 + maj;
+
+        h = g;
+        g = f;
+        f = e;
+        e = d + temp1;
+        d = c;
+        c = b;
+        b = a;
+        a = temp1 + temp2;
+    }
+
+    m_state[0] += a;
+    m_state[1] += b;
+    m_state[2] += c;
+    m_state[3] += d;
+    m_state[4] += e;
+    m_state[5] += f;
+    m_state[6] += g;
+    m_state[7] += h;
+}
@@ -0,0 +1,29 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <array>
+#include <cstdint>
+#include <string>
+
+class Sha256 {
+public:
+    using Digest = std::array<uint8_t, 32>;
+
+    Sha256();
+    ~Sha256();
+
+    void update(const void *data, size_t size);
+    Digest finish();
+
+    static std::string toHex(const Digest &digest);
+
+private:
+    void processBlock(const uint8_t *block);
+
+    std::array<uint32_t, 8> m_state;
+    std::array<uint8_t, 64> m_buffer;
+    size_t m_bufferSize;
+    uint64_t m_totalSize;
+};
+
+#endif
@@ -0,0 +1,216 @@
+#include "Statistics.h"
+
+#include <cstdio>
+#include <ctime>
+#include <iomanip>
+
+#include <sys/resource.h>
+
+Timing &Timing::operator +=(const Timing &other) {
+    wallSeconds += other.wallSeconds;
+    cpuSeconds += other.cpuSeconds;
+
+    return *this;
+}
+
+static double cpuSeconds(CPUClock clock) {
+    timespec time;
+
+    if(clock_gettime(clock == CPUClock::Thread ? CLOCK_THREAD_CPUTIME_ID : CLOCK_PROCESS_CPUTIME_ID, &time) != 0)
+        return 0;
+
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+Stopwatch::Stopwatch(CPUClock clock) : m_clock(clock), m_wallStart(std::chrono::steady_clock::now()),
+    m_cpuStart(cpuSeconds(clock)) {
+
+}
+
+Timing Stopwatch::elapsed() const {
+    Timing timing;
+    timing.wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_wallStart).count();
+    timing.cpuSeconds = cpuSeconds(m_clock) - m_cpuStart;
+
+    return timing;
+}
+
+void ImageStatistics::addPhase(const char *name, const Timing &timing) {
+    for(auto &phase: phases) {
+        if(phase.first == name) {
+            phase.second += timing;
+            return;
+        }
+    }
+
+    phases.emplace_back(name, timing);
+}
+
+PhaseTimer::PhaseTimer(ImageStatistics *statistics, const char *phase) : m_statistics(statistics), m_phase(phase) {
+
+}
+
+PhaseTimer::~PhaseTimer() {
+    if(m_statistics) {
+        auto timing = m_stopwatch.elapsed();
+        timing.cpuSeconds += m_helperCPUSeconds;
+
+        m_statistics->addPhase(m_phase, timing);
+    }
+}
+
+size_t peakResidentSetSize() {
+    rusage usage;
+
+    if(getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+
+    return static_cast<size_t>(usage.ru_maxrss) * 1024; // KiB on Linux
+}
+
+namespace {
+    void writeString(std::ostream &stream, const std::string &string) {
+        stream << '"';
+
+        for(unsigned char ch: string) {
+            if(ch == '"' || ch == '\\') {
+                stream << '\\' << ch;
+            } else if(ch < 0x20) {
+                char escape[8];
+                snprintf(escape, sizeof(escape), "\\u%04x", ch);
+                stream << escape;
+            } else {
+                stream << ch;
+            }
+        }
+
+        stream << '"';
+    }
+
+    void writeTiming(std::ostream &stream, const Timing &timing) {
+        stream << "{ \"wall_s\": " << timing.wallSeconds << ", \"cpu_s\": " << timing.cpuSeconds << " }";
+    }
+
+    void writePhases(std::ostream &stream, const std::vector<std::pair<std::string, Timing>> &phases) {
+        stream << "{";
+
+        for(size_t index = 0; index < phases.size(); index++) {
+            stream << (index == 0 ? " " : ", ");
+            writeString(stream, phases[index].first);
+            stream << ": ";
+            writeTiming(stream, phases[index].second);
+        }
+
+        stream << (phases.empty() ? "}" : " }");
+    }
+
+    double ratio(size_t compressedSize, size_t size) {
+        return size == 0 ? 0 : static_cast<double>(compressedSize) / size;
+    }
+}
+
+void writeStatisticsJSON(std::ostream &stream, const std::vector<ImageStatistics> &images, const Timing &run) {
+    ImageStatistics totals;
+    size_t failed = 0;
+    size_t cached = 0;
+    size_t blockSize = 0;
+    size_t blockCompressedSize = 0;
+
+    for(const auto &image: images) {
+        if(!image.error.empty())
+            failed++;
+
+        if(image.cached)
+            cached++;
+
+        totals.inputSize += image.inputSize;
+        totals.outputSize += image.outputSize;
+
+        for(const auto &phase: image.phases) {
+            totals.addPhase(phase.first.c_str(), phase.second);
+        }
+
+        for(const auto &block: image.blocks) {
+            blockSize += block.size;
+            blockCompressedSize += block.compressedSize;
+        }
+    }
+
+    auto flags = stream.flags();
+    auto precision = stream.precision();
+
+    stream << std::fixed << std::setprecision(6);
+
+    stream << "{\n"
+           << "  \"tool\": \"trim-winboot\",\n"
+           << "  \"version\": \"" << TRIM_WINBOOT_VERSION << "\",\n"
+           << "  \"run\": {\n"
+           << "    \"images\": " << images.size() << ",\n"
+           << "    \"failed\": " << failed << ",\n"
+           << "    \"cached\": " << cached << ",\n"
+           << "    \"wall_s\": " << run.wallSeconds << ",\n"
+           << "    \"cpu_s\": " << run.cpuSeconds << ",\n"
+           << "    \"peak_rss_bytes\": " << peakResidentSetSize() << ",\n"
+           << "    \"input_bytes\": " << totals.inputSize << ",\n"
+           << "    \"output_bytes\": " << totals.outputSize << ",\n"
+           << "    \"block_bytes\": " << blockSize << ",\n"
+           << "    \"block_compressed_bytes\": " << blockCompressedSize << ",\n"
+           << "    \"block_ratio\": " << ratio(blockCompressedSize, blockSize) << ",\n"
+           << "    \"phases\": ";
+    writePhases(stream, totals.phases);
+    stream << "\n"
+           << "  },\n"
+           << "  \"images\": [";
+
+    for(size_t index = 0; index < images.size(); index++) {
+        const auto &image = images[index];
+
+        stream << (index == 0 ? "\n" : ",\n")
+               << "    {\n"
+               << "      \"input\": ";
+        writeString(stream, image.input);
+        stream << ",\n"
+               << "      \"status\": \"" << (!image.error.empty() ? "failed" : image.cached ? "cached" : "processed") << "\",\n";
+
+        if(!image.error.empty()) {
+            stream << "      \"error\": ";
+            writeString(stream, image.error);
+            stream << ",\n";
+        }
+
+        stream << "      \"input_bytes\": " << image.inputSize << ",\n"
+               << "      \"output_bytes\": " << image.outputSize << ",\n";
+
+        if(!image.codec.empty()) {
+            stream << "      \"codec\": ";
+            writeString(stream, image.codec);
+            stream << ",\n";
+        }
+
+        stream << "      \"phases\": ";
+        writePhases(stream, image.phases);
+        stream << ",\n"
+               << "      \"blocks\": [";
+
+        for(size_t blockIndex = 0; blockIndex < image.blocks.size(); blockIndex++) {
+            const auto &block = image.blocks[blockIndex];
+
+            stream << (blockIndex == 0 ? "\n" : ",\n")
+                   << "        { \"size\": " << block.size
+                   << ", \"compressed_size\": " << block.compressedSize
+                   << ", \"ratio\": " << ratio(block.compressedSize, block.size)
+                   << ", \"stored\": " << (block.stored ? "true" : "false")
+                   << ", \"wall_s\": " << block.timing.wallSeconds
+                   << ", \"cpu_s\": " << block.timing.cpuSeconds << " }";
+        }
+
+        stream << (image.blocks.empty() ? "]\n" : "\n      ]\n")
+               << "    }";
+    }
+
+    stream << (images.empty() ? "]\n" : "\n  ]\n")
+           << "}\n";
+
+    stream.flags(flags);
+    stream.precision(precision);
+}
@@ -0,0 +1,135 @@
+#ifndef STATISTICS_H
+#define STATISTICS_H
+
+#include <chrono>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+ * Wall clock and CPU time, in seconds.
+ */
+struct Timing {
+    double wallSeconds = 0;
+    double cpuSeconds = 0;
+
+    Timing &operator +=(const Timing &other);
+};
+
+/*
+ * Whose CPU time a Stopwatch measures.
+ */
+enum class CPUClock {
+    Thread,     // The calling thread only, as the images of a batch are processed concurrently
+    Process     // All threads of the process
+};
+
+/*
+ * Reads the clocks when constructed; elapsed() returns the time since then.
+ */
+class Stopwatch {
+public:
+    explicit Stopwatch(CPUClock clock = CPUClock::Thread);
+
+    Timing elapsed() const;
+
+private:
+    CPUClock m_clock;
+    std::chrono::steady_clock::time_point m_wallStart;
+    double m_cpuStart;
+};
+
+struct BlockStatistics {
+    size_t size = 0;
+
+    /*
+     * Including the framing of the block.
+     */
+    size_t compressedSize = 0;
+
+    bool stored = false;
+
+    Timing timing;
+
+    /*
+     * Whether the block was compressed on another thread than the one
+     * processing the image, whose CPU time doesn't include it then.
+     */
+    bool onHelperThread = false;
+};
+
+struct ImageStatistics {
+    std::string input;
+
+    /*
+     * Empty if the image was processed.
+     */
+    std::string error;
+
+    bool cached = false;
+
+    size_t inputSize = 0;
+    size_t outputSize = 0;
+
+    /*
+     * The codec the payload was compressed with, empty if it wasn't.
+     */
+    std::string codec;
+
+    /*
+     * In the order they first finished. The phases don't overlap, except
+     * for "cm-decode", which is a part of "load".
+     */
+    std::vector<std::pair<std::string, Timing>> phases;
+
+    /*
+     * Of the compressed stream.
+     */
+    std::vector<BlockStatistics> blocks;
+
+    /*
+     * Adds the time to the phase, appending it if it's new.
+     */
+    void addPhase(const char *name, const Timing &timing);
+};
+
+/*
+ * Adds the time from construction to destruction to a phase of the image
+ * statistics, if there are any.
+ */
+class PhaseTimer {
+public:
+    PhaseTimer(ImageStatistics *statistics, const char *phase);
+    ~PhaseTimer();
+
+    PhaseTimer(const PhaseTimer &other) = delete;
+    PhaseTimer &operator =(const PhaseTimer &other) = delete;
+
+    /*
+     * Accounts for CPU time spent on behalf of the phase on other threads.
+     */
+    inline void addHelperCPUSeconds(double seconds) {
+        m_helperCPUSeconds += seconds;
+    }
+
+private:
+    ImageStatistics *m_statistics;
+    const char *m_phase;
+    Stopwatch m_stopwatch;
+    double m_helperCPUSeconds = 0;
+};
+
+/*
+ * The peak resident set size of the process so far, in bytes.
+ */
+size_t peakResidentSetSize();
+
+/*
+ * Writes the statistics of a run, both per image and summed over all of
+ * them, as a JSON object. 'run' is the time the whole run took, with the CPU
+ * time of all threads.
+ */
+void writeStatisticsJSON(std::ostream &stream, const std::vector<ImageStatistics> &images, const Timing &run);
+
+#endif
@@ -0,0 +1,563 @@
+#include "StubBenchmark.h"
+#include "DOSTypes.h"
+#include "PayloadCodec.h"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+
+#include <x86emu.h>
+
+namespace {
+    struct X86EMUDeleter {
+        inline void operator()(x86emu_t *emu) const {
+            x86emu_done(emu);
+        }
+    };
+
+    using X86EMUPointer = std::unique_ptr<x86emu_t, X86EMUDeleter>;
+
+    static constexpr size_t MSLOADSize = 0x800;
+    static constexpr uint16_t PayloadSegment = 0x70;
+
+    /*
+     * Our simulated memory is the conventional 640 KiB:
+     * 0x00700 -            - the payload, then the relocated compressed stream
+     *                        (unless it is unpacked in place)
+     * 0x9F000 - 0x9F800    - stack (2 KiB)
+     * 0x9F800 - 0xA0000    - MSLOAD
+     */
+    static constexpr size_t MemorySize = 0xA0000;
+    static constexpr uint16_t StackSegment = 0x9F00;
+    static constexpr uint16_t StackSize = 0x800;
+    static constexpr uint16_t MSLOADSegment = 0x9F80;
+
+    static constexpr uint64_t InstructionBudget = 4000000000ULL;
+
+    static constexpr uint32_t DirectionFlag = 0x400;
+
+    struct Cycles {
+        uint64_t cycles8088;
+        uint64_t cycles286;
+    };
+
+    class StubRunner {
+    public:
+        StubRunner(const std::vector<unsigned char> &image);
+
+        StubBenchmarkResult run();
+
+    private:
+        static int codeHandler(x86emu_t *emu);
+        static int interruptHandler(x86emu_t *emu, u8 number, unsigned int type);
+
+        int onInstruction(x86emu_t *emu);
+        void retirePrevious(uint32_t address);
+        void account(x86emu_t *emu, uint32_t address);
+
+        inline uint32_t linear(uint16_t segment, uint16_t offset) const {
+            return (static_cast<uint32_t>(segment) << 4) + offset;
+        }
+
+        inline uint8_t peek(uint32_t address) const {
+            return address < m_memory.size() ? m_memory[address] : 0xFF;
+        }
+
+        /*
+         * The costs of an instruction are only known for sure once the next
+         * one is reached: that's when the length of the previous one, and
+         * whether its branch was taken, are known.
+         */
+        struct PendingInstruction {
+            bool valid = false;
+            uint32_t address;
+            uint32_t fallThrough; // Zero unless a conditional branch
+            Cycles cost;
+            Cycles taken;
+        };
+
+        static thread_local StubRunner *m_active;
+
+        X86EMUPointer m_emu;
+        std::vector<unsigned char> m_memory;
+        std::vector<unsigned char> m_expected;
+        uint32_t m_payloadEnd;
+        uint32_t m_streamBase;
+        uint16_t m_payloadParagraphs;
+        uint16_t m_extensionEntry;
+        PendingInstruction m_pending;
+        bool m_finished;
+        std::string m_error;
+        StubBenchmarkResult m_result;
+    };
+
+    thread_local StubRunner *StubRunner::m_active = nullptr;
+
+    bool hasModRM(uint8_t op) {
+        return (op < 0x40 && (op & 7) < 4) ||
+            (op >= 0x80 && op <= 0x8F) ||
+            op == 0xC0 || op == 0xC1 || op == 0xC6 || op == 0xC7 ||
+            (op >= 0xD0 && op <= 0xD3) ||
+            op == 0xF6 || op == 0xF7 || op == 0xFE || op == 0xFF;
+    }
+
+    /*
+     * Execution times from the Intel 8086/8088 and 80286 manuals, simplified:
+     * a memory operand is costed at a typical effective address calculation,
+     * and word accesses cost the 8088 an extra bus cycle each. 'count' is the
+     * repeat count of a string instruction, or the shift count.
+     */
+    Cycles instructionCost(uint8_t op, bool memoryOperand, uint8_t reg, bool repeated, uint64_t count) {
+        bool word = op & 1;
+
+        if(op < 0x40 && (op & 7) < 4)
+            return memoryOperand ? Cycles{ 20, 7 } : Cycles{ 3, 2 };
+
+        if(op < 0x40 && (op & 7) < 6)
+            return { 4, 3 };
+
+        switch(op) {
+            case 0x06: case 0x0E: case 0x16: case 0x1E:
+                return { 14, 3 };
+
+            case 0x07: case 0x17: case 0x1F:
+                return { 12, 5 };
+
+            case 0x80: case 0x81: case 0x82: case 0x83:
+                return memoryOperand ? Cycles{ 23, 7 } : Cycles{ 4, 3 };
+
+            case 0x84: case 0x85:
+                return memoryOperand ? Cycles{ 13, 6 } : Cycles{ 3, 2 };
+
+            case 0x86: case 0x87:
+                return memoryOperand ? Cycles{ 25, 5 } : Cycles{ 4, 3 };
+
+            case 0x88: case 0x89:
+                return memoryOperand ? Cycles{ 13, 3 } : Cycles{ 2, 2 };
+
+            case 0x8A: case 0x8B:
+                return memoryOperand ? Cycles{ 12, 5 } : Cycles{ 2, 2 };
+
+            case 0x8C: case 0x8E:
+                return memoryOperand ? Cycles{ 12, 5 } : Cycles{ 2, 2 };
+
+            case 0x8D:
+                return { 8, 3 };
+
+            case 0x98:
+                return { 2, 2 };
+
+            case 0x99:
+                return { 5, 2 };
+
+            case 0xA4: case 0xA5:
+                if(repeated)
+                    return { 9 + (word ? 25 : 17) * count, 5 + 4 * count };
+                return { word ? 26U : 18U, 5 };
+
+            case 0xA6: case 0xA7:
+                if(repeated)
+                    return { 9 + (word ? 30 : 22) * count, 5 + 9 * count };
+                return { word ? 30U : 22U, 8 };
+
+            case 0xA8: case 0xA9:
+                return { 4, 3 };
+
+            case 0xAA: case 0xAB:
+                if(repeated)
+                    return { 9 + (word ? 14 : 10) * count, 4 + 3 * count };
+                return { word ? 15U : 11U, 3 };
+
+            case 0xAC: case 0xAD:
+                if(repeated)
+                    return { 9 + (word ? 17 : 13) * count, 5 + 4 * count };
+                return { word ? 16U : 12U, 5 };
+
+            case 0xAE: case 0xAF:
+                if(repeated)
+                    return { 9 + (word ? 19 : 15) * count, 5 + 8 * count };
+                return { word ? 19U : 15U, 7 };
+
+            case 0xC0: case 0xC1:
+                return memoryOperand ? Cycles{ 28 + 4 * count, 8 + count } : Cycles{ 8 + 4 * count, 5 + count };
+
+            case 0xC2: case 0xC3:
+                return { 20, 11 };
+
+            case 0xC6: case 0xC7:
+                return memoryOperand ? Cycles{ 14, 3 } : Cycles{ 4, 2 };
+
+            case 0xCD:
+                return { 51, 23 };
+
+            case 0xD0: case 0xD1:
+                return memoryOperand ? Cycles{ 23, 7 } : Cycles{ 2, 2 };
+
+            case 0xD2: case 0xD3:
+                return memoryOperand ? Cycles{ 28 + 4 * count, 8 + count } : Cycles{ 8 + 4 * count, 5 + count };
+
+            case 0xE8:
+                return { 23, 7 };
+
+            case 0xE9: case 0xEB:
+                return { 15, 7 };
+
+            case 0xEA:
+                return { 15, 11 };
+
+            case 0xF5: case 0xF8: case 0xF9: case 0xFA: case 0xFB: case 0xFC: case 0xFD:
+                return { 2, 2 };
+
+            case 0xF6: case 0xF7:
+                switch(reg) {
+                    case 0: return { 5, 3 };
+                    case 4: return { word ? 118U : 70U, word ? 21U : 13U };
+                    case 5: return { word ? 128U : 80U, word ? 24U : 16U };
+                    case 6: return { word ? 144U : 80U, word ? 22U : 14U };
+                    case 7: return { word ? 165U : 101U, word ? 25U : 17U };
+                    default: return memoryOperand ? Cycles{ 24, 7 } : Cycles{ 3, 2 };
+                }
+
+            case 0xFE: case 0xFF:
+                switch(reg) {
+                    case 2: return { 21, 7 };
+                    case 4: return { 11, 7 };
+                    case 6: return { 24, 5 };
+                    default: return memoryOperand ? Cycles{ 23, 7 } : Cycles{ 3, 2 };
+                }
+        }
+
+        if(op >= 0x40 && op < 0x50)
+            return { 2, 2 };
+
+        if(op >= 0x50 && op < 0x58)
+            return { 15, 3 };
+
+        if(op >= 0x58 && op < 0x60)
+            return { 12, 5 };
+
+        if(op >= 0x70 && op < 0x80)
+            return { 4, 3 };
+
+        if(op >= 0x90 && op < 0x98)
+            return { 3, 3 };
+
+        if(op >= 0xB0 && op < 0xC0)
+            return { 4, 2 };
+
+        return { 10, 5 };
+    }
+}
+
+StubRunner::StubRunner(const std::vector<unsigned char> &image) : m_memory(MemorySize), m_finished(false) {
+    if(image.size() < MSLOADSize + 4 || image.size() < sizeof(EXEHeader))
+        throw std::logic_error("the image is too short");
+
+    /*
+     * Same as in WinbootImage: e_cparhdr of an MS-DOS 8 image, which has e_cp
+     * set to zero, is biased by 32 paragraphs.
+     */
+    auto exe = reinterpret_cast<const EXEHeader *>(image.data());
+    size_t dosSize = exe->e_cparhdr;
+    if(exe->e_magic == EXEHeaderMagic && exe->e_cp == 0) {
+        dosSize = dosSize >= 32 ? dosSize - 32 : 0;
+    }
+    dosSize = std::min(16 * dosSize, image.size());
+
+    if(dosSize < MSLOADSize + 4)
+        throw std::logic_error("the DOS portion is too short");
+
+    auto stream = image.data() + MSLOADSize;
+    auto streamSize = dosSize - MSLOADSize;
+
+    /*
+     * Decode the stream natively, to have something to check the extension
+     * against.
+     */
+    auto codec = identifyPayloadCodec(stream, streamSize);
+    if(!codec)
+        throw std::logic_error("the image is not compressed");
+
+    m_result.compressedSize = codec->decode(stream, streamSize, m_expected);
+    m_result.payloadSize = m_expected.size();
+    m_payloadParagraphs = m_expected.size() / 16;
+
+    /*
+     * The extension moves the compressed stream to right past the end of
+     * the payload before unpacking it.
+     */
+    m_payloadEnd = linear(PayloadSegment, 0) + m_expected.size();
+    m_streamBase = m_payloadEnd;
+
+    if(m_streamBase + m_result.compressedSize + 512 > linear(StackSegment, 0))
+        throw std::logic_error("the image doesn't fit into the conventional memory");
+
+    /*
+     * The extension isn't at the same place in every MSLOAD, so find it from
+     * the patched final branch: a near JMP over the far JMP 0070:0000, which
+     * leaves the segment of the latter behind.
+     */
+    m_extensionEntry = 0;
+    for(size_t pos = 0x200; pos + 5 <= MSLOADSize; pos++) {
+        auto branch = image.data() + pos;
+        if(branch[0] == 0xE9 && branch[3] == 0x70 && branch[4] == 0x00) {
+            m_extensionEntry = pos + 3 + *reinterpret_cast<const int16_t *>(branch + 1);
+            break;
+        }
+    }
+
+    if(m_extensionEntry == 0 || m_extensionEntry >= MSLOADSize)
+        throw std::logic_error("unable to find the MSLOAD extension");
+
+    memcpy(m_memory.data() + linear(PayloadSegment, 0), stream, streamSize);
+    memcpy(m_memory.data() + linear(MSLOADSegment, 0), image.data(), MSLOADSize);
+
+    auto rawEmu = x86emu_new(0, 0);
+    if(rawEmu == nullptr)
+        throw std::bad_alloc();
+
+    m_emu.reset(rawEmu);
+
+    for(size_t offset = 0; offset < m_memory.size(); offset += X86EMU_PAGE_SIZE) {
+        x86emu_set_page(rawEmu, offset, m_memory.data() + offset);
+    }
+
+    x86emu_set_perm(rawEmu, 0, m_memory.size(), X86EMU_PERM_R | X86EMU_PERM_W | X86EMU_PERM_X | X86EMU_PERM_VALID);
+
+    x86emu_set_code_handler(rawEmu, codeHandler);
+    x86emu_set_intr_handler(rawEmu, interruptHandler);
+}
+
+StubBenchmarkResult StubRunner::run() {
+    auto emu = m_emu.get();
+
+    /*
+     * MSLOAD leaves significant values in these, which the extension has to
+     * preserve.
+     */
+    static constexpr uint16_t AXValue = 0x1234;
+    static constexpr uint16_t BXValue = 0x5678;
+    static constexpr uint16_t DXValue = 0x9ABC;
+    static constexpr uint16_t BPValue = 0xDEF0;
+
+    x86emu_set_seg_register(emu, emu->x86.R_CS_SEL, MSLOADSegment);
+    x86emu_set_seg_register(emu, emu->x86.R_DS_SEL, MSLOADSegment);
+    x86emu_set_seg_register(emu, emu->x86.R_ES_SEL, MSLOADSegment);
+    x86emu_set_seg_register(emu, emu->x86.R_SS_SEL, StackSegment);
+    emu->x86.R_IP = m_extensionEntry;
+    emu->x86.R_SP = StackSize;
+    emu->x86.R_AX = AXValue;
+    emu->x86.R_BX = BXValue;
+    emu->x86.R_DX = DXValue;
+    emu->x86.R_BP = BPValue;
+    emu->x86.R_CX = 0;
+    emu->x86.R_SI = 0;
+    emu->x86.R_DI = 0;
+
+    emu->max_instr = InstructionBudget;
+
+    m_active = this;
+    x86emu_run(emu, X86EMU_RUN_MAX_INSTR);
+    m_active = nullptr;
+
+    if(!m_error.empty())
+        throw std::logic_error(m_error);
+
+    if(!m_finished) {
+        std::stringstream error;
+        error << "the extension didn't pass control to the payload (stopped at "
+              << std::hex << emu->x86.R_CS << ":" << emu->x86.R_IP << ")";
+        throw std::logic_error(error.str());
+    }
+
+    if(emu->x86.R_AX != AXValue || emu->x86.R_BX != BXValue || emu->x86.R_DX != DXValue ||
+       emu->x86.R_BP != BPValue || emu->x86.R_SP != StackSize) {
+        throw std::logic_error("the extension didn't preserve the registers");
+    }
+
+    if(emu->x86.R_DI != m_payloadParagraphs + 0x60)
+        throw std::logic_error("the extension passed an incorrect DI to the payload");
+
+    auto payload = m_memory.data() + linear(PayloadSegment, 0);
+
+    auto mismatch = std::mismatch(m_expected.begin(), m_expected.end(), payload);
+    if(mismatch.first != m_expected.end()) {
+        std::stringstream error;
+        error << "the extension unpacked the payload incorrectly, starting at the offset "
+              << (mismatch.first - m_expected.begin());
+        throw std::logic_error(error.str());
+    }
+
+    return m_result;
+}
+
+int StubRunner::codeHandler(x86emu_t *emu) {
+    return m_active->onInstruction(emu);
+}
+
+int StubRunner::interruptHandler(x86emu_t *emu, u8 number, unsigned int type) {
+    (void)type;
+
+    auto runner = m_active;
+
+    if(number == 0x10 && (emu->x86.R_AX >> 8) == 0x0E) {
+        runner->m_result.console.push_back(static_cast<char>(emu->x86.R_AX & 0xFF));
+        return 1;
+    }
+
+    std::stringstream error;
+    error << "the extension has invoked an unexpected interrupt " << std::hex << static_cast<unsigned int>(number);
+    runner->m_error = error.str();
+    x86emu_stop(emu);
+
+    return 1;
+}
+
+int StubRunner::onInstruction(x86emu_t *emu) {
+    auto address = linear(emu->x86.R_CS, emu->x86.R_IP);
+
+    retirePrevious(address);
+
+    if(emu->x86.R_CS == PayloadSegment && emu->x86.R_IP == 0) {
+        m_finished = true;
+        return 1;
+    }
+
+    m_result.instructions++;
+    account(emu, address);
+
+    return 0;
+}
+
+void StubRunner::retirePrevious(uint32_t address) {
+    if(!m_pending.valid)
+        return;
+
+    auto cost = m_pending.cost;
+
+    if(m_pending.fallThrough != 0 && address != m_pending.fallThrough) {
+        cost = m_pending.taken;
+    }
+
+    /*
+     * The 8088 fetches code through an 8-bit bus at 4 cycles per byte, which
+     * bounds the instructions that are faster than that. Taken branches
+     * already include the refetch in their timings.
+     */
+    if(address > m_pending.address && address - m_pending.address <= 6) {
+        cost.cycles8088 = std::max<uint64_t>(cost.cycles8088, 4 * (address - m_pending.address));
+    }
+
+    m_result.cycles8088 += cost.cycles8088;
+    m_result.cycles286 += cost.cycles286;
+
+    m_pending.valid = false;
+}
+
+void StubRunner::account(x86emu_t *emu, uint32_t address) {
+    auto position = address;
+    bool repeated = false;
+    int segmentOverride = -1;
+    uint8_t op;
+
+    while(true) {
+        op = peek(position++);
+
+        if(op == 0xF2 || op == 0xF3) {
+            repeated = true;
+        } else if(op == 0x26 || op == 0x2E || op == 0x36 || op == 0x3E) {
+            segmentOverride = (op >> 3) & 3;
+        } else {
+            break;
+        }
+    }
+
+    bool memoryOperand = false;
+    uint8_t reg = 0;
+
+    if(hasModRM(op)) {
+        auto modRM = peek(position);
+        memoryOperand = (modRM >> 6) != 3;
+        reg = (modRM >> 3) & 7;
+    }
+
+    uint64_t count = 1;
+
+    if(op >= 0xA4 && op <= 0xAF && op != 0xA8 && op != 0xA9) {
+        count = repeated ? emu->x86.R_CX : 1;
+    } else if(op == 0xD2 || op == 0xD3) {
+        count = emu->x86.R_CX & 0xFF;
+    } else if(op == 0xC0 || op == 0xC1) {
+        count = peek(position + 1 + (memoryOperand ? 2 : 0));
+    }
+
+    if(op == 0xC0 || op == 0xC1 || (op >= 0x60 && op <= 0x6F) || op == 0xC8 || op == 0xC9) {
+        m_result.post8086Instructions++;
+    }
+
+    m_pending.valid = true;
+    m_pending.address = address;
+    m_pending.fallThrough = 0;
+    m_pending.cost = instructionCost(op, memoryOperand, reg, repeated, count);
+
+    if((op >= 0x70 && op < 0x80) || op == 0xE2 || op == 0xE3) {
+        m_pending.fallThrough = position + 1;
+
+        if(op == 0xE2) {
+            m_pending.cost = { 5, 4 };
+            m_pending.taken = { 17, 8 };
+        } else if(op == 0xE3) {
+            m_pending.cost = { 6, 4 };
+            m_pending.taken = { 18, 8 };
+        } else {
+            m_pending.taken = { 16, 7 };
+        }
+    }
+
+    /*
+     * Classify the bytes moved by the string instructions.
+     */
+    uint64_t bytes = count * ((op & 1) ? 2 : 1);
+
+    if(op == 0xA4 || op == 0xA5) {
+        static const int segmentIndex[] = { R_ES_INDEX, R_CS_INDEX, R_SS_INDEX, R_DS_INDEX };
+
+        auto sourceSegment = emu->x86.seg[segmentOverride < 0 ? R_DS_INDEX : segmentIndex[segmentOverride]].sel;
+        auto source = linear(sourceSegment, emu->x86.R_SI);
+        auto destination = linear(emu->x86.R_ES, emu->x86.R_DI);
+
+        if(destination >= m_streamBase) {
+            m_result.relocatedBytes += bytes;
+        } else if(emu->x86.R_FLG & DirectionFlag) {
+            /*
+             * Unpacking in place, downwards: the stream is below the output,
+             * the matches are above it.
+             */
+            if(source > destination) {
+                m_result.matchBytes += bytes;
+            } else {
+                m_result.literalBytes += bytes;
+            }
+        } else if(source >= m_streamBase) {
+            m_result.literalBytes += bytes;
+        } else {
+            m_result.matchBytes += bytes;
+        }
+    } else if(op == 0xAA || op == 0xAB) {
+        /*
+         * Fills within the payload are runs of a single byte; the padding
+         * past its end isn't counted.
+         */
+        if(linear(emu->x86.R_ES, emu->x86.R_DI) < m_payloadEnd) {
+            m_result.matchBytes += bytes;
+        }
+    }
+}
+
+StubBenchmarkResult benchmarkStub(const std::vector<unsigned char> &image) {
+    StubRunner runner(image);
+
+    return runner.run();
+}
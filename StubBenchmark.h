@@ -0,0 +1,53 @@
+#ifndef STUB_BENCHMARK_H
+#define STUB_BENCHMARK_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct StubBenchmarkResult {
+    size_t payloadSize = 0;
+    size_t compressedSize = 0;
+
+    uint64_t instructions = 0;
+
+    /*
+     * Estimates from the documented instruction timings. The 8088 estimate
+     * also accounts for the 4 cycles the 8088 needs to fetch every byte of
+     * code, which dominates for short instructions.
+     */
+    uint64_t cycles8088 = 0;
+    uint64_t cycles286 = 0;
+
+    /*
+     * Bytes moved by the string instructions, by what they were doing:
+     * moving the compressed stream out of the way of the output, copying
+     * literals from it, or copying (or filling in) matches within the output.
+     */
+    uint64_t relocatedBytes = 0;
+    uint64_t literalBytes = 0;
+    uint64_t matchBytes = 0;
+
+    /*
+     * Instructions the 8086/8088 doesn't have, such as shifts by an
+     * immediate count.
+     */
+    uint64_t post8086Instructions = 0;
+
+    /*
+     * Whatever the extension printed with int 10h.
+     */
+    std::string console;
+};
+
+/*
+ * Boots the MSLOAD extension of a compressed WINBOOT.SYS image under
+ * libx86emu: the payload is loaded at 0070:0000 the way MSLOAD loads it, and
+ * the extension is entered where the patched final branch of MSLOAD leads,
+ * and run until it passes control to the payload. The unpacked payload is
+ * checked against the one decoded natively, and the registers the extension
+ * has to preserve are checked as well.
+ */
+StubBenchmarkResult benchmarkStub(const std::vector<unsigned char> &image);
+
+#endif
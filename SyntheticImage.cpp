@@ -0,0 +1,391 @@
+#include "SyntheticImage.h"
+#include "DOSTypes.h"
+
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include <string>
+
+namespace {
+    static constexpr size_t MSLOADSize = 0x800;
+    static constexpr size_t FinalBranchOffset = 0x4EB;
+
+    /*
+     * Where IO.SYS of MS-DOS 7 keeps the length of its dynamic portion, and
+     * the size of the fixed one (see WinbootImage::removeLogo).
+     */
+    static constexpr size_t DynamicPortionLengthOffset = 0x803;
+    static constexpr size_t FixedPortionSize = 0x12D50;
+
+    /*
+     * The sizes count from linear address 0x700, where MSLOAD loads the
+     * payload, but MSLOAD itself takes 0x800 bytes of the file.
+     */
+    static constexpr size_t MinDOS7PayloadSize = FixedPortionSize - 0x700;
+    static constexpr size_t MaxDOS7PayloadSize = MinDOS7PayloadSize + 0xFFFF;
+
+    static constexpr size_t BitmapHeadersSize = 14 + 40;
+    static constexpr size_t BitmapPaletteSize = 256 * 4;
+    static constexpr size_t BitmapWidth = 320;
+
+    /*
+     * Produces the filler: words from a fixed vocabulary, interspersed with
+     * random bytes.
+     */
+    class Filler {
+    public:
+        Filler(uint32_t seed, double compressibility) : m_random(seed), m_compressibility(compressibility) {
+            std::uniform_int_distribution<unsigned int> byte(0, 255);
+            std::uniform_int_distribution<size_t> length(3, 12);
+
+            m_vocabulary.resize(256);
+            for(auto &word: m_vocabulary) {
+                word.resize(length(m_random));
+
+                for(auto &ch: word) {
+                    ch = byte(m_random);
+                }
+            }
+        }
+
+        void fill(unsigned char *data, size_t size) {
+            std::uniform_real_distribution<double> chance(0, 1);
+            std::uniform_int_distribution<unsigned int> byte(0, 255);
+            std::uniform_int_distribution<size_t> wordIndex(0, m_vocabulary.size() - 1);
+
+            for(size_t position = 0; position < size;) {
+                if(chance(m_random) < m_compressibility) {
+                    const auto &word = m_vocabulary[wordIndex(m_random)];
+                    auto length = std::min(word.size(), size - position);
+
+                    memcpy(data + position, word.data(), length);
+                    position += length;
+                } else {
+                    data[position++] = byte(m_random);
+                }
+            }
+        }
+
+        unsigned char byte() {
+            return std::uniform_int_distribution<unsigned int>(0, 255)(m_random);
+        }
+
+    private:
+        std::mt19937 m_random;
+        double m_compressibility;
+        std::vector<std::vector<unsigned char>> m_vocabulary;
+    };
+
+    void put16(unsigned char *data, uint16_t value) {
+        data[0] = value;
+        data[1] = value >> 8;
+    }
+
+    void put32(unsigned char *data, uint32_t value) {
+        put16(data, value);
+        put16(data + 2, value >> 16);
+    }
+
+    /*
+     * An 8 bits per pixel bitmap file of 'size' bytes.
+     */
+    void makeLogo(Filler &filler, unsigned char *logo, size_t size) {
+        if(size < BitmapHeadersSize + BitmapPaletteSize + BitmapWidth)
+            throw std::logic_error("the synthetic logo is too small to hold a bitmap");
+
+        size_t bitsOffset = BitmapHeadersSize + BitmapPaletteSize;
+
+        memset(logo, 0, bitsOffset);
+        logo[0] = 'B';
+        logo[1] = 'M';
+        put32(logo + 2, size);
+        put32(logo + 10, bitsOffset);
+        put32(logo + 14, 40);
+        put32(logo + 18, BitmapWidth);
+        put32(logo + 22, (size - bitsOffset) / BitmapWidth);
+        put16(logo + 26, 1);
+        put16(logo + 28, 8);
+
+        filler.fill(logo + BitmapHeadersSize, size - BitmapHeadersSize);
+    }
+
+    /*
+     * Code of MSLOAD, starting with the 'BJ' signature the boot sector checks
+     * for, and ending with the far jump into the payload.
+     */
+    void makeMSLOAD(Filler &filler, unsigned char *image, size_t end) {
+        image[0x200] = 'B';
+        image[0x201] = 'J';
+
+        for(size_t position = 0x202; position < FinalBranchOffset; position++) {
+            image[position] = filler.byte();
+        }
+
+        static const unsigned char finalBranch[] { 0xEA, 0x00, 0x00, 0x70, 0x00 };
+        memcpy(image + FinalBranchOffset, finalBranch, sizeof(finalBranch));
+
+        for(size_t position = FinalBranchOffset + sizeof(finalBranch); position < end; position++) {
+            image[position] = filler.byte();
+        }
+    }
+
+    inline size_t alignToParagraph(size_t size) {
+        return (size + 15) & ~static_cast<size_t>(15);
+    }
+
+    class BitWriter {
+    public:
+        explicit BitWriter(std::vector<unsigned char> &output) : m_output(output), m_buffer(0), m_bits(0) {
+
+        }
+
+        void put(unsigned int value, unsigned int bits) {
+            m_buffer |= static_cast<uint32_t>(value & ((1U << bits) - 1)) << m_bits;
+            m_bits += bits;
+
+            while(m_bits >= 8) {
+                m_output.push_back(m_buffer);
+                m_buffer >>= 8;
+                m_bits -= 8;
+            }
+        }
+
+        void flush() {
+            if(m_bits > 0)
+                m_output.push_back(m_buffer);
+
+            m_buffer = 0;
+            m_bits = 0;
+        }
+
+    private:
+        std::vector<unsigned char> &m_output;
+        uint32_t m_buffer;
+        unsigned int m_bits;
+    };
+
+    static constexpr size_t DSSectorSize = 512;
+    static constexpr size_t DSBlockSize = 0x8000;
+    static constexpr size_t DSMaxOffset = 0xFFE + 320; // 0xFFF + 320 marks the end of a sector
+    static constexpr unsigned int DSHashBits = 12;
+    static constexpr unsigned int DSMaxChainLength = 16;
+
+    /*
+     * The 'DS' encoding of one block (see DSDecoder.cpp), with the greedy
+     * longest match found among the last few positions with the same three
+     * leading bytes. Matches don't cross sectors.
+     */
+    void dsCompressBlock(const unsigned char *data, size_t size, std::vector<unsigned char> &output) {
+        BitWriter writer(output);
+
+        std::vector<int32_t> head(1U << DSHashBits, -1);
+        std::vector<int32_t> previous(size, -1);
+
+        auto hash = [data](size_t position) {
+            uint32_t value = data[position] | (data[position + 1] << 8) | (data[position + 2] << 16);
+            return (value * 2654435761U) >> (32 - DSHashBits);
+        };
+
+        auto insert = [&](size_t position, size_t sectorEnd) {
+            if(position + 3 <= sectorEnd) {
+                auto &bucket = head[hash(position)];
+                previous[position] = bucket;
+                bucket = position;
+            }
+        };
+
+        for(size_t position = 0; position < size;) {
+            size_t sectorStart = position - position % DSSectorSize;
+            size_t sectorEnd = std::min(sectorStart + DSSectorSize, size);
+
+            size_t bestLength = 0;
+            size_t bestOffset = 0;
+
+            if(position + 3 <= sectorEnd) {
+                int32_t candidate = head[hash(position)];
+
+                for(unsigned int chain = 0; candidate >= 0 && chain < DSMaxChainLength; chain++) {
+                    size_t offset = position - candidate;
+                    if(offset > DSMaxOffset)
+                        break;
+
+                    size_t length = 0;
+                    while(position + length < sectorEnd && data[candidate + length] == data[position + length])
+                        length++;
+
+                    if(length > bestLength) {
+                        bestLength = length;
+                        bestOffset = offset;
+                    }
+
+                    candidate = previous[candidate];
+                }
+            }
+
+            if(bestLength >= 3) {
+                if(bestOffset < 64) {
+                    writer.put(0, 2);
+                    writer.put(bestOffset, 6);
+                } else if(bestOffset < 320) {
+                    writer.put(3, 2);
+                    writer.put(0, 1);
+                    writer.put(bestOffset - 64, 8);
+                } else {
+                    writer.put(3, 2);
+                    writer.put(1, 1);
+                    writer.put(bestOffset - 320, 12);
+                }
+
+                unsigned int lengthBits = 0;
+                while((2U << lengthBits) + 1 <= bestLength)
+                    lengthBits++;
+
+                writer.put(0, lengthBits);
+                writer.put(1, 1);
+                writer.put(bestLength - (1U << lengthBits) - 1, lengthBits);
+
+                for(size_t index = 0; index < bestLength; index++) {
+                    insert(position + index, sectorEnd);
+                }
+
+                position += bestLength;
+            } else {
+                auto byte = data[position];
+
+                writer.put(byte < 0x80 ? 1 : 2, 2);
+                writer.put(byte & 0x7F, 7);
+
+                insert(position, sectorEnd);
+
+                position++;
+            }
+
+            if(position % DSSectorSize == 0) {
+                writer.put(3, 2);
+                writer.put(1, 1);
+                writer.put(0xFFF, 12);
+            }
+        }
+
+        writer.flush();
+    }
+}
+
+std::vector<unsigned char> cmCompress(const unsigned char *data, size_t size,
+                                      const unsigned char *decompressor, size_t decompressorLength) {
+    std::vector<unsigned char> stream { 'C', 'M' };
+    std::vector<unsigned char> block;
+
+    for(size_t position = 0; position < size; position += DSBlockSize) {
+        auto blockSize = std::min(DSBlockSize, size - position);
+
+        block.assign({ 'D', 'S', 0, 0, 0, 0 });
+        dsCompressBlock(data + position, blockSize, block);
+
+        if(block.size() > 0xFFFF)
+            throw std::logic_error("a 'DS' block doesn't fit its 16-bit length");
+
+        stream.push_back(1);
+        stream.push_back(block.size());
+        stream.push_back(block.size() >> 8);
+        stream.push_back(blockSize);
+        stream.push_back(blockSize >> 8);
+        stream.insert(stream.end(), block.begin(), block.end());
+    }
+
+    stream.insert(stream.end(), { 0, 0, 0 });
+    stream.resize(alignToParagraph(stream.size()));
+
+    if(decompressor) {
+        if(decompressorLength % 16 != 0)
+            throw std::logic_error("the 'CM' decompressor isn't a whole number of paragraphs long");
+
+        stream.insert(stream.end(), decompressor, decompressor + decompressorLength);
+        return stream;
+    }
+
+    /*
+     * The decompressor follows the stream, with its own 'CM' header: the
+     * signature, the entry point and the length in paragraphs. There is no
+     * code in this one.
+     */
+    size_t decompressorPos = stream.size();
+    stream.resize(decompressorPos + 32);
+    stream[decompressorPos] = 'C';
+    stream[decompressorPos + 1] = 'M';
+    put16(&stream[decompressorPos + 4], 2);
+
+    return stream;
+}
+
+std::vector<unsigned char> generateSyntheticImage(const SyntheticImageOptions &options) {
+    if(options.compressibility < 0 || options.compressibility > 1)
+        throw std::logic_error("the compressibility of a synthetic image must be between 0 and 1");
+
+    if(options.layout == SyntheticLayout::DOS7 &&
+       (options.payloadSize < MinDOS7PayloadSize || options.payloadSize > MaxDOS7PayloadSize)) {
+        throw std::logic_error("the payload of a synthetic MS-DOS 7 image must be between " +
+                               std::to_string(MinDOS7PayloadSize) + " and " +
+                               std::to_string(MaxDOS7PayloadSize) + " bytes");
+    }
+
+    if(options.payloadSize < 16)
+        throw std::logic_error("the payload of a synthetic image is too small");
+
+    Filler filler(options.seed, options.compressibility);
+
+    size_t logoPos = MSLOADSize + options.payloadSize;
+    size_t dosSize = alignToParagraph(logoPos + options.logoSize);
+    size_t msdcmSize = options.layout == SyntheticLayout::DOS7 ? options.msdcmSize : 0;
+
+    std::vector<unsigned char> image(dosSize + msdcmSize);
+
+    auto payload = image.data() + MSLOADSize;
+    filler.fill(payload, options.payloadSize);
+
+    /*
+     * Start with a short jump, like IO.SYS does, so that the payload can't be
+     * mistaken for a compressed one.
+     */
+    payload[0] = 0xEB;
+    payload[2] = 0x90;
+
+    if(options.logoSize != 0)
+        makeLogo(filler, image.data() + logoPos, options.logoSize);
+
+    auto exe = reinterpret_cast<EXEHeader *>(image.data());
+    exe->e_magic = EXEHeaderMagic;
+
+    if(options.layout == SyntheticLayout::DOS7) {
+        makeMSLOAD(filler, image.data(), 0x700);
+
+        put16(image.data() + DynamicPortionLengthOffset, options.payloadSize - MinDOS7PayloadSize);
+
+        filler.fill(image.data() + dosSize, msdcmSize);
+
+        exe->e_cp = (image.size() + 511) / 512;
+        exe->e_cblp = image.size() % 512;
+        exe->e_cparhdr = dosSize / 16;
+    } else {
+        /*
+         * MS-DOS 8 only keeps the signature and the size of the DOS portion,
+         * biased by 32 paragraphs.
+         */
+        makeMSLOAD(filler, image.data(), FinalBranchOffset + 5);
+
+        if(options.layout == SyntheticLayout::DOS8Compressed) {
+            auto stream = cmCompress(payload, dosSize - MSLOADSize);
+
+            image.resize(MSLOADSize);
+            image.insert(image.end(), stream.begin(), stream.end());
+            dosSize = image.size();
+
+            exe = reinterpret_cast<EXEHeader *>(image.data());
+        }
+
+        exe->e_cparhdr = dosSize / 16 + 32;
+    }
+
+    return image;
+}
@@ -0,0 +1,62 @@
+#ifndef SYNTHETIC_IMAGE_H
+#define SYNTHETIC_IMAGE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+ * The layouts of WINBOOT.SYS that generateSyntheticImage() can imitate.
+ */
+enum class SyntheticLayout {
+    DOS7,           // MZ header + MSLOAD + IO.SYS + logo, followed by MSDCM
+    DOS8,           // Vestigial MZ header + MSLOAD + IO.SYS + logo
+    DOS8Compressed  // Like DOS8, but with the payload 'CM'-compressed
+};
+
+struct SyntheticImageOptions {
+    SyntheticLayout layout = SyntheticLayout::DOS7;
+
+    /*
+     * Of IO.SYS proper, from the end of MSLOAD to the logo. The DOS 7 layout
+     * derives the logo position from a 16-bit length in IO.SYS, so there it
+     * has to be between 0x12650 and 0x2264F bytes.
+     */
+    size_t payloadSize = 0x18000;
+
+    size_t logoSize = 30000;
+
+    /*
+     * Only used by the DOS 7 layout.
+     */
+    size_t msdcmSize = 20000;
+
+    /*
+     * The share of the contents made of a small vocabulary of repeated
+     * strings, from 0 (random bytes) to 1; the rest is random bytes.
+     */
+    double compressibility = 0.8;
+
+    uint32_t seed = 1;
+};
+
+/*
+ * Builds an image with the structure WinbootImage expects of the given
+ * layout, and filler instead of actual code. It loads, compresses, loses its
+ * logo and MSDCM, and saves like the real thing, but doesn't boot. The 'CM'
+ * stream of the compressed layout only decodes natively, as there is no
+ * decompressor to emulate in it.
+ */
+std::vector<unsigned char> generateSyntheticImage(const SyntheticImageOptions &options);
+
+/*
+ * Encodes 'size' bytes as a 'CM' stream of 'DS' blocks, as MS-DOS 8
+ * compresses its payload, with the greedy matching of a simple encoder. The
+ * stream is followed by the given decompressor, 'CM' header included, which
+ * must be a whole number of paragraphs long; without one, by a header with
+ * no code.
+ */
+std::vector<unsigned char> cmCompress(const unsigned char *data, size_t size,
+                                      const unsigned char *decompressor = nullptr, size_t decompressorLength = 0);
+
+#endif
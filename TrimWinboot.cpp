@@ -0,0 +1,99 @@
+#include "TrimWinboot.h"
+#include "Statistics.h"
+#include "WinbootImage.h"
+
+#include <cstring>
+#include <new>
+#include <system_error>
+#include <vector>
+
+OutputAllocator outputInto(std::span<std::byte> buffer) {
+    return [buffer](size_t size) {
+        return size <= buffer.size() ? buffer.first(size) : std::span<std::byte>();
+    };
+}
+
+static std::span<std::byte> allocateOutput(const OutputAllocator &allocator, size_t size, TrimWinbootResult &result) {
+    auto area = allocator(size);
+
+    if(area.size() < size) {
+        result.requiredSize = size;
+
+        throw WinbootError(WinbootErrorCode::OutputTooSmall,
+                           "the output buffer is too small: " + std::to_string(size) + " bytes needed");
+    }
+
+    return area.first(size);
+}
+
+TrimWinbootResult trimWinboot(std::span<const std::byte> input, const TrimWinbootRequest &request) {
+    TrimWinbootResult result;
+    ScopedLogSink log(request.log);
+
+    try {
+        if(!request.output)
+            throw WinbootError(WinbootErrorCode::InvalidOptions, "no output allocator");
+
+        auto statistics = request.statistics;
+        if(statistics) {
+            statistics->inputSize = input.size();
+        }
+
+        WinbootImage image;
+        image.setCMDecompressionOptions(request.options.cm);
+        image.setStatistics(statistics);
+
+        {
+            PhaseTimer timer(statistics, "load");
+
+            auto data = reinterpret_cast<const unsigned char *>(input.data());
+            image.load(std::vector<unsigned char>(data, data + input.size()));
+        }
+
+        if(request.msdcm) {
+            std::vector<unsigned char> msdcm;
+            image.extractMSDCM(msdcm);
+
+            result.msdcm = allocateOutput(request.msdcm, msdcm.size(), result);
+            memcpy(result.msdcm.data(), msdcm.data(), msdcm.size());
+        }
+
+        transformImage(image, request.options);
+
+        {
+            PhaseTimer timer(statistics, "save");
+
+            auto output = allocateOutput(request.output, image.savedSize(), result);
+            image.save(std::span<unsigned char>(reinterpret_cast<unsigned char *>(output.data()), output.size()));
+
+            result.output = output;
+        }
+
+        if(statistics) {
+            statistics->outputSize = result.output.size();
+        }
+    } catch(const WinbootError &e) {
+        result.error = e.code();
+        result.message = e.what();
+    } catch(const std::bad_alloc &e) {
+        result.error = WinbootErrorCode::OutOfMemory;
+        result.message = e.what();
+    } catch(const std::system_error &e) {
+        result.error = WinbootErrorCode::IOError;
+        result.message = e.what();
+    } catch(const std::exception &e) {
+        result.error = WinbootErrorCode::Internal;
+        result.message = e.what();
+    }
+
+    if(!result) {
+        result.output = std::span<std::byte>();
+        result.msdcm = std::span<std::byte>();
+
+        if(request.statistics) {
+            request.statistics->error = result.message;
+        }
+    }
+
+    return result;
+}
@@ -0,0 +1,90 @@
+#ifndef TRIM_WINBOOT_H
+#define TRIM_WINBOOT_H
+
+#include <cstddef>
+#include <functional>
+#include <span>
+#include <string>
+
+#include "ImageProcessor.h"
+#include "Log.h"
+#include "WinbootError.h"
+
+struct ImageStatistics;
+
+/*
+ * The in-memory interface of libtrimwinboot, for the programs that already
+ * hold WINBOOT.SYS in memory.
+ */
+
+/*
+ * Asked once for room for an output of 'size' bytes, such as from an arena.
+ * Returns where to write it; a shorter span fails the call with
+ * WinbootErrorCode::OutputTooSmall.
+ */
+using OutputAllocator = std::function<std::span<std::byte>(size_t size)>;
+
+/*
+ * Writes the output into a caller-provided buffer.
+ */
+OutputAllocator outputInto(std::span<std::byte> buffer);
+
+struct TrimWinbootRequest {
+    /*
+     * The same transformations as on the command line. Memory mapping and
+     * the result cache only apply to files, so 'mappedIO' and
+     * 'cacheDirectory' are ignored.
+     */
+    ProcessingOptions options;
+
+    /*
+     * Receives the processed image.
+     */
+    OutputAllocator output;
+
+    /*
+     * If set, receives MSDCM, extracted before the transformations.
+     */
+    OutputAllocator msdcm;
+
+    /*
+     * Where the messages of the call go, including those of the threads it
+     * starts, which may call it concurrently. If null, the process-wide sink.
+     */
+    const LogSink *log = nullptr;
+
+    /*
+     * If not null, the sizes and the time taken by every phase are recorded
+     * into it.
+     */
+    ImageStatistics *statistics = nullptr;
+};
+
+struct TrimWinbootResult {
+    WinbootErrorCode error = WinbootErrorCode::None;
+    std::string message;
+
+    /*
+     * Where the outputs were written, empty on failure.
+     */
+    std::span<std::byte> output;
+    std::span<std::byte> msdcm;
+
+    /*
+     * With WinbootErrorCode::OutputTooSmall, the size of the output that
+     * didn't fit.
+     */
+    size_t requiredSize = 0;
+
+    explicit inline operator bool() const {
+        return error == WinbootErrorCode::None;
+    }
+};
+
+/*
+ * Processes the image in 'input'. Never throws; failures are returned in the
+ * result instead.
+ */
+TrimWinbootResult trimWinboot(std::span<const std::byte> input, const TrimWinbootRequest &request);
+
+#endif
@@ -0,0 +1,48 @@
+#include "WinbootError.h"
+
+WinbootError::WinbootError(WinbootErrorCode code, const std::string &message) : std::logic_error(message), m_code(code) {
+
+}
+
+const char *winbootErrorCodeName(WinbootErrorCode code) {
+    switch(code) {
+        case WinbootErrorCode::None:
+            return "none";
+
+        case WinbootErrorCode::InvalidImage:
+            return "invalid-image";
+
+        case WinbootErrorCode::UnsupportedImage:
+            return "unsupported-image";
+
+        case WinbootErrorCode::AlreadyCompressed:
+            return "already-compressed";
+
+        case WinbootErrorCode::AlreadyRemoved:
+            return "already-removed";
+
+        case WinbootErrorCode::CorruptPayload:
+            return "corrupt-payload";
+
+        case WinbootErrorCode::CorruptStream:
+            return "corrupt-stream";
+
+        case WinbootErrorCode::DoesNotFit:
+            return "does-not-fit";
+
+        case WinbootErrorCode::InvalidOptions:
+            return "invalid-options";
+
+        case WinbootErrorCode::OutputTooSmall:
+            return "output-too-small";
+
+        case WinbootErrorCode::IOError:
+            return "io-error";
+
+        case WinbootErrorCode::OutOfMemory:
+            return "out-of-memory";
+
+        default:
+            return "internal";
+    }
+}
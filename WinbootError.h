@@ -0,0 +1,48 @@
+#ifndef WINBOOT_ERROR_H
+#define WINBOOT_ERROR_H
+
+#include <stdexcept>
+#include <string>
+
+/*
+ * What went wrong, for the callers that need to tell the failures apart
+ * rather than just report them.
+ */
+enum class WinbootErrorCode {
+    None,
+    InvalidImage,       // Not a WINBOOT.SYS, or a truncated or damaged one
+    UnsupportedImage,   // A WINBOOT.SYS this tool can't handle (yet)
+    AlreadyCompressed,  // The payload has already been compressed by this tool
+    AlreadyRemoved,     // MSDCM has already been removed
+    CorruptPayload,     // The 'CM'-compressed payload of an MS-DOS 8 image doesn't decompress
+    CorruptStream,      // A stream of one of our codecs doesn't decode
+    DoesNotFit,         // The compressed payload or its extension doesn't fit where it has to go
+    InvalidOptions,     // The requested options can't be applied together
+    OutputTooSmall,     // The caller-provided output buffer is too small
+    IOError,
+    OutOfMemory,
+    Internal            // Anything else; a bug, most likely
+};
+
+/*
+ * A short, stable name for the code, such as "invalid-image".
+ */
+const char *winbootErrorCodeName(WinbootErrorCode code);
+
+/*
+ * Still a std::logic_error, so that it is reported like all the other
+ * failures by the code that doesn't care for the code.
+ */
+class WinbootError : public std::logic_error {
+public:
+    WinbootError(WinbootErrorCode code, const std::string &message);
+
+    inline WinbootErrorCode code() const {
+        return m_code;
+    }
+
+private:
+    WinbootErrorCode m_code;
+};
+
+#endif
@@ -1,14 +1,19 @@
 #include <fstream>
 #include <bit>
 #include <cstring>
+#include <algorithm>
 
 #include "WinbootImage.h"
 #include "DOSTypes.h"
-#include "CompressionStream.h"
-#include "msload_extension.h"
+#include "PayloadCodec.h"
+#include "CompressionSearch.h"
 #include "CMDecompressor.h"
-
-#include <lz4hc.h>
+#include "MappedFile.h"
+#include "FileIO.h"
+#include "Statistics.h"
+#include "WinbootError.h"
+#include "WinbootVariant.h"
+#include "Log.h"
 
 WinbootImage::WinbootImage() = default;
 
@@ -34,7 +39,138 @@ void WinbootImage::load(std::istream &stream) {
     load(std::move(data));
 }
 
+void WinbootImage::loadMapped(const std::filesystem::path &path) {
+    auto mapping = std::make_unique<MappedFile>(path);
+
+    /*
+     * Only copy in the DOS portion, as indicated by the header. The header is
+     * fully validated by parse() afterwards.
+     */
+    size_t split = mapping->size();
+
+    if(mapping->size() >= sizeof(EXEHeader)) {
+        auto exe = reinterpret_cast<const EXEHeader *>(mapping->data());
+
+        size_t dosSize = exe->e_cparhdr;
+        if(exe->e_magic == EXEHeaderMagic && exe->e_cp == 0) {
+            dosSize = dosSize >= 32 ? dosSize - 32 : 0;
+        }
+
+        split = std::min(split, std::max(16 * dosSize, sizeof(EXEHeader)));
+    }
+
+    m_data.assign(mapping->data(), mapping->data() + split);
+    m_layout.assign({ Extent{ Extent::Source::Data, 0, split } });
+
+    if(mapping->size() > split) {
+        m_layout.push_back(Extent{ Extent::Source::Mapping, split, mapping->size() - split });
+        m_mapping = std::move(mapping);
+    } else {
+        m_mapping.reset();
+    }
+
+    parse();
+}
+
+size_t WinbootImage::imageSize() const {
+    size_t size = 0;
+
+    for(const auto &extent: m_layout) {
+        size += extent.size;
+    }
+
+    return size;
+}
+
+std::vector<WinbootImage::Extent> WinbootImage::finalLayout() {
+    auto layout = m_layout;
+
+    auto padding = trailingPaddingBytes();
+    if(padding != 0)
+        layout.push_back(Extent{ Extent::Source::Zero, 0, padding });
+
+    return layout;
+}
+
+const unsigned char *WinbootImage::extentData(const Extent &extent) const {
+    switch(extent.source) {
+        case Extent::Source::Data:
+            return m_data.data() + extent.offset;
+
+        case Extent::Source::Mapping:
+            return m_mapping->data() + extent.offset;
+
+        default:
+            return nullptr;
+    }
+}
+
+void WinbootImage::gather(std::span<const Extent> extents, unsigned char *output) const {
+    for(const auto &extent: extents) {
+        if(extent.source == Extent::Source::Zero) {
+            memset(output, 0, extent.size);
+        } else {
+            memcpy(output, extentData(extent), extent.size);
+        }
+
+        output += extent.size;
+    }
+}
+
+void WinbootImage::writeExtents(int fd, std::span<const Extent> extents) const {
+    for(const auto &extent: extents) {
+        if(extent.source == Extent::Source::Mapping) {
+            m_mapping->copyTo(fd, extent.offset, extent.size);
+        } else if(extent.source == Extent::Source::Zero) {
+            std::vector<char> padding(extent.size);
+            writeAll(fd, padding.data(), padding.size());
+        } else {
+            writeAll(fd, extentData(extent), extent.size);
+        }
+    }
+}
+
+const std::vector<unsigned char> &WinbootImage::data() {
+    /*
+     * Nothing needs to move if the extents still follow each other in
+     * m_data.
+     */
+    bool inPlace = true;
+    size_t end = 0;
+
+    for(const auto &extent: m_layout) {
+        if(extent.source != Extent::Source::Data || extent.offset != end) {
+            inPlace = false;
+            break;
+        }
+
+        end += extent.size;
+    }
+
+    if(inPlace) {
+        m_data.resize(end);
+    } else {
+        std::vector<unsigned char> data(imageSize());
+        gather(m_layout, data.data());
+
+        m_data = std::move(data);
+        m_mapping.reset();
+    }
+
+    m_layout.assign({ Extent{ Extent::Source::Data, 0, m_data.size() } });
+
+    return m_data;
+}
+
 void WinbootImage::save(const std::filesystem::path &path) {
+    if(m_mapping) {
+        OutputFile file(path);
+        writeExtents(file.fd(), finalLayout());
+        file.commit();
+
+        return;
+    }
+
     std::ofstream stream;
     stream.exceptions(std::ios::failbit | std::ios::eofbit | std::ios::badbit);
     stream.open(path, std::ios::in | std::ios::trunc | std::ios::binary);
@@ -42,8 +178,37 @@ void WinbootImage::save(const std::filesystem::path &path) {
 }
 
 void WinbootImage::save(std::ostream &stream) {
-    stream.write(reinterpret_cast<const char *>(m_data.data()), m_data.size());
+    for(const auto &extent: finalLayout()) {
+        if(extent.source == Extent::Source::Zero) {
+            std::vector<char> padding(extent.size);
+            stream.write(padding.data(), padding.size());
+        } else {
+            stream.write(reinterpret_cast<const char *>(extentData(extent)), extent.size);
+        }
+    }
+}
+
+void WinbootImage::save(std::vector<unsigned char> &data) {
+    data.resize(savedSize());
+    save(std::span<unsigned char>(data));
+}
 
+void WinbootImage::save(std::span<unsigned char> data) {
+    if(data.size() != savedSize())
+        throw std::logic_error("WinbootImage::save: the buffer doesn't match the saved size");
+
+    /*
+     * The padding is only zeros, so skip building the final layout.
+     */
+    gather(m_layout, data.data());
+    memset(data.data() + imageSize(), 0, data.size() - imageSize());
+}
+
+size_t WinbootImage::savedSize() {
+    return imageSize() + trailingPaddingBytes();
+}
+
+size_t WinbootImage::trailingPaddingBytes() {
     auto exeHeader = getEXEHeader(true);
     if(exeHeader->e_magic != EXEHeaderMagic) {
         /*
@@ -54,14 +219,21 @@ void WinbootImage::save(std::ostream &stream) {
          * without this padding (which must be at least 5 sectors) at the end
          * of file.
          */
-        std::vector<char> padding(5 * 512);
-        stream.write(padding.data(), padding.size());
+        return 5 * 512;
     }
+
+    return 0;
 }
 
 void WinbootImage::load(std::vector<unsigned char> &&data) {
     m_data = std::move(data);
+    m_layout.assign({ Extent{ Extent::Source::Data, 0, m_data.size() } });
+    m_mapping.reset();
+
+    parse();
+}
 
+void WinbootImage::parse() {
     static_assert(std::endian::native == std::endian::little, "Little-endian system is expected");
 
     auto exe = getEXEHeader(true);
@@ -75,7 +247,7 @@ void WinbootImage::load(std::vector<unsigned char> &&data) {
 
         m_version = Version::DOS8;
 
-        printf("This is a MS-DOS 8 WINBOOT.\n");
+        logMessage(LogLevel::Info, "This is a MS-DOS 8 WINBOOT.");
 
         /*
          * Is this a compressed image?
@@ -83,28 +255,52 @@ void WinbootImage::load(std::vector<unsigned char> &&data) {
         auto size = dosSizeBytes();
 
         if(size < MSLOADSize) {
-            throw std::logic_error("DOS is too short doesn't fit the MSLOAD");
+            throw WinbootError(WinbootErrorCode::InvalidImage, "DOS is too short doesn't fit the MSLOAD");
         }
 
         auto payload = m_data.data() + MSLOADSize;
         auto payloadSize = size - MSLOADSize;
 
         if(isCMCompressed(payload, payloadSize)) {
-            printf("The payload is 'CM' compressed.\n");
+            logMessage(LogLevel::Info, "The payload is 'CM' compressed.");
+
+            PhaseTimer timer(m_statistics, "cm-decode");
+
+            /*
+             * The decompressed length is known upfront, so allocate the new
+             * image once and decompress every block directly into its place.
+             * The compressed payload stays in the old buffer until then.
+             */
+            size_t decompressedSize;
+            std::vector<unsigned char> image;
 
-            auto decompressed = cmDecompress(payload, payloadSize);
+            try {
+                decompressedSize = cmDecompressedSize(payload, payloadSize);
 
-            if((decompressed.size() & 15) != 0)
-                throw std::logic_error("decompressed data length is not paragraph-aligned");
+                if((decompressedSize & 15) != 0)
+                    throw WinbootError(WinbootErrorCode::CorruptPayload, "decompressed data length is not paragraph-aligned");
 
-            m_data.resize(MSLOADSize + decompressed.size());
+                image.resize(MSLOADSize + decompressedSize);
+                memcpy(image.data(), m_data.data(), MSLOADSize);
 
-            memcpy(m_data.data() + MSLOADSize, decompressed.data(), decompressed.size());
+                cmDecompress(payload, payloadSize, image.data() + MSLOADSize, decompressedSize, m_cmOptions);
+            } catch(const WinbootError &) {
+                throw;
+            } catch(const std::logic_error &e) {
+                /*
+                 * Whichever engine failed, it was on the data of the image.
+                 */
+                throw WinbootError(WinbootErrorCode::CorruptPayload, e.what());
+            }
+
+            m_data = std::move(image);
+            m_layout.assign({ Extent{ Extent::Source::Data, 0, m_data.size() } });
+            m_mapping.reset();
 
             exe = getEXEHeader(true);
             exe->e_cparhdr = (m_data.size() + 512) / 16;
 
-            printf("Decompressed to %zu bytes\n", decompressed.size());
+            logMessage(LogLevel::Info, "Decompressed to %zu bytes", decompressedSize);
         }
 
     } else {
@@ -120,10 +316,10 @@ void WinbootImage::load(std::vector<unsigned char> &&data) {
 
         m_version = Version::DOS7;
 
-        printf("This is a MS-DOS 7 WINBOOT.\n");
+        logMessage(LogLevel::Info, "This is a MS-DOS 7 WINBOOT.");
 
         if(exe->e_cp < 1) {
-            throw std::logic_error("e_cp indicates zero pages");
+            throw WinbootError(WinbootErrorCode::InvalidImage, "e_cp indicates zero pages");
         }
 
         auto totalExeSize = 512 * exe->e_cp;
@@ -132,20 +328,33 @@ void WinbootImage::load(std::vector<unsigned char> &&data) {
             totalExeSize = totalExeSize - 512 + exe->e_cblp;
         }
 
-        if(totalExeSize != m_data.size()) {
+        if(totalExeSize != imageSize()) {
             std::stringstream error;
             error << "exe size doesn't match: " << totalExeSize << " indicated ("
                 << exe->e_cp << " 512-byte pages, " << exe->e_cblp << " bytes "
-                "in the last page), but actual file size is " << m_data.size()
+                "in the last page), but actual file size is " << imageSize()
                 << " bytes";
 
-            throw std::logic_error(error.str());
+            throw WinbootError(WinbootErrorCode::InvalidImage, error.str());
         }
     }
 
-    if(dosSizeBytes() > m_data.size()) {
-        printf("dos size bytes: %zu, image size: %zu\n", dosSizeBytes(), m_data.size());
-        throw std::logic_error("EXE header (DOS) portion overruns the executable");
+    if(dosSizeBytes() > imageSize()) {
+        logMessage(LogLevel::Info, "dos size bytes: %zu, image size: %zu", dosSizeBytes(), imageSize());
+        throw WinbootError(WinbootErrorCode::InvalidImage, "EXE header (DOS) portion overruns the executable");
+    }
+
+    /*
+     * Make the DOS portion an extent of its own, as it's the only part that
+     * the transformations edit.
+     */
+    auto dosSize = dosSizeBytes();
+    auto &first = m_layout.front();
+
+    if(first.size > dosSize) {
+        Extent rest{ first.source, first.offset + dosSize, first.size - dosSize };
+        first.size = dosSize;
+        m_layout.insert(m_layout.begin() + 1, rest);
     }
 }
 
@@ -156,8 +365,8 @@ EXEHeader *WinbootImage::getEXEHeader(bool evenIfInvaid) {
         header = reinterpret_cast<EXEHeader *>(m_data.data());
     }
 
-    if(!header || (!evenIfInvaid && (header->e_magic != EXEHeaderMagic || header->e_cp != 0)))
-        throw std::logic_error("winboot has no MZ header. Already removed?");
+    if(!header || (!evenIfInvaid && (header->e_magic != EXEHeaderMagic || header->e_cp == 0)))
+        throw WinbootError(WinbootErrorCode::AlreadyRemoved, "winboot has no MZ header. Already removed?");
 
     return header;
 }
@@ -174,7 +383,7 @@ size_t WinbootImage::dosSizeParagraphs() {
 
     if(m_version == Version::DOS8) {
         if(size < 32) {
-            throw std::logic_error("DOS size is less than the expected bias");
+            throw WinbootError(WinbootErrorCode::InvalidImage, "DOS size is less than the expected bias");
         }
 
         size -= 32;
@@ -189,6 +398,18 @@ size_t WinbootImage::dosSizeBytes() {
 
 
 void WinbootImage::extractMSDCM(const std::filesystem::path &path) {
+    if(m_mapping) {
+        auto header = makeMSDCMHeader();
+
+        OutputFile file(path);
+
+        writeAll(file.fd(), header.data(), header.size());
+        writeExtents(file.fd(), std::span<const Extent>(m_layout).subspan(1));
+        file.commit();
+
+        return;
+    }
+
     std::ofstream stream;
     stream.exceptions(std::ios::failbit | std::ios::eofbit | std::ios::badbit);
     stream.open(path, std::ios::in | std::ios::trunc | std::ios::binary);
@@ -196,6 +417,23 @@ void WinbootImage::extractMSDCM(const std::filesystem::path &path) {
 }
 
 void WinbootImage::extractMSDCM(std::ostream &stream) {
+    std::vector<unsigned char> data;
+    extractMSDCM(data);
+    stream.write(reinterpret_cast<const char *>(data.data()), data.size());
+}
+
+void WinbootImage::extractMSDCM(std::vector<unsigned char> &data) {
+    data = makeMSDCMHeader();
+
+    /*
+     * Everything past the DOS portion is the MSDCM body.
+     */
+    auto header = data.size();
+    data.resize(header + imageSize() - m_layout.front().size);
+    gather(std::span<const Extent>(m_layout).subspan(1), data.data() + header);
+}
+
+std::vector<unsigned char> WinbootImage::makeMSDCMHeader() {
     if(m_version == Version::DOS7) {
         static constexpr size_t exeHeaderAllocationBytes = 32;
         static constexpr size_t exeHeaderAllocationParagraphs = exeHeaderAllocationBytes / 16;
@@ -216,23 +454,22 @@ void WinbootImage::extractMSDCM(std::ostream &stream) {
         * exeHeaderAllocation.
         */
 
-        std::vector<char> header(exeHeaderAllocationBytes);
-        auto newExe = reinterpret_cast<EXEHeader *>(header.data());
+        auto newTotalSize = imageSize() - originalHeaderBytes + exeHeaderAllocationBytes;
 
-        auto newTotalSize = m_data.size() - originalHeaderBytes + exeHeaderAllocationBytes;
+        std::vector<unsigned char> header(exeHeaderAllocationBytes);
+        auto newExe = reinterpret_cast<EXEHeader *>(header.data());
 
         *newExe = *exeHeader;
         newExe->e_cparhdr = exeHeaderAllocationParagraphs;
         newExe->e_cp = (newTotalSize + 511) / 512;
         newExe->e_cblp = newTotalSize & 511;
         if(newExe->e_crlc != 0) {
-            throw std::logic_error("MSDCM contains relocations, which are not currently supported");
+            throw WinbootError(WinbootErrorCode::UnsupportedImage, "MSDCM contains relocations, which are not currently supported");
         }
 
-        stream.write(header.data(), header.size());
-        stream.write(reinterpret_cast<const char *>(m_data.data()) + originalHeaderBytes, m_data.size() - originalHeaderBytes);
+        return header;
     } else {
-        throw std::logic_error("MSDCM cannot be extracted from this DOS version");
+        throw WinbootError(WinbootErrorCode::UnsupportedImage, "MSDCM cannot be extracted from this DOS version");
     }
 }
 
@@ -249,134 +486,237 @@ void WinbootImage::removeMSDCM() {
 
         auto savedSize = exeHeader->e_cparhdr;
 
-        m_data.resize(16 * savedSize);
+        m_layout.resize(1);
+        m_mapping.reset();
 
         memset(exeHeader, 0, 512);
 
         exeHeader->e_cparhdr = savedSize;
     } else {
-        throw std::logic_error("MSDCM cannot be removed from this DOS version");
+        throw WinbootError(WinbootErrorCode::UnsupportedImage, "MSDCM cannot be removed from this DOS version");
     }
 }
 
 
-void WinbootImage::compress() {
-    if(m_version == Version::DOS7) {
-        /*
-        * Get the DOS ('payload') portion.
-        */
-        auto dosSize = dosSizeBytes();
-        if(dosSize < MSLOADSize + 2) {
-            throw std::logic_error("DOS portion is too short (doesn't fit the MSLOAD)");
+size_t WinbootImage::compressiblePayload() {
+    /*
+     * Get the DOS ('payload') portion.
+     */
+    auto dosSize = dosSizeBytes();
+    if(dosSize < MSLOADSize + 2) {
+        throw WinbootError(WinbootErrorCode::InvalidImage, "DOS portion is too short (doesn't fit the MSLOAD)");
+    }
+
+    auto payloadSize = dosSize - MSLOADSize;
+
+    if(identifyPayloadCodec(m_data.data() + MSLOADSize, payloadSize)) {
+        throw WinbootError(WinbootErrorCode::AlreadyCompressed, "WINBOOT.SYS is already compressed");
+    }
+
+    return payloadSize;
+}
+
+std::vector<CompressionTrial> WinbootImage::searchCompression(const CompressionOptions &options) {
+    auto payloadSize = compressiblePayload();
+
+    if(options.codecSelection != CodecSelection::Fixed)
+        throw WinbootError(WinbootErrorCode::InvalidOptions, "searching needs a single codec");
+
+    auto codec = findPayloadCodec(options.codec);
+    if(!codec)
+        throw WinbootError(WinbootErrorCode::InvalidOptions, "unknown codec: " + options.codec);
+
+    return ::searchCompression(*codec, m_data.data() + MSLOADSize, payloadSize, options);
+}
+
+void WinbootImage::compress(const CompressionOptions &requestedOptions) {
+    auto payloadSize = compressiblePayload();
+    auto payload = m_data.data() + MSLOADSize;
+
+    /*
+     * Find where our unpacking extension goes into MSLOAD before compressing
+     * anything.
+     */
+    auto patchPoints = findMSLOADPatchPoints(detectVariant());
+
+    /*
+     * Let the policy pick the level and the block size.
+     */
+    auto options = requestedOptions;
+
+    if(options.policy != CompressionPolicy::Fixed) {
+        PhaseTimer timer(m_statistics, "search");
+
+        auto trials = searchCompression(options);
+        if(trials.empty()) {
+            throw WinbootError(WinbootErrorCode::DoesNotFit, "the payload doesn't compress with any level or block size");
         }
 
-        auto payload = m_data.data() + MSLOADSize;
-        auto payloadSize = dosSize - MSLOADSize;
+        const auto &chosen = chooseTrial(trials, options);
+
+        auto blocks = chosen.blockSize == 0 ? std::string("linked") : std::to_string(chosen.blockSize) + "-byte";
+        logMessage(LogLevel::Info, "Policy %s picked level %d and %s blocks", policyName(options.policy),
+                   chosen.level, blocks.c_str());
+
+        options.level = chosen.level;
+        options.blockSize = chosen.blockSize;
+        options.policy = CompressionPolicy::Fixed;
+    }
 
-        static constexpr uint16_t LZMagic = 0x5A4C; // 'LZ'
+    std::vector<const PayloadCodec *> candidates;
 
-        if(*reinterpret_cast<const uint16_t *>(payload) == LZMagic) {
-            throw std::logic_error("WINBOOT.SYS is already LZ-compressed");
+    if(options.codecSelection == CodecSelection::Fixed) {
+        auto codec = findPayloadCodec(options.codec);
+        if(!codec)
+            throw WinbootError(WinbootErrorCode::InvalidOptions, "unknown codec: " + options.codec);
+
+        if(options.inPlace && !codec->unpacksInPlace())
+            throw WinbootError(WinbootErrorCode::InvalidOptions, options.codec + " streams can't be unpacked in place");
+
+        candidates.push_back(codec);
+    } else {
+        for(auto codec: payloadCodecs()) {
+            if(!options.inPlace || codec->unpacksInPlace())
+                candidates.push_back(codec);
         }
+    }
 
-        /*
-        * Pack LZ4 into a compact framed format:
-        * 2 bytes: 0x5A4C ('LZ')
-        * 2 bytes: source size, paragraphs
-        * zero or more blocks:
-        *   2 bytes: compressed length, bytes
-        *   the specified number of bytes
-        * 2 bytes: zero
-        */
+    /*
+     * Encode with every candidate codec, and keep the smallest or the
+     * cheapest to decode.
+     */
+    EncodedPayload encoded;
+    const PayloadCodec *chosenCodec = nullptr;
+
+    {
+        PhaseTimer timer(m_statistics, "encode");
+
+        for(auto codec: candidates) {
+            auto candidate = codec->encode(payload, payloadSize, options);
+
+            for(const auto &block: candidate.blocks) {
+                if(block.onHelperThread)
+                    timer.addHelperCPUSeconds(block.timing.cpuSeconds);
+            }
+
+            if(candidates.size() > 1) {
+                logMessage(LogLevel::Info, "%s: %zu bytes, about %.1f million 8088 cycles to unpack",
+                           codec->name(), candidate.stream.size(), candidate.decodeCycles / 1e6);
+            }
+
+            bool better;
+            if(!chosenCodec) {
+                better = true;
+            } else if(options.codecSelection == CodecSelection::Cheapest) {
+                better = candidate.decodeCycles < encoded.decodeCycles;
+            } else {
+                better = candidate.stream.size() < encoded.stream.size();
+            }
+
+            if(better) {
+                encoded = std::move(candidate);
+                chosenCodec = codec;
+            }
+        }
+    }
 
-        //LZ4HC_CLEVEL_MAX;
+    if(candidates.size() > 1) {
+        logMessage(LogLevel::Info, "Using %s", chosenCodec->name());
+    }
 
-        CompressionStream outputStream;
+    if(m_statistics) {
+        m_statistics->codec = chosenCodec->name();
+        m_statistics->blocks = encoded.blocks;
+    }
 
-        /*
-        * Stream header
-        */
-        outputStream.reserveOutputBytes(4); // header
+    PhaseTimer timer(m_statistics, "patch");
 
-        unsigned char *headerData;
-        outputStream.getAvailableArea(headerData);
+    if(encoded.extensionSize > patchPoints.extensionSpace) {
+        throw WinbootError(WinbootErrorCode::DoesNotFit, "MSLOAD extension doesn't fit into MSLOAD");
+    }
 
-        reinterpret_cast<uint16_t *>(headerData)[0] = LZMagic;
-        reinterpret_cast<uint16_t *>(headerData)[1] = payloadSize / 16;
+    const auto &compressedPayload = encoded.stream;
+    if(compressedPayload.size() > payloadSize) {
+        throw WinbootError(WinbootErrorCode::DoesNotFit, "compressed payload length exceeds the uncompressed length");
+    }
 
-        outputStream.advanceOutputPointer(4);
+    /*
+     * Transplant the compressed payload back in.
+     */
 
-        static constexpr size_t blockSize = 63 * 1024;
-        for(size_t pos = 0; pos < payloadSize; pos += blockSize) {
-            auto chunk = std::min<size_t>(blockSize, payloadSize - pos);
+    memcpy(m_data.data() + MSLOADSize, compressedPayload.data(), compressedPayload.size());
 
-            outputStream.reserveOutputBytes(2 + LZ4_compressBound(chunk));
+    /*
+     * Update file sizes, relocate MSDCM (if present). On MS-DOS 8, this
+     * keeps the 32 paragraph bias in e_cparhdr, as it only subtracts.
+     */
+    cutDOSAt(MSLOADSize + compressedPayload.size());
 
-            unsigned char *blockData;
-            size_t blockDataLength = outputStream.getAvailableArea(blockData);
+    /*
+     * Now, insert our unpacking extension into MSLOAD.
+     */
+    memcpy(m_data.data() + patchPoints.extensionPos, encoded.extension, encoded.extensionSize);
 
-            auto result = LZ4_compress_HC(
-                reinterpret_cast<const char *>(payload + pos),
-                reinterpret_cast<char *>(blockData + 2),
-                chunk,
-                blockDataLength - 2,
-                LZ4HC_CLEVEL_MAX
-            );
-            if(result <= 0)
-                throw std::logic_error("LZ4_compress_HC failed");
+    /*
+     * And patch the final branches into the payload to pass control into our
+     * extension instead.
+     */
+    for(auto branchPos: patchPoints.finalBranches) {
+        unsigned char *finalBranch = &m_data[branchPos];
+        finalBranch[0] = 0xE9; // JMP NEAR
+        *reinterpret_cast<int16_t *>(&finalBranch[1]) = patchPoints.extensionPos - (branchPos + 3);
+    }
+}
 
-            if(result > blockSize)
-                throw std::logic_error("LZ4-compressed block length exceeds the limit");
+WinbootImage::MSLOADPatchPoints WinbootImage::findMSLOADPatchPoints(const WinbootVariant &variant) const {
+    MSLOADPatchPoints points;
 
-            *reinterpret_cast<uint16_t *>(blockData) = static_cast<uint16_t>(result);
+    points.finalBranches = variant.finalBranches;
+    points.extensionPos = variant.extensionPos;
 
-            outputStream.advanceOutputPointer(2 + result);
+    if(points.finalBranches.empty()) {
+        if(!variant.scanMSLOAD && !m_scanMSLOAD) {
+            throw WinbootError(WinbootErrorCode::UnsupportedImage, std::string("where to patch the MSLOAD of ") +
+                               variant.name + " is not known; it can be found by scanning MSLOAD");
         }
 
-        /*
-        * Stream terminator
-        */
-        unsigned char *terminatorData;
-        outputStream.getAvailableArea(terminatorData);
-
-        reinterpret_cast<uint16_t *>(terminatorData)[0] = 0;
-        outputStream.advanceOutputPointer(2);
+        points.finalBranches = scanFinalBranches(m_data.data(), MSLOADSize);
 
-        auto compressedPayload = outputStream.finish();
-        if(compressedPayload.size() > payloadSize) {
-            throw std::logic_error("compressed payload length exceeds the uncompressed length");
+        if(points.finalBranches.empty()) {
+            throw WinbootError(WinbootErrorCode::UnsupportedImage, "unable to find the final branch of MSLOAD");
         }
+    }
 
+    if(points.extensionPos == 0) {
         /*
-        * Transplant the compressed payload back in.
-        */
+         * Put the extension into the zero-filled slack at the end of MSLOAD,
+         * leaving a zero byte after the last of its code and data.
+         */
+        static constexpr size_t farJumpSize = 5;
+        static constexpr size_t msloadStart = 0x200;
 
-        memcpy(m_data.data() + MSLOADSize, compressedPayload.data(), compressedPayload.size());
+        size_t end = MSLOADSize;
+        while(end > msloadStart && m_data[end - 1] == 0)
+            end--;
 
-        /*
-        * Update file sizes, relocate MSDCM (if present).
-        */
-        cutDOSAt(MSLOADSize + compressedPayload.size());
+        points.extensionPos = std::max(end + 1, points.finalBranches.back() + farJumpSize);
+    }
 
-        /*
-        * Now, insert our unpacking extension into MSLOAD.
-        */
+    points.extensionSpace = MSLOADSize - std::min(points.extensionPos, MSLOADSize);
 
-        static constexpr size_t msloadFinalBranchPos = 0x4EB;
-        static constexpr size_t msloadExtensionPos   = 0x701;
+    return points;
+}
 
-        memcpy(m_data.data() + msloadExtensionPos, msload_extension, sizeof(msload_extension));
+const WinbootVariant &WinbootImage::detectVariant() {
+    auto variant = detectWinbootVariant(m_data.data(), dosSizeBytes(), m_version == Version::DOS7 ? 7 : 8, m_scanMSLOAD);
 
-        /*
-        * And patch the final branch into the payload to pass control into our
-        * extension instead.
-        */
-        unsigned char *finalBranch = &m_data[msloadFinalBranchPos];
-        finalBranch[0] = 0xE9; // JMP NEAR
-        *reinterpret_cast<int16_t *>(&finalBranch[1]) = msloadExtensionPos - (msloadFinalBranchPos + 3);
-    } else {
-        throw std::logic_error("compression is not yet supported for this DOS version");
+    if(!variant) {
+        throw WinbootError(WinbootErrorCode::UnsupportedImage, "unknown MSLOAD or IO.SYS variant");
     }
+
+    logMessage(LogLevel::Info, "MSLOAD and IO.SYS variant: %s", variant->name);
+
+    return *variant;
 }
 
 void WinbootImage::cutDOSAt(size_t newSize) {
@@ -384,7 +724,7 @@ void WinbootImage::cutDOSAt(size_t newSize) {
 
     size_t oldSize = dosSizeBytes();
 
-    printf("Shrinking the DOS portion: new size: %zu, old size: %zu\n", newSize, oldSize);
+    logMessage(LogLevel::Info, "Shrinking the DOS portion: new size: %zu, old size: %zu", newSize, oldSize);
 
     if(newSize > oldSize) {
         throw std::logic_error("WinbootImage::cutDOSAt: DOS size has grown");
@@ -396,59 +736,135 @@ void WinbootImage::cutDOSAt(size_t newSize) {
 
     auto moveup = oldSize - newSize;
 
-    header->e_cparhdr -= moveup / 16;
-
-    if(hasMSDCM) {
-        auto msdcmSize = m_data.size() - oldSize;
-
-        printf("MSDCM: relocating MSDCM body, %zu bytes, from %zu to %zu, moveup %zu bytes\n",
-               msdcmSize, oldSize, newSize, moveup);
+    if(moveup & 15)
+        throw std::logic_error("moveup is not paragraph-aligned");
 
-        memmove(m_data.data() + newSize,
-                m_data.data() + oldSize,
-                msdcmSize);
+    header->e_cparhdr -= moveup / 16;
 
-        auto newFullSize = newSize + msdcmSize;
+    /*
+     * Whatever follows the DOS portion isn't moved: it is simply gathered
+     * right after the shrunk one when saving.
+     */
+    m_layout.front().size = newSize;
 
-        if(moveup & 15)
-            throw std::logic_error("moveup is not paragraph-aligned");
+    if(hasMSDCM) {
+        auto newFullSize = imageSize();
 
+        logMessage(LogLevel::Info, "MSDCM: %zu bytes now follow the DOS portion, at %zu",
+                   newFullSize - newSize, newSize);
 
         header->e_cp = (newFullSize + 511) / 512;
         header->e_cblp = (newFullSize & 511);
         if(header->e_crlc != 0) {
-            throw std::logic_error("MSDCM contains relocations, which are not currently supported");
+            throw WinbootError(WinbootErrorCode::UnsupportedImage, "MSDCM contains relocations, which are not currently supported");
         }
-
-        m_data.resize(newFullSize);
     } else {
-        m_data.resize(newSize);
+        m_layout.resize(1);
+        m_mapping.reset();
     }
 }
 
 void WinbootImage::removeLogo() {
-    if(m_version == Version::DOS7) {
+    PhaseTimer timer(m_statistics, "logo-cut");
+
+    auto fullDosSize = dosSizeBytes(); // DOS size including the logo, if any
+
+    if(fullDosSize > MSLOADSize && identifyPayloadCodec(m_data.data() + MSLOADSize, fullDosSize - MSLOADSize)) {
+        throw WinbootError(WinbootErrorCode::AlreadyCompressed, "the logo can't be removed from a compressed WINBOOT.SYS");
+    }
+
+    const auto &variant = detectVariant();
+
+    size_t logoPos = 0;
+
+    if(variant.fixedPortionParagraphs != 0) {
         /*
-        * First,  we need to figure out where the logo starts.
+        * First,  we need to figure out where the logo starts. The layout is
+        * only known for the build the variant stands for, so don't take its
+        * word for it: unless there's the header of a bitmap where it has the
+        * logo start, look for the logo instead.
         */
-        static constexpr size_t dosFixedPortionInParagraphs = 0x12D5; // From the IO.SYS-proper portion of WINBOOT.SYS
-        static constexpr size_t dosDynamicPortionLengthOffset = 0x803;
+        size_t dosDynamicPortionInBytes = *reinterpret_cast<const uint16_t *>(&m_data[variant.dynamicPortionLengthOffset]);
+
+        size_t realDOSSize = variant.fixedPortionParagraphs * 16 + dosDynamicPortionInBytes + 0x800 - 0x700;
+        if(((realDOSSize + 15) & ~15) == fullDosSize) {
+            logMessage(LogLevel::Info, "No logo found, nothing to remove.");
+            return;
+        } else if(hasBitmapAt(realDOSSize)) {
+            logoPos = realDOSSize;
+        } else {
+            logMessage(LogLevel::Info, "No logo at %zu (0x%zX), where %s has IO.SYS end; looking for it",
+                       realDOSSize, realDOSSize, variant.name);
+        }
+    }
 
-        auto fullDosSize = dosSizeBytes(); // DOS size including the logo, if any
+    if(logoPos == 0) {
+        logoPos = findLogoBitmap();
 
-        if(fullDosSize < dosFixedPortionInParagraphs * 16) {
-            throw std::logic_error("WINBOOT.SYS is too short: doesn't fit IO.SYS");
+        if(logoPos == 0 && variant.fixedPortionParagraphs != 0) {
+            throw WinbootError(WinbootErrorCode::UnsupportedImage, std::string("IO.SYS doesn't end where ") +
+                               variant.name + " has it end, and no logo follows it");
+        } else if(logoPos == 0) {
+            logMessage(LogLevel::Info, "No logo found, nothing to remove.");
+            return;
         }
+    }
 
-        size_t dosDynamicPortionInBytes = *reinterpret_cast<const uint16_t *>(&m_data[dosDynamicPortionLengthOffset]);
+    logMessage(LogLevel::Info, "Found the logo at %zu (0x%zX), %zu bytes long", logoPos, logoPos,
+               static_cast<size_t>(*reinterpret_cast<const uint32_t *>(&m_data[logoPos + 2])));
 
-        size_t realDOSSize = dosFixedPortionInParagraphs * 16 + dosDynamicPortionInBytes + 0x800 - 0x700;
-        if(realDOSSize > fullDosSize) {
-            throw std::logic_error("WINBOOT.SYS is too short: doesn't fit IO.SYS+MSDOS.SYS");
-        } else if(realDOSSize < fullDosSize) {
-            cutDOSAt(realDOSSize);
-        }
-    } else {
-        throw std::logic_error("logo removal is not yet supported for this DOS version");
+    cutDOSAt(logoPos);
+}
+
+bool WinbootImage::hasBitmapAt(size_t position) {
+    return position >= MSLOADSize && position <= dosSizeBytes() && dosSizeBytes() - position >= BitmapHeadersSize &&
+           m_data[position] == 'B' && m_data[position + 1] == 'M' &&
+           *reinterpret_cast<const uint32_t *>(&m_data[position + 14]) == 40;
+}
+
+size_t WinbootImage::findLogoBitmap() {
+    /*
+    * The IO.SYS of MS-DOS 8, and of the builds we don't know the size of,
+    * is laid out differently, so rather than go by its size, find the logo
+    * itself: a bitmap file ending the (by now decompressed) DOS portion,
+    * followed by nothing but the zero padding to the paragraph the portion
+    * ends at. Its pixels have to follow its headers and palette right away,
+    * which data that just happens to start with 'BM' is unlikely to get
+    * right.
+    */
+    auto fullDosSize = dosSizeBytes();
+    const unsigned char *dosEnd = m_data.data() + fullDosSize;
+
+    for(size_t pos = fullDosSize - std::min(fullDosSize, BitmapHeadersSize); pos >= MSLOADSize; pos--) {
+        if(!hasBitmapAt(pos))
+            continue;
+
+        const unsigned char *bitmap = &m_data[pos];
+
+        size_t fileSize = *reinterpret_cast<const uint32_t *>(&bitmap[2]);
+        size_t bitsOffset = *reinterpret_cast<const uint32_t *>(&bitmap[10]);
+        uint16_t planes = *reinterpret_cast<const uint16_t *>(&bitmap[26]);
+        uint16_t bitCount = *reinterpret_cast<const uint16_t *>(&bitmap[28]);
+        size_t colorsUsed = *reinterpret_cast<const uint32_t *>(&bitmap[46]);
+
+        if(planes != 1 || (bitCount != 1 && bitCount != 4 && bitCount != 8 && bitCount != 24))
+            continue;
+
+        size_t paletteSize = 0;
+        if(bitCount <= 8)
+            paletteSize = 4 * (colorsUsed != 0 ? colorsUsed : 1U << bitCount);
+
+        if(bitsOffset != BitmapHeadersSize + paletteSize || bitsOffset > fileSize || fileSize > fullDosSize - pos)
+            continue;
+
+        if(fullDosSize - pos - fileSize >= 16)
+            continue;
+
+        if(std::any_of(bitmap + fileSize, dosEnd, [](unsigned char byte) { return byte != 0; }))
+            continue;
+
+        return pos;
     }
+
+    return 0;
 }
@@ -3,9 +3,18 @@
 
 #include <filesystem>
 #include <ios>
+#include <memory>
+#include <span>
 #include <vector>
 
+#include "CompressionOptions.h"
+#include "CMDecompressor.h"
+
+struct CompressionTrial;
 struct EXEHeader;
+struct ImageStatistics;
+struct WinbootVariant;
+class MappedFile;
 
 class WinbootImage {
 public:
@@ -15,23 +24,73 @@ public:
     WinbootImage(const WinbootImage &other) = delete;
     WinbootImage &operator =(const WinbootImage &other) = delete;
 
+    /*
+     * Controls how 'CM'-compressed MS-DOS 8 payloads are decompressed by the
+     * subsequent load() calls.
+     */
+    inline void setCMDecompressionOptions(const CMDecompressionOptions &options) {
+        m_cmOptions = options;
+    }
+
+    /*
+     * Lets compress() and removeLogo() handle the builds of MSLOAD and IO.SYS
+     * that aren't known by scanning MSLOAD for its jumps into the payload, and
+     * IO.SYS for its logo. Off by default, as the scans can't tell code from
+     * data that happens to look like it.
+     */
+    inline void setMSLOADScanning(bool scan) {
+        m_scanMSLOAD = scan;
+    }
+
+    /*
+     * Makes the subsequent calls record how long their phases take, and what
+     * the payload was compressed into, until reset to nullptr.
+     */
+    inline void setStatistics(ImageStatistics *statistics) {
+        m_statistics = statistics;
+    }
+
     void load(const std::filesystem::path &path);
     void load(std::istream &stream);
     void load(std::vector<unsigned char> &&data);
 
-    inline const std::vector<unsigned char> &data() const {
-        return m_data;
-    }
+    /*
+     * Maps the file instead of reading it. Only the DOS portion, which the
+     * transformations modify, is copied into memory; the MSDCM body stays a
+     * reference into the mapping and is copied into the output files by the
+     * kernel when saving to a path.
+     */
+    void loadMapped(const std::filesystem::path &path);
+
+    /*
+     * Returns the whole image, pulling in any part of it that is still only
+     * referenced in the mapped input file.
+     */
+    const std::vector<unsigned char> &data();
 
     void save(const std::filesystem::path &path);
     void save(std::ostream &stream);
+    void save(std::vector<unsigned char> &data);
+
+    /*
+     * Saves into a caller-provided buffer of exactly savedSize() bytes.
+     */
+    void save(std::span<unsigned char> data);
+    size_t savedSize();
 
     void extractMSDCM(const std::filesystem::path &path);
     void extractMSDCM(std::ostream &stream);
+    void extractMSDCM(std::vector<unsigned char> &data);
 
     void removeMSDCM();
 
-    void compress();
+    void compress(const CompressionOptions &options = CompressionOptions());
+
+    /*
+     * Compresses the payload with a grid of levels and block sizes, without
+     * changing the image, for CompressionOptions::policy to choose from.
+     */
+    std::vector<CompressionTrial> searchCompression(const CompressionOptions &options);
 
     void removeLogo();
 
@@ -44,17 +103,112 @@ private:
     EXEHeader *getEXEHeader(bool evenIfInvalid = false);
     size_t dosSizeParagraphs();
     size_t dosSizeBytes();
+    size_t trailingPaddingBytes();
+
+    /*
+     * Returns the length of the payload, past MSLOAD, after checking that
+     * there is one to compress.
+     */
+    size_t compressiblePayload();
+    std::vector<unsigned char> makeMSDCMHeader();
+    void parse();
+
+    /*
+     * The operations don't rearrange the image in memory. They edit the
+     * DOS portion in place, and otherwise only record where the parts of the
+     * image come from: the image is the concatenation of these extents. The
+     * first one is always the DOS portion, at the start of m_data; the others
+     * are the MSDCM body, which stays wherever it was loaded (in m_data past
+     * the original DOS portion, or in the mapped input file), however many
+     * times the DOS portion shrinks. Saving gathers them in a single pass.
+     */
+    struct Extent {
+        enum class Source {
+            Data,       // m_data
+            Mapping,    // The mapped input file
+            Zero        // Padding, only in the final layout
+        };
+
+        Source source;
+        size_t offset;
+        size_t size;
+    };
+
+    size_t imageSize() const;
+
+    /*
+     * The layout to save: the extents, followed by the trailing padding, if
+     * any.
+     */
+    std::vector<Extent> finalLayout();
+
+    const unsigned char *extentData(const Extent &extent) const;
+
+    /*
+     * Copies the extents, in order, into 'output'.
+     */
+    void gather(std::span<const Extent> extents, unsigned char *output) const;
+
+    /*
+     * Writes the extents, in order, into the file, letting the kernel copy
+     * the mapped ones.
+     */
+    void writeExtents(int fd, std::span<const Extent> extents) const;
 
     void cutDOSAt(size_t position);
 
+    /*
+     * Whether the DOS portion has the headers of a bitmap file at 'position',
+     * as the logo starts with.
+     */
+    bool hasBitmapAt(size_t position);
+
+    /*
+     * Returns where the logo starts, found by its bitmap header, or 0 if the
+     * DOS portion doesn't end with one.
+     */
+    size_t findLogoBitmap();
+
+    /*
+     * Where compress() puts the unpacking extension into MSLOAD, and the far
+     * jumps into the payload it redirects to it.
+     */
+    struct MSLOADPatchPoints {
+        std::vector<size_t> finalBranches;
+        size_t extensionPos;
+        size_t extensionSpace;
+    };
+
+    MSLOADPatchPoints findMSLOADPatchPoints(const WinbootVariant &variant) const;
+
+    /*
+     * Returns the build of MSLOAD and IO.SYS the image is, refusing the
+     * unknown ones, unless scanning, rather than patching them at the wrong
+     * places.
+     */
+    const WinbootVariant &detectVariant();
+
     /*
      * This includes both the MZ header sector (the first one) and the three
      * sectors of MSLOAD itself.
      */
     static constexpr size_t MSLOADSize = 0x800;
 
+    static constexpr size_t BitmapHeadersSize = 14 + 40; // BITMAPFILEHEADER, BITMAPINFOHEADER
+
     std::vector<unsigned char> m_data;
+    std::vector<Extent> m_layout;
+
+    /*
+     * In mapped mode, only the DOS portion is copied into m_data, and the
+     * MSDCM body is an extent of the mapped input file.
+     */
+    std::unique_ptr<MappedFile> m_mapping;
+
     Version m_version;
+    CMDecompressionOptions m_cmOptions;
+    bool m_scanMSLOAD = false;
+    ImageStatistics *m_statistics = nullptr;
 };
 
 #endif
@@ -0,0 +1,140 @@
+#include "WinbootVariant.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+    /*
+     * MSLOAD follows the MZ header sector, and ends where the payload starts.
+     */
+    constexpr size_t MSLOADStart = 0x200;
+    constexpr size_t MSLOADEnd = 0x800;
+
+    const std::vector<unsigned char> farJumpToPayload = { 0xEA, 0x00, 0x00, 0x70, 0x00 }; // JMP 0070:0000
+
+    /*
+     * The boot sector refuses to start an IO.SYS without the 'BJ' signature
+     * at the start of MSLOAD, which every build has.
+     */
+    const WinbootSignature msloadSignature = { MSLOADStart, { 'B', 'J' } };
+
+    /*
+     * IO.SYS is entered at its start, through a short jump over the header
+     * (JMP SHORT, NOP), followed by the length of its dynamic portion on
+     * MS-DOS 7.
+     */
+    const WinbootSignature ioSysJump = { MSLOADEnd, { 0xEB } };
+    const WinbootSignature ioSysJumpPadding = { MSLOADEnd + 2, { 0x90 } };
+
+    /*
+     * Only the builds whose layout has been checked against an image of
+     * theirs have a row, and the row claims no more than what was checked;
+     * the others are what the scanned variants are for.
+     */
+    const WinbootVariant variants[] = {
+        {
+            /*
+             * The build whose IO.SYS is 0x12D5 paragraphs long, plus its
+             * dynamic portion, with the logo right after it.
+             */
+            "MS-DOS 7",
+            7,
+            {
+                msloadSignature,
+                { 0x4EB, farJumpToPayload },
+                ioSysJump,
+                ioSysJumpPadding
+            },
+            { 0x4EB },
+            false,
+            0x701,
+            0x12D5,
+            0x803
+        },
+        {
+            /*
+             * Its MSLOAD is laid out differently, and where it jumps into the
+             * payload is only known by scanning it. It only shipped with
+             * Windows Me, so the scan is what compress() has always done
+             * with it.
+             */
+            "MS-DOS 8",
+            8,
+            {
+                msloadSignature,
+                ioSysJump,
+                ioSysJumpPadding
+            },
+            {},
+            true,
+            0,
+            0,
+            0
+        }
+    };
+
+    const WinbootVariant scannedVariants[] = {
+        { "MS-DOS 7, unknown build", 7, {}, {}, false, 0, 0, 0 },
+        { "MS-DOS 8, unknown build", 8, {}, {}, false, 0, 0, 0 }
+    };
+
+    bool hasBytes(const unsigned char *dos, size_t size, size_t offset, const std::vector<unsigned char> &bytes) {
+        return offset <= size && bytes.size() <= size - offset && memcmp(dos + offset, bytes.data(), bytes.size()) == 0;
+    }
+
+    bool matches(const WinbootVariant &variant, const unsigned char *dos, size_t size) {
+        for(const auto &signature: variant.signatures) {
+            if(!hasBytes(dos, size, signature.offset, signature.bytes))
+                return false;
+        }
+
+        for(auto branch: variant.finalBranches) {
+            if(!hasBytes(dos, MSLOADEnd, branch, farJumpToPayload))
+                return false;
+        }
+
+        if(variant.extensionPos != 0) {
+            if(variant.extensionPos <= MSLOADStart || variant.extensionPos > MSLOADEnd)
+                return false;
+
+            if(std::any_of(dos + variant.extensionPos - 1, dos + MSLOADEnd, [](unsigned char byte) { return byte != 0; }))
+                return false;
+        }
+
+        if(variant.fixedPortionParagraphs != 0 && variant.dynamicPortionLengthOffset + 2 > size)
+            return false;
+
+        return true;
+    }
+}
+
+const WinbootVariant *detectWinbootVariant(const unsigned char *dos, size_t size, unsigned int dosVersion, bool scan) {
+    if(size < MSLOADEnd)
+        return nullptr;
+
+    for(const auto &variant: variants) {
+        if(variant.dosVersion == dosVersion && matches(variant, dos, size))
+            return &variant;
+    }
+
+    if(!scan || scanFinalBranches(dos, MSLOADEnd).empty())
+        return nullptr;
+
+    for(const auto &variant: scannedVariants) {
+        if(variant.dosVersion == dosVersion)
+            return &variant;
+    }
+
+    return nullptr;
+}
+
+std::vector<size_t> scanFinalBranches(const unsigned char *msload, size_t size) {
+    std::vector<size_t> branches;
+
+    for(size_t pos = MSLOADStart; pos + farJumpToPayload.size() <= size; pos++) {
+        if(memcmp(msload + pos, farJumpToPayload.data(), farJumpToPayload.size()) == 0)
+            branches.push_back(pos);
+    }
+
+    return branches;
+}
@@ -0,0 +1,69 @@
+#ifndef WINBOOT_VARIANT_H
+#define WINBOOT_VARIANT_H
+
+#include <cstddef>
+#include <vector>
+
+/*
+ * Bytes an image of the variant has at a given offset.
+ */
+struct WinbootSignature {
+    size_t offset;
+    std::vector<unsigned char> bytes;
+};
+
+/*
+ * A build of MSLOAD and IO.SYS, as far as the transformations are concerned:
+ * where compress() patches MSLOAD, and where removeLogo() cuts IO.SYS. The
+ * builds differ between the releases, the localized versions, and the OEMs.
+ */
+struct WinbootVariant {
+    const char *name;
+    unsigned int dosVersion;    // 7 or 8
+
+    /*
+     * What identifies the variant, in MSLOAD and the IO.SYS header.
+     */
+    std::vector<WinbootSignature> signatures;
+
+    /*
+     * The far jumps into the payload (JMP 0070:0000) that compress() redirects
+     * to its extension, and where the extension goes: MSLOAD has to be
+     * zero-filled from the byte before it to its end. If no far jumps are
+     * listed, the patch points are only known by scanning MSLOAD, which has
+     * to be asked for, unless the variant is known to be patched right by
+     * the scan.
+     */
+    std::vector<size_t> finalBranches;
+    bool scanMSLOAD;
+    size_t extensionPos;
+
+    /*
+     * IO.SYS proper, which the logo follows, is this many paragraphs long,
+     * plus the length of its dynamic portion, recorded in a word at the given
+     * offset, both counting from the 0x700 MSLOAD loads the payload at. The
+     * bitmap header of the logo has to be there, or else the logo is looked
+     * for the way it is when these are zero: by its bitmap header.
+     */
+    size_t fixedPortionParagraphs;
+    size_t dynamicPortionLengthOffset;
+};
+
+/*
+ * Returns the first of the known variants of the given DOS version that the
+ * DOS portion of an image matches. If none does, and 'scan' is set, returns
+ * the variant standing for all the other builds of the version, which are
+ * patched by scanning MSLOAD and lose their logo by its bitmap header, as
+ * long as their MSLOAD jumps into the payload at all. Otherwise, returns
+ * nullptr.
+ */
+const WinbootVariant *detectWinbootVariant(const unsigned char *dos, size_t size, unsigned int dosVersion, bool scan);
+
+/*
+ * Finds the far jumps into the payload in MSLOAD, which ends at 'size'. This
+ * can't tell them from data that happens to look the same, hence only the
+ * variants that don't list theirs rely on it, when asked to.
+ */
+std::vector<size_t> scanFinalBranches(const unsigned char *msload, size_t size);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef WORK_QUEUE_H
+#define WORK_QUEUE_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+
+/*
+ * A bounded blocking queue connecting two pipeline stages. The producer
+ * blocks while the queue is full, so a fast stage can only run a limited
+ * distance ahead of a slow one. Once the queue is closed, consumers drain
+ * the remaining items and then receive an empty optional.
+ */
+template<typename T>
+class WorkQueue {
+public:
+    explicit WorkQueue(size_t capacity) : m_capacity(capacity), m_closed(false) {
+
+    }
+
+    ~WorkQueue() = default;
+
+    WorkQueue(const WorkQueue &other) = delete;
+    WorkQueue &operator =(const WorkQueue &other) = delete;
+
+    void push(T &&item) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        m_notFull.wait(lock, [this]() { return m_items.size() < m_capacity; });
+
+        m_items.emplace_back(std::move(item));
+
+        m_notEmpty.notify_one();
+    }
+
+    std::optional<T> pop() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        m_notEmpty.wait(lock, [this]() { return !m_items.empty() || m_closed; });
+
+        if(m_items.empty())
+            return std::nullopt;
+
+        std::optional<T> item(std::move(m_items.front()));
+        m_items.pop_front();
+
+        m_notFull.notify_one();
+
+        return item;
+    }
+
+    void close() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        m_closed = true;
+
+        m_notEmpty.notify_all();
+    }
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_notEmpty;
+    std::condition_variable m_notFull;
+    std::deque<T> m_items;
+    size_t m_capacity;
+    bool m_closed;
+};
+
+#endif
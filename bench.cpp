@@ -0,0 +1,58 @@
+#include <stdio.h>
+
+#include <stdexcept>
+
+#include "StubBenchmark.h"
+#include "FileIO.h"
+
+int main(int argc, char **argv) {
+    if(argc < 2) {
+        fprintf(stderr,
+                "Usage: %s <IMAGE>...\n"
+                "\n"
+                "Boots the MSLOAD extension of every compressed WINBOOT.SYS image under\n"
+                "emulation, checks the unpacked payload, and reports the cost of unpacking it.\n",
+                argv[0]);
+        return 1;
+    }
+
+    /*
+     * Clock rates of the IBM PC/XT and of a typical AT, to put the cycle
+     * estimates in perspective.
+     */
+    static constexpr double clock8088 = 4.77e6;
+    static constexpr double clock286 = 8e6;
+
+    int status = 0;
+
+    for(int arg = 1; arg < argc; arg++) {
+        auto filename = argv[arg];
+
+        try {
+            auto result = benchmarkStub(readFile(filename));
+
+            printf("%s:\n", filename);
+            printf("  payload:             %zu bytes, compressed into %zu bytes (%.1f%%)\n",
+                   result.payloadSize, result.compressedSize,
+                   100.0 * result.compressedSize / result.payloadSize);
+            printf("  instructions:        %llu\n", static_cast<unsigned long long>(result.instructions));
+            printf("  8088 cycles (est.):  %llu (%.3f s at 4.77 MHz)\n",
+                   static_cast<unsigned long long>(result.cycles8088), result.cycles8088 / clock8088);
+            printf("  286 cycles (est.):   %llu (%.3f s at 8 MHz)\n",
+                   static_cast<unsigned long long>(result.cycles286), result.cycles286 / clock286);
+            printf("  relocated:           %llu bytes\n", static_cast<unsigned long long>(result.relocatedBytes));
+            printf("  literals copied:     %llu bytes\n", static_cast<unsigned long long>(result.literalBytes));
+            printf("  matches copied:      %llu bytes\n", static_cast<unsigned long long>(result.matchBytes));
+
+            if(result.post8086Instructions != 0) {
+                printf("  warning:             %llu instructions executed that the 8086/8088 doesn't have\n",
+                       static_cast<unsigned long long>(result.post8086Instructions));
+            }
+        } catch(const std::exception &e) {
+            fprintf(stderr, "%s: failed: %s\n", filename, e.what());
+            status = 2;
+        }
+    }
+
+    return status;
+}
@@ -0,0 +1,146 @@
+bits 16
+org 0
+; A 'DS' block decompressor for the self-tests, with the calling convention of
+; the one MS-DOS 8 embeds after its 'CM' stream, so that the streams cmCompress()
+; makes can be decoded by the emulated engine, too. It follows the stream, with
+; the header the real one has: the 'CM' signature, the entry point and the
+; length in paragraphs.
+;
+; At entry, DS:SI points to the bitstream of the block, past its 'DS' header,
+; ES:DI to the output, and CX holds the number of sectors to decode. It returns
+; far, with the carry clear, SI past the input and DI past the output.
+;
+; The only thing that tells it where a block ends is the marker that ends every
+; sector, so it can't decode a block that ends with a partial sector. Unlike the
+; real one, it doesn't check the stream either.
+
+    db      'CM'
+    dw      decompress
+    dw      (decompressor_end - $$) / 16
+
+decompress:
+    cld
+    mov     bp, cx                  ; sectors left
+    xor     bh, bh                  ; no bits buffered
+
+.next_token:
+    mov     cl, 2
+    call    get_bits
+    cmp     dl, 1
+    jb      .near_match             ; 00
+    je      .literal                ; 01
+    cmp     dl, 2
+    je      .literal                ; 10
+
+    call    get_bit                 ; 11
+    jc      .far_match
+
+    mov     cl, 8
+    call    get_bits
+    add     dx, 64
+    jmp     .match_length
+
+.far_match:
+    mov     cl, 12
+    call    get_bits
+    add     dx, 320
+    cmp     dx, 0xFFF + 320
+    jne     .match_length
+
+    ; The end of a sector.
+    dec     bp
+    jnz     .next_token
+
+    clc
+    retf
+
+.literal:
+    mov     ch, dl
+    mov     cl, 7
+    call    get_bits
+    mov     al, dl
+    cmp     ch, 2
+    jne     .store_literal
+    or      al, 0x80
+
+.store_literal:
+    stosb
+    jmp     .next_token
+
+.near_match:
+    mov     cl, 6
+    call    get_bits
+
+.match_length:
+    ; The length is 2^N + 1 + an N-bit value, with N given by the number of
+    ; zero bits before a one bit.
+    push    dx
+    xor     cl, cl
+
+.count_length_bits:
+    call    get_bit
+    jc      .length_bits_counted
+    inc     cl
+    jmp     .count_length_bits
+
+.length_bits_counted:
+    mov     ax, 1
+    shl     ax, cl
+    inc     ax
+    push    ax
+
+    xor     dx, dx
+    or      cl, cl
+    jz      .copy_match
+    call    get_bits
+
+.copy_match:
+    pop     cx
+    add     cx, dx
+    pop     ax
+
+    ; Matches may overlap their own output, which copying forwards byte by
+    ; byte takes care of.
+    push    si
+    push    ds
+    mov     si, di
+    sub     si, ax
+    push    es
+    pop     ds
+    rep     movsb
+    pop     ds
+    pop     si
+    jmp     .next_token
+
+; Reads the next bit of the bitstream, least significant first, into CF.
+; BL holds the bits of the current byte that are left, and BH their number.
+get_bit:
+    dec     bh
+    jns     .buffered
+    mov     bl, [si]
+    inc     si
+    mov     bh, 7
+
+.buffered:
+    shr     bl, 1
+    ret
+
+; Reads CL (1 - 16) bits of the bitstream, the first one least significant,
+; into DX. Trashes AX and CL.
+get_bits:
+    xor     dx, dx
+    mov     ax, 1
+
+.next_bit:
+    call    get_bit
+    jnc     .zero
+    or      dx, ax
+
+.zero:
+    shl     ax, 1
+    dec     cl
+    jnz     .next_bit
+    ret
+
+    align   16, db 0
+decompressor_end:
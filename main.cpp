@@ -1,10 +1,24 @@
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <getopt.h>
+#include <string.h>
 
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
 #include <stdexcept>
 
-#include "WinbootImage.h"
+#include "ImageProcessor.h"
+#include "BatchProcessor.h"
+#include "CMProfile.h"
+#include "Log.h"
+#include "ParallelFor.h"
+#include "PayloadCodec.h"
+#include "Statistics.h"
 
 static const struct option options[] {
     { "help",          no_argument,       nullptr, 0 },
@@ -12,14 +26,59 @@ static const struct option options[] {
     { "remove-msdcm",  no_argument,       nullptr, 0 },
     { "compress",      no_argument,       nullptr, 0 },
     { "remove-logo",   no_argument,       nullptr, 0 },
+    { "jobs",          required_argument, nullptr, 0 },
+    { "manifest",      required_argument, nullptr, 0 },
+    { "threads",       required_argument, nullptr, 0 },
+    { "cm-engine",     required_argument, nullptr, 0 },
+    { "cache-dir",     required_argument, nullptr, 0 },
+    { "io",            required_argument, nullptr, 0 },
+    { "linked-blocks", no_argument,       nullptr, 0 },
+    { "decoder",       required_argument, nullptr, 0 },
+    { "codec",         required_argument, nullptr, 0 },
+    { "in-place",      no_argument,       nullptr, 0 },
+    { "stats",         required_argument, nullptr, 0 },
+    { "stats-output",  required_argument, nullptr, 0 },
+    { "disk-image",    no_argument,       nullptr, 0 },
+    { "profile-cm",    required_argument, nullptr, 0 },
+    { "cm-budget",     required_argument, nullptr, 0 },
+    { "parser",        required_argument, nullptr, 0 },
+    { "byte-cost",     required_argument, nullptr, 0 },
+    { "search",        no_argument,       nullptr, 0 },
+    { "level",         required_argument, nullptr, 0 },
+    { "block-size",    required_argument, nullptr, 0 },
+    { "policy",        required_argument, nullptr, 0 },
+    { "scan-msload",   no_argument,       nullptr, 0 },
     { nullptr,         0,                 nullptr, 0 }
 };
 
+/*
+ * Parses a positive decimal count, rejecting anything that strtoul() would
+ * wrap around or only partially consume.
+ */
+static bool parsePositive(const char *text, unsigned int &value) {
+    if(!isdigit(static_cast<unsigned char>(text[0])))
+        return false;
+
+    char *end;
+    errno = 0;
+    auto parsed = strtoul(text, &end, 10);
+
+    if(errno != 0 || *end != 0 || parsed == 0 || parsed > UINT_MAX)
+        return false;
+
+    value = parsed;
+    return true;
+}
+
 static void usage(const char *appname) {
     printf(
            "MS-DOS 7 WINBOOT.SYS size reduction tool.\n"
            "\n"
            "Usage: %s [OPTIONS] <INPUT FILE> <OUTPUT FILE>\n"
+           "       %s [OPTIONS] <INPUT DIRECTORY> <OUTPUT DIRECTORY>\n"
+           "       %s [OPTIONS] --manifest=<FILENAME>\n"
+           "       %s [OPTIONS] --disk-image <DISK IMAGE>...\n"
+           "       %s [OPTIONS] --search <INPUT FILE>\n"
            "Options:\n"
            "  --help                      Print this message\n"
            "  --extract-msdcm=<FILENAME>  Extract the MSDCM portion of WINBOOT.SYS into a separate file.\n"
@@ -29,18 +88,144 @@ static void usage(const char *appname) {
            "                              Windows boot potentially problematic unless MSDCM is saved\n"
            "                              as JO.SYS beforehand.\n"
            "\n"
-           "  --compress                  Compress WINBOOT.SYS with LZ4 compression algorithm.\n"
-           "  --remove-logo               Remove the built-in logo without impairing functionality.\n",
-           appname);
+           "  --compress                  Compress WINBOOT.SYS.\n"
+           "  --codec=<CODEC>             With --compress, how to compress the payload:\n"
+           "                                lz4      - LZ4, fast to unpack (default)\n"
+           "                                lze      - LZ with Elias gamma codes, denser but\n"
+           "                                           slower to unpack\n"
+           "                                smallest - whichever produces the smallest image\n"
+           "                                cheapest - whichever is estimated to unpack the fastest\n"
+           "  --linked-blocks             With --compress, let the compressed blocks refer back into\n"
+           "                              the preceding ones, for a better compression ratio.\n"
+           "  --decoder=<DECODER>         With --compress, the LZ4 decoder to embed into MSLOAD:\n"
+           "                                small - size-optimized, prints a banner (default)\n"
+           "                                fast  - speed-optimized, for a faster boot\n"
+           "  --parser=<PARSER>           With --compress, how LZ4 breaks the payload down:\n"
+           "                                hc          - LZ4HC, for the smallest stream (default)\n"
+           "                                decode-cost - minimize the cycles the decoder takes,\n"
+           "                                              plus --byte-cost per byte of the stream\n"
+           "  --byte-cost=<CYCLES>        With --parser=decode-cost, how many 8088 cycles of\n"
+           "                              unpacking a byte of the stream is worth. Higher values\n"
+           "                              favour size, lower ones unpacking speed. Defaults to %u.\n"
+           "  --level=<N>                 With --compress, the LZ4HC level, from 1 to 12 (default).\n"
+           "  --block-size=<BYTES>        With --compress, the length of the independent blocks: a\n"
+           "                              multiple of 16 from 1024 to 64512 (default).\n"
+           "  --policy=<POLICY>           With --compress, try a grid of levels and block sizes on\n"
+           "                              every image first (see --search), and use the one the\n"
+           "                              policy picks:\n"
+           "                                smallest - the smallest stream\n"
+           "                                boot     - the fewest cycles to unpack, plus --byte-cost\n"
+           "                                           per byte of the stream\n"
+           "                                fastest  - the least time to compress\n"
+           "                                balanced - the best compromise between the three\n"
+           "                              fastest and balanced depend on timing, so the output may\n"
+           "                              vary from run to run.\n"
+           "  --in-place                  With --compress, lay the stream out to be unpacked where\n"
+           "                              MSLOAD loads it, instead of moving it out of the way first.\n"
+           "                              LZ4 only; not with --linked-blocks or --decoder=fast.\n"
+           "  --remove-logo               Remove the built-in logo without impairing functionality.\n"
+           "  --scan-msload               Also process the builds of MSLOAD and IO.SYS that aren't\n"
+           "                              known, by scanning MSLOAD for its jumps into IO.SYS, and\n"
+           "                              IO.SYS for its logo. The scans can mistake data for what\n"
+           "                              they look for, so check that the output boots.\n"
+           "  --threads=<N>               Number of threads to use for processing a single image.\n"
+           "                              Defaults to the number of CPUs, or to 1 in batch mode.\n"
+           "  --cm-engine=<ENGINE>        How to decompress 'CM'-compressed MS-DOS 8 payloads:\n"
+           "                                native   - built-in decoder, falling back to the\n"
+           "                                           emulator if it fails\n"
+           "                                emulated - run the decompressor embedded in the image\n"
+           "                                           (default)\n"
+           "                                verify   - run both, and fail unless they agree\n"
+           "  --cm-budget=<N>             Instructions the emulated 'CM' decompressor may execute on\n"
+           "                              a block before it's considered stuck. Defaults to %llu;\n"
+           "                              0 for no limit.\n"
+           "  --profile-cm=<FILENAME>     Profile the emulated 'CM' decompressor, and write the\n"
+           "                              instructions per block, and the hottest loops and\n"
+           "                              instructions, into the file. Implies --cm-engine=emulated,\n"
+           "                              unless verify is chosen.\n"
+           "  --cache-dir=<DIRECTORY>     Look up finished images in, and store them into, a\n"
+           "                              result cache keyed by the input and the options.\n"
+           "                              The cache can be shared by concurrent runs.\n"
+           "  --io=<MODE>                 How to read and write the images:\n"
+           "                                stream - read and write whole files (default)\n"
+           "                                mmap   - map the inputs, and copy the unmodified\n"
+           "                                         parts into the outputs in the kernel.\n"
+           "                                         In batch mode, every job then reads,\n"
+           "                                         transforms and writes its image by itself,\n"
+           "                                         rather than in a pipeline.\n"
+           "  --stats=json                Report the time taken by every phase, the sizes, the\n"
+           "                              compressed blocks and the peak RSS, per image and for\n"
+           "                              the whole run, as JSON.\n"
+           "  --stats-output=<FILENAME>   Write the --stats report into the file rather than to the\n"
+           "                              standard output, after the rest of the output.\n"
+           "\n"
+           "Batch processing:\n"
+           "  --manifest=<FILENAME>       Process every image listed in the manifest. Each line is\n"
+           "                              <INPUT>, <OUTPUT> and optionally <MSDCM OUTPUT>, separated\n"
+           "                              by tabs. Lines starting with '#' are ignored.\n"
+           "  --jobs=<N>                  Number of images to process concurrently in batch mode.\n"
+           "                              Defaults to the number of CPUs.\n"
+           "\n"
+           "If the input is a directory, every file in it is processed into the same relative\n"
+           "path in the output directory, and --extract-msdcm names a directory as well.\n"
+           "\n"
+           "Disk images:\n"
+           "  --disk-image                The arguments are raw FAT12, FAT16 or FAT32 disk images,\n"
+           "                              either unpartitioned or MBR-partitioned. WINBOOT.SYS (or\n"
+           "                              IO.SYS) in the root directory is processed in place, and\n"
+           "                              the clusters it no longer needs are freed. The file can't\n"
+           "                              grow. --extract-msdcm needs a single disk image.\n"
+           "\n"
+           "Searching:\n"
+           "  --search                    Apply the other transformations to <INPUT FILE>, then\n"
+           "                              compress its payload with a grid of levels and block\n"
+           "                              sizes, and report the size, the time to compress and\n"
+           "                              the estimated cycles to unpack of each, marking the\n"
+           "                              Pareto front, and what --policy would pick. Nothing is\n"
+           "                              written; apply the choice with --level and --block-size.\n",
+           appname, appname, appname, appname, appname, CompressionOptions::DefaultByteCost,
+           static_cast<unsigned long long>(DefaultCMInstructionBudget));
+}
+
+static int writeStatistics(const char *path, const std::vector<ImageStatistics> &images, const Stopwatch &run) {
+    auto timing = run.elapsed();
+
+    if(!path) {
+        fflush(stdout);
+        writeStatisticsJSON(std::cout, images, timing);
+        std::cout.flush();
+        return 0;
+    }
+
+    std::ofstream stream(path, std::ios::out | std::ios::trunc);
+    if(stream) {
+        writeStatisticsJSON(stream, images, timing);
+        stream.close();
+    }
+
+    if(!stream) {
+        fprintf(stderr, "Unable to write the statistics into %s\n", path);
+        return 1;
+    }
+
+    return 0;
 }
 
 int main(int argc, char **argv) {
+    Stopwatch run(CPUClock::Process);
+
     int optindex;
     int result;
     const char *extractMSDCMTo = nullptr;
-    bool removeMSDCM = false;
-    bool compress = false;
-    bool removeLogo = false;
+    const char *manifest = nullptr;
+    const char *statisticsOutput = nullptr;
+    bool statistics = false;
+    bool diskImages = false;
+    bool search = false;
+    const char *profileCMTo = nullptr;
+    unsigned int jobs = 0;
+    bool threadsSet = false;
+    ProcessingOptions processing;
 
     while((result = getopt_long(argc, argv, "", options, &optindex)) != -1) {
         switch(result) {
@@ -60,15 +245,178 @@ int main(int argc, char **argv) {
                         break;
 
                     case 2: // --remove-msdcm
-                        removeMSDCM = true;
+                        processing.removeMSDCM = true;
                         break;
 
                     case 3: // --compress
-                        compress = true;
+                        processing.compress = true;
                         break;
 
                     case 4: // --remove-logo
-                        removeLogo = true;
+                        processing.removeLogo = true;
+                        break;
+
+                    case 5: // --jobs
+                        if(!parsePositive(optarg, jobs)) {
+                            fprintf(stderr, "--jobs expects a positive number.\n");
+                            return 1;
+                        }
+                        break;
+
+                    case 6: // --manifest
+                        manifest = optarg;
+                        break;
+
+                    case 7: // --threads
+                        if(!parsePositive(optarg, processing.compression.threads)) {
+                            fprintf(stderr, "--threads expects a positive number.\n");
+                            return 1;
+                        }
+                        processing.cm.threads = processing.compression.threads;
+                        threadsSet = true;
+                        break;
+
+                    case 8: // --cm-engine
+                        if(strcmp(optarg, "native") == 0) {
+                            processing.cm.engine = CMEngine::Native;
+                        } else if(strcmp(optarg, "emulated") == 0) {
+                            processing.cm.engine = CMEngine::Emulated;
+                        } else if(strcmp(optarg, "verify") == 0) {
+                            processing.cm.engine = CMEngine::Verify;
+                        } else {
+                            fprintf(stderr, "Unknown CM engine: %s\n", optarg);
+                            return 1;
+                        }
+                        break;
+
+                    case 9: // --cache-dir
+                        processing.cacheDirectory = optarg;
+                        break;
+
+                    case 10: // --io
+                        if(strcmp(optarg, "stream") == 0) {
+                            processing.mappedIO = false;
+                        } else if(strcmp(optarg, "mmap") == 0) {
+                            processing.mappedIO = true;
+                        } else {
+                            fprintf(stderr, "Unknown I/O mode: %s\n", optarg);
+                            return 1;
+                        }
+                        break;
+
+                    case 11: // --linked-blocks
+                        processing.compression.linkedBlocks = true;
+                        break;
+
+                    case 12: // --decoder
+                        if(strcmp(optarg, "small") == 0) {
+                            processing.compression.decoder = LZ4Decoder::Small;
+                        } else if(strcmp(optarg, "fast") == 0) {
+                            processing.compression.decoder = LZ4Decoder::Fast;
+                        } else {
+                            fprintf(stderr, "Unknown decoder: %s\n", optarg);
+                            return 1;
+                        }
+                        break;
+
+                    case 13: // --codec
+                        if(strcmp(optarg, "smallest") == 0) {
+                            processing.compression.codecSelection = CodecSelection::Smallest;
+                        } else if(strcmp(optarg, "cheapest") == 0) {
+                            processing.compression.codecSelection = CodecSelection::Cheapest;
+                        } else if(findPayloadCodec(optarg)) {
+                            processing.compression.codecSelection = CodecSelection::Fixed;
+                            processing.compression.codec = optarg;
+                        } else {
+                            fprintf(stderr, "Unknown codec: %s\n", optarg);
+                            return 1;
+                        }
+                        break;
+
+                    case 14: // --in-place
+                        processing.compression.inPlace = true;
+                        break;
+
+                    case 15: // --stats
+                        if(strcmp(optarg, "json") == 0) {
+                            statistics = true;
+                        } else {
+                            fprintf(stderr, "Unknown statistics format: %s\n", optarg);
+                            return 1;
+                        }
+                        break;
+
+                    case 16: // --stats-output
+                        statisticsOutput = optarg;
+                        break;
+
+                    case 17: // --disk-image
+                        diskImages = true;
+                        break;
+
+                    case 18: // --profile-cm
+                        profileCMTo = optarg;
+                        break;
+
+                    case 19: // --cm-budget
+                        processing.cm.instructionBudget = strtoull(optarg, nullptr, 10);
+                        break;
+
+                    case 20: // --parser
+                        if(strcmp(optarg, "hc") == 0) {
+                            processing.compression.parser = LZ4Parser::HC;
+                        } else if(strcmp(optarg, "decode-cost") == 0) {
+                            processing.compression.parser = LZ4Parser::DecodeCost;
+                        } else {
+                            fprintf(stderr, "Unknown parser: %s\n", optarg);
+                            return 1;
+                        }
+                        break;
+
+                    case 21: // --byte-cost
+                        processing.compression.byteCost = strtoul(optarg, nullptr, 10);
+                        break;
+
+                    case 22: // --search
+                        search = true;
+                        break;
+
+                    case 23: // --level
+                        processing.compression.level = strtol(optarg, nullptr, 10);
+                        if(processing.compression.level < CompressionOptions::MinLevel ||
+                           processing.compression.level > CompressionOptions::MaxLevel) {
+                            fprintf(stderr, "--level expects a number from 1 to 12.\n");
+                            return 1;
+                        }
+                        break;
+
+                    case 24: // --block-size
+                        processing.compression.blockSize = strtoul(optarg, nullptr, 0);
+                        if(processing.compression.blockSize < PayloadCodec::MinBlockSize ||
+                           processing.compression.blockSize > PayloadCodec::MaxBlockSize ||
+                           processing.compression.blockSize % 16 != 0) {
+                            fprintf(stderr, "--block-size expects a multiple of 16 from 1024 to 64512.\n");
+                            return 1;
+                        }
+                        break;
+
+                    case 25: // --policy
+                        if(strcmp(optarg, "smallest") == 0) {
+                            processing.compression.policy = CompressionPolicy::Smallest;
+                        } else if(strcmp(optarg, "boot") == 0) {
+                            processing.compression.policy = CompressionPolicy::Boot;
+                        } else if(strcmp(optarg, "fastest") == 0) {
+                            processing.compression.policy = CompressionPolicy::Fastest;
+                        } else if(strcmp(optarg, "balanced") == 0) {
+                            processing.compression.policy = CompressionPolicy::Balanced;
+                        } else {
+                            fprintf(stderr, "Unknown policy: %s\n", optarg);
+                            return 1;
+                        }
+                        break;
+
+                    case 26: // --scan-msload
+                        processing.scanMSLOAD = true;
                         break;
 
                     default:
@@ -81,6 +429,155 @@ int main(int argc, char **argv) {
         }
     }
 
+    const auto &compression = processing.compression;
+    if(compression.inPlace) {
+        if(compression.linkedBlocks || compression.decoder != LZ4Decoder::Small) {
+            fprintf(stderr, "--in-place can't be combined with --linked-blocks or --decoder=fast.\n");
+            return 1;
+        }
+
+        if(compression.codecSelection == CodecSelection::Fixed && !findPayloadCodec(compression.codec)->unpacksInPlace()) {
+            fprintf(stderr, "The %s codec can't unpack in place.\n", compression.codec.c_str());
+            return 1;
+        }
+    }
+
+    if(compression.linkedBlocks && compression.blockSize != 0) {
+        fprintf(stderr, "--block-size only applies to independent blocks, not with --linked-blocks.\n");
+        return 1;
+    }
+
+    if((search || compression.policy != CompressionPolicy::Fixed) && compression.codecSelection != CodecSelection::Fixed) {
+        fprintf(stderr, "--search and --policy need a single codec.\n");
+        return 1;
+    }
+
+    if(search) {
+        if(manifest || diskImages || extractMSDCMTo || argc - optind != 1) {
+            fprintf(stderr, "--search takes a single input file, and no output.\n");
+            return 1;
+        }
+
+        try {
+            searchImageFile(argv[optind], processing, std::cout);
+        } catch(const std::exception &e) {
+            fprintf(stderr, "%s: failed: %s\n", argv[optind], e.what());
+            return 2;
+        }
+
+        return 0;
+    }
+
+    /*
+     * The profile collects over all the images, whatever mode they are
+     * processed in, and is written out once they are done.
+     */
+    CMProfile profile;
+
+    if(profileCMTo) {
+        processing.cm.profile = &profile;
+
+        if(processing.cm.engine == CMEngine::Native)
+            processing.cm.engine = CMEngine::Emulated;
+    }
+
+    auto writeProfile = [&]() {
+        if(!profileCMTo)
+            return 0;
+
+        std::ofstream stream(profileCMTo, std::ios::out | std::ios::trunc);
+        if(stream) {
+            profile.write(stream);
+            stream.close();
+        }
+
+        if(!stream) {
+            fprintf(stderr, "Unable to write the 'CM' profile into %s\n", profileCMTo);
+            return 1;
+        }
+
+        return 0;
+    };
+
+    auto batchOptions = processing;
+    if(!threadsSet) {
+        /*
+         * In batch mode, the images are already processed concurrently.
+         */
+        batchOptions.compression.threads = 1;
+        batchOptions.cm.threads = 1;
+    }
+
+    if(diskImages) {
+        if(manifest) {
+            fprintf(stderr, "--disk-image cannot be used with --manifest.\n");
+            return 1;
+        }
+
+        size_t count = argc - optind;
+        if(count == 0 || (extractMSDCMTo && count != 1)) {
+            fprintf(stderr, "Try %s --help for usage.\n", argv[0]);
+            return 1;
+        }
+
+        std::vector<ImageStatistics> images(count);
+        std::vector<std::string> errors(count);
+
+        /*
+         * Every disk image is a separate file, so they can be patched
+         * concurrently, like a batch.
+         */
+        parallelFor(count, parallelWorkerCount(jobs, count), [&](size_t index, unsigned int) {
+            auto diskImage = argv[optind + index];
+            images[index].input = diskImage;
+
+            try {
+                processDiskImage(diskImage, extractMSDCMTo ? extractMSDCMTo : std::filesystem::path(),
+                                 count == 1 ? processing : batchOptions, statistics ? &images[index] : nullptr);
+            } catch(const std::exception &e) {
+                errors[index] = e.what();
+                images[index].error = e.what();
+            }
+
+            if(errors[index].empty()) {
+                logMessage(LogLevel::Info, "%s: processed", diskImage);
+            } else {
+                logMessage(LogLevel::Error, "%s: failed: %s", diskImage, errors[index].c_str());
+            }
+        });
+
+        size_t failures = std::count_if(errors.begin(), errors.end(), [](const std::string &error) {
+            return !error.empty();
+        });
+
+        if(writeProfile() != 0 || (statistics && writeStatistics(statisticsOutput, images, run) != 0))
+            return 1;
+
+        return failures == 0 ? 0 : 2;
+    }
+
+    if(manifest) {
+        if(extractMSDCMTo) {
+            fprintf(stderr, "--extract-msdcm cannot be used with --manifest; specify MSDCM outputs in the manifest.\n");
+            return 1;
+        }
+
+        if(optind != argc) {
+            fprintf(stderr, "--manifest cannot be used with input and output paths; list them in the manifest.\n");
+            return 1;
+        }
+
+        BatchProcessor batch(batchOptions, jobs);
+        batch.addManifest(manifest);
+
+        auto failures = batch.run();
+
+        if(writeProfile() != 0 || (statistics && writeStatistics(statisticsOutput, batch.statistics(), run) != 0))
+            return 1;
+
+        return failures == 0 ? 0 : 2;
+    }
+
     if(argc - optind < 2) {
         fprintf(stderr, "Try %s --help for usage.\n", argv[0]);
         return 1;
@@ -89,24 +586,27 @@ int main(int argc, char **argv) {
     auto input = argv[optind];
     auto output = argv[optind + 1];
 
-    WinbootImage image;
-    image.load(input);
+    if(std::filesystem::is_directory(input)) {
+        BatchProcessor batch(batchOptions, jobs);
+        batch.addDirectory(input, output, extractMSDCMTo ? extractMSDCMTo : std::filesystem::path());
 
-    if(extractMSDCMTo) {
-        image.extractMSDCM(extractMSDCMTo);
-    }
+        auto failures = batch.run();
 
-    if(removeMSDCM) {
-        image.removeMSDCM();
-    }
+        if(writeProfile() != 0 || (statistics && writeStatistics(statisticsOutput, batch.statistics(), run) != 0))
+            return 1;
 
-    if(removeLogo) {
-        image.removeLogo();
+        return failures == 0 ? 0 : 2;
     }
 
-    if(compress) {
-        image.compress();
-    }
+    std::vector<ImageStatistics> images(1);
+    images[0].input = input;
+
+    processImageFile(input, output, extractMSDCMTo ? extractMSDCMTo : std::filesystem::path(), processing,
+                     statistics ? &images[0] : nullptr);
+
+    if(writeProfile() != 0)
+        return 1;
 
-    image.save(output);
+    if(statistics)
+        return writeStatistics(statisticsOutput, images, run);
 }
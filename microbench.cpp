@@ -0,0 +1,342 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "CMDecompressor.h"
+#include "FileIO.h"
+#include "Log.h"
+#include "PayloadCodec.h"
+#include "SyntheticImage.h"
+#include "WinbootImage.h"
+
+/*
+ * Every allocation made through the global operator new is counted, on all
+ * threads, so that the benchmarks can report allocations per operation.
+ */
+static std::atomic<uint64_t> allocationCount;
+static std::atomic<uint64_t> allocatedBytes;
+
+void *operator new(size_t size) {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+
+    auto pointer = malloc(size == 0 ? 1 : size);
+    if(!pointer)
+        throw std::bad_alloc();
+
+    return pointer;
+}
+
+void operator delete(void *pointer) noexcept {
+    free(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept {
+    free(pointer);
+}
+
+static const struct option options[] {
+    { "help",            no_argument,       nullptr, 0 },
+    { "layout",          required_argument, nullptr, 0 },
+    { "size",            required_argument, nullptr, 0 },
+    { "compressibility", required_argument, nullptr, 0 },
+    { "seed",            required_argument, nullptr, 0 },
+    { "min-time",        required_argument, nullptr, 0 },
+    { "threads",         required_argument, nullptr, 0 },
+    { "codec",           required_argument, nullptr, 0 },
+    { "filter",          required_argument, nullptr, 0 },
+    { "save-images",     required_argument, nullptr, 0 },
+    { nullptr,           0,                 nullptr, 0 }
+};
+
+static void usage(const char *appname) {
+    printf(
+           "Microbenchmarks of the WINBOOT.SYS processing hot paths on synthetic images.\n"
+           "\n"
+           "Usage: %s [OPTIONS]\n"
+           "Options:\n"
+           "  --help                      Print this message\n"
+           "  --layout=<LAYOUT>           Which images to generate:\n"
+           "                                dos7  - MS-DOS 7, with MSDCM\n"
+           "                                dos8  - MS-DOS 8, uncompressed\n"
+           "                                dos8cm - MS-DOS 8, 'CM'-compressed\n"
+           "                                all   - all of the above (default)\n"
+           "  --size=<BYTES>              Size of the IO.SYS payload, without the logo. Defaults to\n"
+           "                              98304. MS-DOS 7 images take 75344 to 140879 bytes.\n"
+           "  --compressibility=<R>       Share of the payload made of repeated strings, from 0\n"
+           "                              (random) to 1. Defaults to 0.8.\n"
+           "  --seed=<N>                  Seed of the generator. Defaults to 1.\n"
+           "  --min-time=<SECONDS>        How long to repeat every benchmark for. Defaults to 0.5.\n"
+           "  --threads=<N>               Number of threads for compressing and for decompressing\n"
+           "                              'CM' payloads. Defaults to 1, for stable results.\n"
+           "  --codec=<CODEC>             Codec to compress with. Defaults to lz4.\n"
+           "  --filter=<TEXT>             Only run the benchmarks whose name contains the text.\n"
+           "  --save-images=<DIRECTORY>   Also write the generated images into the directory.\n"
+           "\n"
+           "Throughput is in megabytes (10^6 bytes) of the input image per second, except for\n"
+           "cmDecompress, which counts the decompressed bytes. Allocations are counted on all\n"
+           "threads, and exclude the setup of every iteration.\n",
+           appname);
+}
+
+namespace {
+    struct Layout {
+        const char *name;
+        SyntheticLayout layout;
+    };
+
+    static const Layout layouts[] {
+        { "dos7",   SyntheticLayout::DOS7 },
+        { "dos8",   SyntheticLayout::DOS8 },
+        { "dos8cm", SyntheticLayout::DOS8Compressed }
+    };
+
+    struct BenchmarkSettings {
+        double minTime = 0.5;
+        std::string filter;
+        CMDecompressionOptions cm;
+        CompressionOptions compression;
+    };
+
+    /*
+     * Repeats 'setup' and 'operation' for at least the minimum time (and at
+     * least three times), timing only the operation and counting only its
+     * allocations, and reports the averages. 'bytes' is the amount of data
+     * one operation processes. A failing benchmark is reported and skipped,
+     * as compress() does on incompressible payloads.
+     */
+    void runBenchmark(const BenchmarkSettings &settings, const std::string &name, size_t bytes,
+                      const std::function<void()> &setup, const std::function<void()> &operation) {
+        if(name.find(settings.filter) == std::string::npos)
+            return;
+
+        using Clock = std::chrono::steady_clock;
+
+        Clock::duration elapsed {};
+        uint64_t allocations = 0;
+        uint64_t allocationBytes = 0;
+        size_t iterations = 0;
+
+        auto minTime = std::chrono::duration<double>(settings.minTime);
+
+        try {
+            do {
+                setup();
+
+                auto allocationsBefore = allocationCount.load();
+                auto bytesBefore = allocatedBytes.load();
+                auto start = Clock::now();
+
+                operation();
+
+                elapsed += Clock::now() - start;
+                allocations += allocationCount.load() - allocationsBefore;
+                allocationBytes += allocatedBytes.load() - bytesBefore;
+                iterations++;
+            } while(iterations < 3 || elapsed < minTime);
+        } catch(const std::exception &e) {
+            printf("%-24s failed: %s\n", name.c_str(), e.what());
+            fflush(stdout);
+            return;
+        }
+
+        double seconds = std::chrono::duration<double>(elapsed).count() / iterations;
+
+        printf("%-24s %9zu %7zu %11.3f %10.2f %10.1f %12.0f\n",
+               name.c_str(), bytes, iterations, seconds * 1e3, bytes / seconds / 1e6,
+               static_cast<double>(allocations) / iterations,
+               static_cast<double>(allocationBytes) / iterations);
+        fflush(stdout);
+    }
+
+    void benchmarkLayout(const BenchmarkSettings &settings, const Layout &layout,
+                         const std::vector<unsigned char> &input) {
+        std::vector<unsigned char> data;
+        WinbootImage image;
+        image.setCMDecompressionOptions(settings.cm);
+
+        auto loadImage = [&]() {
+            data = input;
+            image.load(std::move(data));
+        };
+
+        std::string prefix = std::string(layout.name) + "/";
+
+        runBenchmark(settings, prefix + "load", input.size(), [&]() {
+            data = input;
+        }, [&]() {
+            image.load(std::move(data));
+        });
+
+        if(layout.layout == SyntheticLayout::DOS8Compressed) {
+            static constexpr size_t MSLOADSize = 0x800;
+
+            auto stream = input.data() + MSLOADSize;
+            auto streamSize = input.size() - MSLOADSize;
+            std::vector<unsigned char> output(cmDecompressedSize(stream, streamSize));
+
+            runBenchmark(settings, prefix + "cmDecompress", output.size(), []() {}, [&]() {
+                cmDecompress(stream, streamSize, output.data(), output.size(), settings.cm);
+            });
+        }
+
+        runBenchmark(settings, prefix + "compress", input.size(), loadImage, [&]() {
+            image.compress(settings.compression);
+        });
+
+        /*
+         * Cutting the logo out is the cutDOSAt() path, which moves MSDCM
+         * along on MS-DOS 7.
+         */
+        runBenchmark(settings, prefix + "cutDOSAt", input.size(), loadImage, [&]() {
+            image.removeLogo();
+        });
+
+        std::vector<unsigned char> output;
+
+        runBenchmark(settings, prefix + "save", input.size(), [&]() {
+            loadImage();
+            output = std::vector<unsigned char>();
+        }, [&]() {
+            image.save(output);
+        });
+    }
+}
+
+int main(int argc, char **argv) {
+    int optindex;
+    int result;
+    const char *layoutName = "all";
+    const char *saveImagesTo = nullptr;
+    SyntheticImageOptions generator;
+    BenchmarkSettings settings;
+
+    generator.payloadSize = 0x18000;
+
+    /*
+     * The 'CM' streams of the synthetic images have no decompressor to
+     * emulate.
+     */
+    settings.cm.engine = CMEngine::Native;
+    settings.cm.threads = 1;
+    settings.compression.threads = 1;
+
+    while((result = getopt_long(argc, argv, "", options, &optindex)) != -1) {
+        switch(result) {
+            case '?':
+            case ':':
+                fprintf(stderr, "Try %s --help for usage.\n", argv[0]);
+                return 1;
+
+            case 0:
+                switch(optindex) {
+                    case 0: // --help
+                        usage(argv[0]);
+                        return 0;
+
+                    case 1: // --layout
+                        layoutName = optarg;
+                        break;
+
+                    case 2: // --size
+                        generator.payloadSize = strtoul(optarg, nullptr, 0);
+                        break;
+
+                    case 3: // --compressibility
+                        generator.compressibility = strtod(optarg, nullptr);
+                        break;
+
+                    case 4: // --seed
+                        generator.seed = strtoul(optarg, nullptr, 0);
+                        break;
+
+                    case 5: // --min-time
+                        settings.minTime = strtod(optarg, nullptr);
+                        break;
+
+                    case 6: // --threads
+                        settings.compression.threads = strtoul(optarg, nullptr, 10);
+                        settings.cm.threads = settings.compression.threads;
+                        if(settings.compression.threads == 0) {
+                            fprintf(stderr, "--threads expects a positive number.\n");
+                            return 1;
+                        }
+                        break;
+
+                    case 7: // --codec
+                        if(!findPayloadCodec(optarg)) {
+                            fprintf(stderr, "Unknown codec: %s\n", optarg);
+                            return 1;
+                        }
+                        settings.compression.codec = optarg;
+                        break;
+
+                    case 8: // --filter
+                        settings.filter = optarg;
+                        break;
+
+                    case 9: // --save-images
+                        saveImagesTo = optarg;
+                        break;
+
+                    default:
+                        throw std::logic_error("unexpected optindex from getopt_long");
+                }
+                break;
+
+            default:
+                throw std::logic_error("unexpected return value from getopt_long");
+        }
+    }
+
+    bool layoutFound = strcmp(layoutName, "all") == 0;
+    for(const auto &layout: layouts) {
+        layoutFound = layoutFound || strcmp(layoutName, layout.name) == 0;
+    }
+
+    if(!layoutFound) {
+        fprintf(stderr, "Unknown layout: %s\n", layoutName);
+        return 1;
+    }
+
+    /*
+     * WinbootImage reports every step it takes, which would swamp the
+     * results.
+     */
+    setLogSink(LogSink());
+
+    printf("%-24s %9s %7s %11s %10s %10s %12s\n",
+           "benchmark", "bytes", "iters", "ms/op", "MB/s", "allocs/op", "alloc B/op");
+
+    for(const auto &layout: layouts) {
+        if(strcmp(layoutName, "all") != 0 && strcmp(layoutName, layout.name) != 0)
+            continue;
+
+        generator.layout = layout.layout;
+
+        try {
+            auto image = generateSyntheticImage(generator);
+
+            if(saveImagesTo) {
+                writeFile(std::filesystem::path(saveImagesTo) / (std::string(layout.name) + ".sys"), image);
+            }
+
+            benchmarkLayout(settings, layout, image);
+        } catch(const std::exception &e) {
+            fprintf(stderr, "%s: failed: %s\n", layout.name, e.what());
+            return 2;
+        }
+    }
+
+    return 0;
+}
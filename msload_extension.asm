@@ -3,17 +3,81 @@ org 0x701
 ; Main procedure.
 ; Invoked by the patched MSLOAD with the complete WINBOOT.SYS payload,
 ; loaded starting at the segment 0x70.
+; The code has to be position-independent: the org is where the extension
+; goes in MS-DOS 7 MSLOAD, but in MS-DOS 8 MSLOAD it goes wherever the slack is.
 ; At entry, we have a valid stack set, and the following register values set:
 ; AX, BX, DX, DI, BP  - unknown, but signficant, should be restored before passing
 ; control to the payload.
+;
+; When assembled with LINKED_BLOCKS defined, the extension decodes the linked
+; block stream ('LK' magic) instead, in which the matches of a block may reach
+; back up to 32 KiB into the output of the previous blocks. The blocks of such
+; a stream are at most 0x7FF0 bytes long, and the first one is always full.
+;
+; When assembled with FAST_DECODER defined, the blocks are decoded with
+; lz4_decompress_fast instead of lz4_decompress_small.
+;
+; When assembled with LZE_CODEC defined, the blocks are LZE-compressed
+; ('EZ' magic, or 'EK' for linked blocks) rather than LZ4-compressed, and are
+; decoded with lze_decompress.
+;
+; Any block may be stored instead: its length word is 0xFFFF, followed by the
+; actual length word and that many bytes of the payload, which is always even.
+;
+; When assembled with IN_PLACE defined, the extension decodes the in-place
+; LZ4 stream ('LI' magic) laid out by LZ4Codec: it is unpacked backwards,
+; from the top of the payload down, right where MSLOAD has loaded it, so it
+; never has to be moved out of the way of the output first. Such a stream is
+; made of independent blocks, decoded with lz4_decompress_back.
+;
+; Only the builds that decode with lz4_decompress_small (the default LZ4
+; ones, with independent or linked blocks) print the LZ4_8088 banner that
+; credits it. The others leave it out along with the routine: with it, their
+; larger decoders wouldn't fit into the slack of MS-DOS 7 MSLOAD.
+;
+; The encoders estimate the cost of unpacking with the cycle models of these
+; decoders in DecoderModels.h, which need refitting when they change.
+
+%ifdef IN_PLACE
+
+%define STREAM_MAGIC 0x494C ; 'LI'
+%define decompress_block lz4_decompress_back
+
+%elifdef LZE_CODEC
+
+%ifdef LINKED_BLOCKS
+%define STREAM_MAGIC 0x4B45 ; 'EK'
+%else
+%define STREAM_MAGIC 0x5A45 ; 'EZ'
+%endif
+
+%define decompress_block lze_decompress
+
+%else
+
+%ifdef LINKED_BLOCKS
+%define STREAM_MAGIC 0x4B4C ; 'LK'
+%else
+%define STREAM_MAGIC 0x5A4C ; 'LZ'
+%endif
+
+%ifdef FAST_DECODER
+%define decompress_block lz4_decompress_fast
+%else
+%define decompress_block lz4_decompress_small
+%define WITH_BANNER
+%endif
+
+%endif
+
 extension_start:
 
     mov     cx, 0x70
     mov     ds, cx
-    cmp     word [ds:0], 0x5A4C
+    cmp     word [ds:0], STREAM_MAGIC
     je      .compressed
 
-    ; No 'LZ' magic, the payload is not compressed
+    ; No magic, the payload is not compressed (or not in a format we know)
     jmp     .invoke_winboot
 
 .compressed:
@@ -24,30 +88,172 @@ extension_start:
 
     cld
 
-    push    ds
-    push    cs
-    pop     ds
+%ifdef WITH_BANNER
+    push    ds ; int 10h AH 0x0E may corrupt DS
+    push    bp ; and BP
 
-    push    bp ; int 10h AH 0x0E may corrupt BP
-
-    mov     si, copyright
     mov     ah, 0x0E ; Teletype output
     mov     bx, 0x07 ; Page 0, foreground color 7
+
+    ; The extension doesn't always go at the same place in MSLOAD, so the
+    ; banner is found from the return address.
+    call    .print_banner
+    db "LZ4_8088 Copyright Jim Leonard", 13, 10
+.print_banner:
+    pop     si
 .next_char:
-    lodsb
-    test    al, al
-    jz      .copyright_done
+    cs lodsb
 
+    push    ax ; not every BIOS preserves AL
     int     0x10
+    pop     ax
 
-    push    cs ; int 10h AH 0x0E may corrupt DS
+    cmp     al, 10 ; the line feed ends the banner
+    jne     .next_char
+
+    pop     bp
     pop     ds
+%endif
+
+%ifdef IN_PLACE
+    push    bp
+
+    mov     si, 2
+    lodsw   ; ax - size of the uncompressed payload, in paragraphs
+    ; Calculate DI value for WINBOOT.SYS (last DOS paragraph)
+    add     ax, 0x60
+    push    ax ; this becomes DI when we pass control to WINBOOT
+
+    ; ES - the end of the payload
+    add     ax, 0x10
+    mov     es, ax
+
+    lodsw   ; top of the blocks: paragraphs past 0x70:0
+    add     ax, cx
+    xchg    bx, ax
+    lodsw   ; and bytes past that paragraph
+    xchg    dx, ax
+    lodsw   ; number of blocks
+    xchg    bp, ax
+    lodsw   ; number of bytes displaced from the start of the payload
+    xchg    cx, ax
+    push    cx
+
+    ; The header and the bottom of the stream take the place of the start of
+    ; the payload, which is kept above the blocks instead. Put it aside past
+    ; the padding, where the output doesn't reach.
+    mov     ds, bx
+    mov     si, dx
+    mov     di, 0x200
+    rep     movsb
+    mov     si, dx
+
+    ; Some padding at the end of winboot is required for the proper
+    ; initialization of it. The blocks never reach that far, so it can be
+    ; done right away.
+    xor     ax, ax
+    xor     di, di
+    mov     cx, 256
+    rep     stosw
+
+    ; DS:SI - the top of the compressed data
+    ; ES:DI - the top of the uncompressed data
+    xor     di, di
+    std
+    call    normalize
+    dec     si
+    dec     di
+
+.uncompress_next_block:
+    ; DS:SI points at the last byte of the length of the next block down,
+    ; which is above its data.
+    dec     si
+    lodsw
+    inc     si
+    inc     ax
+    jz      .stored_block
+    dec     ax
+
+    ; Decompress a block of AX bytes from DS:SI to ES:DI, downwards.
+    call    decompress_block
 
-    jmp     .next_char
-.copyright_done:
+.block_done:
+    call    normalize
+
+    dec     bp
+    jnz     .uncompress_next_block
+
+    ; Now put the start of the payload in place.
+    cld
+    pop     cx
+    pop     di
+    lea     ax, [di + 0x10]
+    mov     ds, ax
+    mov     si, 0x200
+    mov     ax, 0x70
+    mov     es, ax
+    push    di
+    xor     di, di
+    rep     movsb
+
+    pop     di
     pop     bp
+    pop     ax
+    pop     bx
+    pop     dx
 
-    pop     ds
+.invoke_winboot:
+    jmp     0x70:0
+
+.stored_block:
+    ; Copy a stored block from DS:SI to ES:DI, downwards. Its length is even,
+    ; so it goes a word at a time, from the word below the pointers up.
+    dec     si
+    lodsw
+    xchg    cx, ax
+    shr     cx, 1
+    dec     di
+    rep     movsw
+    inc     si
+    inc     di
+    jmp     .block_done
+
+; Normalizes DS:SI and ES:DI pairs for going downwards: moves the segments
+; as far down as they go, at most 0xFFF paragraphs below the pointers, so that
+; the offsets have as much room to decrease as possible.
+; Destroys AX, BX, CL, DX.
+normalize:
+    mov     cl, 4 ; the 8086 can't shift by an immediate count
+    mov     ax, ds
+    mov     dx, si
+    call    .lower
+    mov     ds, ax
+    mov     si, dx
+
+    mov     ax, es
+    mov     dx, di
+    call    .lower
+    mov     es, ax
+    mov     di, dx
+
+    ret
+
+; AX:DX -> AX:DX
+.lower:
+    mov     bx, dx
+    shr     bx, cl
+    add     bx, ax
+    sub     bx, 0xFFF
+    jnc     .lowered
+    xor     bx, bx
+.lowered:
+    sub     ax, bx
+    shl     ax, cl
+    add     dx, ax
+    xchg    ax, bx
+    ret
+
+%else
 
     mov     si, 2
     ; DS:SI: compressed data
@@ -58,11 +264,12 @@ extension_start:
     add     ax, 0x60
     push    ax ; this becomes DI when we pass control to WINBOOT
 
+    push    ds ; this becomes ES for unpacking
+
     add     ax, 0x10
     ; relocated compressed data segment
     mov     es, ax
     xor     di, di
-    mov     si, 4
 
     push    ax
 
@@ -72,15 +279,21 @@ extension_start:
 .copy_next_block:
     lodsw
     stosw
-    ; ax - block length
+    xchg    cx, ax
+    ; cx - block length
     ; DS:SI: block data
 
     ; Zero length means last block
-    test    ax, ax
-    jz      .copy_finished
+    jcxz    .copy_finished
 
-    mov     cx, ax
+    ; A stored block has the actual length next
+    cmp     cx, 0xFFFF
+    jne     .copy_block
+    lodsw
+    stosw
+    xchg    cx, ax
 
+.copy_block:
     rep     movsb
 
     call    normalize
@@ -97,22 +310,43 @@ extension_start:
     xor     si, si
 
     ; ES:DI - uncompressed data
-    mov     ax, 0x70
-    mov     es, ax
+    pop     es
     xor     di, di
 
 .uncompress_next_block:
-    mov     ax, [si]
-    test    ax, ax
+    lodsw
+    inc     ax
+    jz      .stored_block
+    dec     ax
     jz      .decompression_finished
 
-    ; Decompress a block from DS:SI to ES:DI.
-    call    lz4_decompress_small
+    ; Decompress a block of AX bytes from DS:SI to ES:DI.
+    call    decompress_block
 
+.block_done:
     call    normalize
 
+%ifdef LINKED_BLOCKS
+    ; Move 32 KiB of the output already produced below ES:DI, so that the
+    ; matches of the next block can reach back into it without crossing the
+    ; segment. This is why the blocks are limited to 0x7FF0 bytes, and why the
+    ; first block has to be full: otherwise, ES would wrap around here.
+    mov     ax, es
+    sub     ax, 0x800
+    mov     es, ax
+    or      di, 0x8000
+%endif
+
     jmp     .uncompress_next_block
 
+.stored_block:
+    ; Copy a stored block from DS:SI to ES:DI.
+    lodsw
+    xchg    cx, ax
+    shr     cx, 1
+    rep     movsw
+    jmp     .block_done
+
 .decompression_finished:
     ; ax is guaranteed zero at this point
     ; some padding at the end of winboot is required for the proper
@@ -129,9 +363,11 @@ extension_start:
     jmp     0x70:0
 
 ; Normalizes DS:SI and ES:DI pairs.
+; Destroys AX, BX, CL, DX.
 normalize:
+    mov     cl, 4 ; the 8086 can't shift by an immediate count
     mov     ax, si
-    shr     ax, 4
+    shr     ax, cl
     mov     bx, ds
     add     ax, bx
     mov     ds, ax
@@ -139,14 +375,166 @@ normalize:
 
     mov     bx, es
     mov     dx, di
-    shr     dx, 4
+    shr     dx, cl
     add     bx, dx
     mov     es, bx
     and     di, 0x0F
 
     ret
 
-copyright: db "LZ4_8088 Copyright Jim Leonard", 10, 13, 0
+%endif
+
+%ifdef IN_PLACE
+
+;---------------------------------------------------------------
+; lz4_decompress_back
+;
+; lz4_decompress_small turned around, for the blocks of the in-place stream:
+; the block is read and the output written from the top down, with the
+; direction flag set. LZ4Codec compresses the reversed payload and lays every
+; sequence out back to front, so the decoder sees an ordinary LZ4 block, only
+; reading each match offset as a word from the two bytes below the pointer,
+; and finding the match above the output rather than below.
+;---------------------------------------------------------------
+
+; At entry:
+; AX - size of compressed chunk
+; DS:SI - the last byte of the source
+; ES:DI - the last byte of the destination
+; DF set
+; At exit:
+; DS:SI, ES:DI - updated, everything else: destroyed
+
+lz4_decompress_back:
+        mov     bx,si
+        sub     bx,ax           ;BX = threshold to stop decompression
+        xor     ax,ax
+.parsetoken:                    ;CX=0 here because of REP at end of loop
+        lodsb                   ;grab token to AL
+        mov     dx,ax           ;preserve packed token in DX
+        mov     cx,4            ;set full CX reg to ensure CH is 0
+        shr     al,cl           ;unpack upper 4 bits
+        call    buildfullcount  ;build full literal count if necessary
+        rep     movsb           ;if cx=0 nothing happens
+        cmp     si,bx           ;are we at the end of our compressed chunk?
+        je      .done
+        dec     si
+        lodsw                   ;AX = match offset
+        inc     si
+        xchg    dx,ax           ;AX = packed token, DX = match offset
+        and     al,0Fh          ;unpack match length token
+        call    buildfullcount  ;build full match count if necessary
+        push    ds
+        push    si
+        mov     si,di
+        add     si,dx
+        push    es
+        pop     ds              ;ds:si points at match; es:di points at dest
+        add     cx,4            ;minmatch = 4
+        rep     movsb           ;copy match run
+        pop     si
+        pop     ds              ;ds:si restored
+        jmp     .parsetoken
+
+.done:
+        ret
+
+buildfullcount:
+                                ;CH has to be 0 here to ensure AH remains 0
+        cmp     al,0Fh          ;test if unpacked literal length token is 15?
+        xchg    cx,ax           ;CX = unpacked literal length token; flags unchanged
+        jne     .builddone      ;if AL was not 15, we have nothing to build
+.buildloop:
+        lodsb                   ;load a byte
+        add     cx,ax           ;add it to the full count
+        cmp     al,0FFh         ;was it FF?
+        je      .buildloop      ;if so, keep going
+.builddone:
+        retn
+
+%elifdef LZE_CODEC
+
+;---------------------------------------------------------------
+; lze_decompress
+;
+; Decodes an LZE block, as produced by LZECodec: a stream of control bits,
+; read MSB-first a byte at a time as they are needed, interleaved with the
+; literal bytes and with the low bytes of the match offsets. The counts are
+; interlaced Elias gamma codes. A block is a literal run, followed by any
+; number of:
+;   0 <gamma len>                 - match at the last offset (after literals)
+;   1 <gamma hi+1> <lo> <gamma len-1> - match at offset (hi:lo)+1
+;   0 <gamma len> <literals>      - literal run (after a match)
+; and is terminated by a new match with hi+1 = 257.
+;---------------------------------------------------------------
+
+; At entry:
+; DS:SI - source
+; ES:DI - destination
+; At exit:
+; DS:SI, ES:DI - updated, everything else but BP: destroyed
+
+; Reads the next control bit into CF.
+%macro getbit 0
+        add     dl,dl
+        jnz     %%done
+        mov     dl,[si]         ;refill, shifting the marker bit in
+        inc     si
+        adc     dl,dl
+%%done:
+%endmacro
+
+lze_decompress:                 ;the block is terminated, its length is not needed
+        push    bp
+        mov     dl,80h          ;empty bit buffer: just the marker bit
+        mov     bp,1            ;last offset
+.literals:
+        call    .gamma
+        rep     movsb
+        getbit
+        jc      .newoffset
+        call    .gamma          ;match at the last offset
+.copymatch:
+        push    ds
+        push    si
+        mov     si,di
+        sub     si,bp
+        push    es
+        pop     ds              ;ds:si points at match; es:di points at dest
+        rep     movsb
+        pop     si
+        pop     ds              ;ds:si restored
+        getbit
+        jnc     .literals
+.newoffset:
+        call    .gamma          ;CX = high byte of the offset + 1
+        dec     cx
+        test    ch,ch           ;257 terminates the block
+        jnz     .done
+        mov     ah,cl
+        lodsb
+        inc     ax
+        xchg    bp,ax           ;BP = offset
+        call    .gamma
+        inc     cx              ;minmatch = 2
+        jmp     .copymatch
+
+.done:
+        pop     bp
+        ret
+
+.gamma:                         ;CX = interlaced Elias gamma code
+        mov     cx,1
+.gammaloop:
+        getbit
+        jc      .gammadone
+        getbit
+        adc     cx,cx
+        jmp     .gammaloop
+.gammadone:
+        ret
+
+%elifndef FAST_DECODER
 
 ; Decompresses Y. Collet's LZ4 compressed stream data in 16-bit real mode.
 ; Optimized for 8088/8086 CPUs.
@@ -166,13 +554,13 @@ copyright: db "LZ4_8088 Copyright Jim Leonard", 10, 13, 0
 ;---------------------------------------------------------------
 
 ; At entry:
+; AX - size of compressed chunk
 ; DS:SI - source
 ; ES:DI - destination
 ; At exit:
 ; DS:SI, ES:DI - updated, everything else: destroyed
 
 lz4_decompress_small:
-        lodsw                   ;load chunk size low 16-bit word
         xchg    bx,ax           ;BX = size of compressed chunk
         add     bx,si           ;BX = threshold to stop decompression
         xor     ax, ax
@@ -226,3 +614,98 @@ buildfullcount:
 .builddone:
         retn
 
+%else
+
+;---------------------------------------------------------------
+; lz4_decompress_fast
+;
+; Speed-optimized counterpart of lz4_decompress_small, after the approach of
+; Jim Leonard's lz4_decompress: the counts are built inline, literals and
+; matches are copied a word at a time, and matches at offset 1 (runs of a
+; single byte) are filled with REP STOSW. A match at any larger offset can be
+; copied with MOVSW even if it overlaps its own output, as both bytes of every
+; word read have already been written by then.
+;---------------------------------------------------------------
+
+; At entry:
+; AX - size of compressed chunk
+; DS:SI - source
+; ES:DI - destination
+; At exit:
+; DS:SI, ES:DI - updated, everything else: destroyed
+
+lz4_decompress_fast:
+        xchg    bx,ax           ;BX = size of compressed chunk
+        add     bx,si           ;BX = threshold to stop decompression
+        xor     cx,cx
+.parsetoken:                    ;CH=0 here because of REP at end of loop
+        lodsb                   ;grab token to AL
+        mov     dl,al           ;preserve packed token in DL
+        mov     cl,4
+        shr     al,cl           ;unpack upper 4 bits
+        jz      .copymatches    ;no literals
+        cbw
+        xchg    cx,ax           ;CX = literal count, AX = 4
+        cmp     cl,0Fh
+        jne     .doliteralcopy
+.buildliterals:
+        lodsb                   ;AH is 0 here
+        add     cx,ax
+        cmp     al,0FFh
+        je      .buildliterals
+.doliteralcopy:
+        shr     cx,1
+        rep     movsw
+        adc     cx,cx
+        rep     movsb
+
+;All LZ4 data ends with literals, and the offset token is ignored.
+
+        cmp     si,bx           ;are we at the end of our compressed chunk?
+        jae     .done
+.copymatches:
+        lodsw                   ;AX = match offset
+        xchg    dx,ax           ;AL = packed token, DX = match offset
+        and     ax,0Fh          ;unpack match length token
+        xchg    cx,ax           ;CX = match count, AX = 0 or 4
+        cmp     cl,0Fh
+        jne     .domatchcopy
+.buildmatch:
+        lodsb                   ;AH is 0 here
+        add     cx,ax
+        cmp     al,0FFh
+        je      .buildmatch
+.domatchcopy:
+        add     cx,4            ;minmatch = 4
+        xchg    ax,si           ;AX = source pointer
+        mov     si,di
+        sub     si,dx
+        cmp     dx,1
+        mov     dx,ds           ;DX:AX = source, doesn't change the flags
+        push    es
+        pop     ds              ;ds:si points at match; es:di points at dest
+        je      .dorun
+        shr     cx,1
+        rep     movsw
+        adc     cx,cx
+        rep     movsb
+.matchdone:
+        xchg    ax,si
+        mov     ds,dx           ;ds:si restored
+        jmp     .parsetoken
+
+.dorun:
+        push    ax
+        lodsb
+        mov     ah,al
+        shr     cx,1
+        rep     stosw
+        adc     cx,cx
+        rep     stosb
+        pop     ax
+        jmp     .matchdone
+
+.done:
+        ret
+
+%endif
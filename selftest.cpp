@@ -0,0 +1,867 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "CMDecompressor.h"
+#include "FATVolume.h"
+#include "PayloadCodec.h"
+#include "StubBenchmark.h"
+#include "SyntheticImage.h"
+#include "WinbootError.h"
+#include "WinbootImage.h"
+#include "cm_decompressor.h"
+
+/*
+ * Self-tests of the codecs and the image transformations, each a function
+ * that throws if it fails. CTest runs every one of them by name.
+ */
+
+namespace {
+    void check(bool condition, const std::string &what) {
+        if(!condition)
+            throw std::runtime_error(what);
+    }
+
+    void put16(unsigned char *data, uint16_t value) {
+        data[0] = value;
+        data[1] = value >> 8;
+    }
+
+    void put32(unsigned char *data, uint32_t value) {
+        put16(data, value);
+        put16(data + 2, value >> 16);
+    }
+
+    /*
+     * Runs of repeated bytes and copies of earlier data, interspersed with
+     * random bytes, so that the encoders find both matches and literals.
+     */
+    std::vector<unsigned char> makeTestData(size_t size, uint32_t seed) {
+        std::mt19937 random(seed);
+        std::uniform_int_distribution<unsigned int> byte(0, 255);
+        std::uniform_int_distribution<unsigned int> kind(0, 3);
+        std::uniform_int_distribution<size_t> length(1, 300);
+
+        std::vector<unsigned char> data;
+        data.reserve(size);
+
+        while(data.size() < size) {
+            auto runLength = std::min(length(random), size - data.size());
+
+            switch(kind(random)) {
+                case 0:
+                    data.insert(data.end(), runLength, byte(random));
+                    break;
+
+                case 1:
+                    if(data.size() >= runLength) {
+                        std::uniform_int_distribution<size_t> source(0, data.size() - runLength);
+                        auto start = source(random);
+
+                        for(size_t index = 0; index < runLength; index++) {
+                            data.push_back(data[start + index]);
+                        }
+                        break;
+                    }
+
+                    [[fallthrough]];
+
+                default:
+                    for(size_t index = 0; index < runLength; index++) {
+                        data.push_back(byte(random));
+                    }
+                    break;
+            }
+        }
+
+        return data;
+    }
+
+    void fillRandom(unsigned char *data, size_t size, uint32_t seed) {
+        std::mt19937 random(seed);
+        std::uniform_int_distribution<unsigned int> byte(0, 255);
+
+        for(size_t index = 0; index < size; index++) {
+            data[index] = byte(random);
+        }
+    }
+
+    std::vector<unsigned char> cmRoundTrip(const std::vector<unsigned char> &stream, CMEngine engine) {
+        CMDecompressionOptions options;
+        options.engine = engine;
+
+        std::vector<unsigned char> output(cmDecompressedSize(stream.data(), stream.size()));
+        cmDecompress(stream.data(), stream.size(), output.data(), output.size(), options);
+
+        return output;
+    }
+
+    /*
+     * Streams of several 'DS' blocks, the last one partial, decode back to
+     * their input with every engine. The test decompressor can only tell
+     * where a block ends by its sector markers, so the emulated engines get
+     * whole sectors; the native decoder gets an odd-sized tail, too.
+     */
+    void testCMRoundTrip() {
+        auto data = makeTestData(3 * 0x8000 + 0x1200, 1);
+
+        auto stream = cmCompress(data.data(), data.size(), cm_decompressor, sizeof(cm_decompressor));
+
+        check(cmRoundTrip(stream, CMEngine::Native) == data, "the native engine doesn't restore the input");
+        check(cmRoundTrip(stream, CMEngine::Emulated) == data, "the emulated engine doesn't restore the input");
+        check(cmRoundTrip(stream, CMEngine::Verify) == data, "the verified engines don't restore the input");
+
+        data = makeTestData(0x8000 + 777, 2);
+        stream = cmCompress(data.data(), data.size());
+
+        check(cmRoundTrip(stream, CMEngine::Native) == data, "the native engine doesn't restore an odd-sized input");
+    }
+
+    /*
+     * The framed streams of every codec, with independent and with linked
+     * blocks.
+     */
+    const struct {
+        const char *codec;
+        bool linked;
+    } streamKinds[] = {
+        { "lz4", false },   // 'LZ'
+        { "lz4", true },    // 'LK'
+        { "lze", false },   // 'EZ'
+        { "lze", true }     // 'EK'
+    };
+
+    /*
+     * The random stretch covers at least one whole block of either kind,
+     * which is stored, and the payload ends with a partial block.
+     */
+    static constexpr size_t RandomStart = 0xFC00;
+    static constexpr size_t RandomEnd = 0x1F800;
+
+    void testStreamRoundTrip() {
+        auto payload = makeTestData(0x25230, 3);
+        fillRandom(payload.data() + RandomStart, RandomEnd - RandomStart, 4);
+
+        for(const auto &kind: streamKinds) {
+            std::string name = std::string(kind.codec) + (kind.linked ? ", linked" : "");
+
+            CompressionOptions options;
+            options.codec = kind.codec;
+            options.linkedBlocks = kind.linked;
+
+            auto codec = findPayloadCodec(kind.codec);
+            auto encoded = codec->encode(payload.data(), payload.size(), options);
+
+            bool stored = false;
+            for(const auto &block: encoded.blocks) {
+                stored |= block.stored;
+            }
+
+            check(stored, name + ": no block is stored");
+            check(encoded.blocks.back().size < encoded.blocks.front().size, name + ": the last block is whole");
+
+            std::vector<unsigned char> decoded;
+            auto length = codec->decode(encoded.stream.data(), encoded.stream.size(), decoded);
+
+            check(length == encoded.stream.size(), name + ": the stream isn't decoded whole");
+            check(decoded == payload, name + ": the stream doesn't decode to the payload");
+        }
+    }
+
+    /*
+     * Compresses a synthetic image with a stretch that doesn't compress with
+     * every kind of stream, and boots it, which checks what the extension
+     * unpacks against what the stream decodes to natively, and that against
+     * the original payload.
+     */
+    void testStreamBoot() {
+        static constexpr size_t PayloadStart = 0x800;
+
+        SyntheticImageOptions generator;
+        generator.payloadSize = 0x22000;
+
+        auto input = generateSyntheticImage(generator);
+        fillRandom(input.data() + PayloadStart + RandomStart, RandomEnd - RandomStart, 5);
+
+        for(const auto &kind: streamKinds) {
+            std::string name = std::string(kind.codec) + (kind.linked ? ", linked" : "");
+
+            CompressionOptions options;
+            options.codec = kind.codec;
+            options.linkedBlocks = kind.linked;
+
+            WinbootImage image;
+            image.load(std::vector<unsigned char>(input));
+            image.compress(options);
+
+            std::vector<unsigned char> output;
+            image.save(output);
+
+            benchmarkStub(output);
+
+            auto stream = output.data() + PayloadStart;
+            auto streamSize = output.size() - PayloadStart;
+
+            std::vector<unsigned char> decoded;
+            identifyPayloadCodec(stream, streamSize)->decode(stream, streamSize, decoded);
+
+            check(decoded.size() <= input.size() - PayloadStart &&
+                  std::equal(decoded.begin(), decoded.end(), input.begin() + PayloadStart),
+                  name + ": the image doesn't unpack to the original payload");
+        }
+    }
+
+    /*
+     * MS-DOS 8 is compressed without being asked to scan MSLOAD, as its row
+     * is patched by the scan, and boots.
+     */
+    void testDOS8Boot() {
+        static constexpr size_t PayloadStart = 0x800;
+
+        SyntheticImageOptions generator;
+        generator.layout = SyntheticLayout::DOS8;
+
+        auto input = generateSyntheticImage(generator);
+
+        WinbootImage image;
+        image.load(std::vector<unsigned char>(input));
+        image.compress();
+
+        std::vector<unsigned char> output;
+        image.save(output);
+
+        benchmarkStub(output);
+
+        auto stream = output.data() + PayloadStart;
+        auto streamSize = output.size() - PayloadStart;
+
+        std::vector<unsigned char> decoded;
+        identifyPayloadCodec(stream, streamSize)->decode(stream, streamSize, decoded);
+
+        check(decoded.size() <= input.size() - PayloadStart &&
+              std::equal(decoded.begin(), decoded.end(), input.begin() + PayloadStart),
+              "the image doesn't unpack to the original payload");
+    }
+
+    /*
+     * The in-place stream is unpacked from the top down, so a payload whose
+     * bottom doesn't compress makes the output catch up with the input: the
+     * encoder has to keep the start of the payload out of the blocks, as a
+     * margin that's displaced to the top. Stored blocks take four bytes more
+     * than their part of the payload, so the random bottom is stored.
+     */
+    static constexpr size_t InPlaceRandomStart = 0x10;
+    static constexpr size_t InPlaceRandomEnd = 0x10000;
+
+    /*
+     * Offsets of the in-place stream header.
+     */
+    static constexpr size_t InPlaceDisplacedSizeOffset = 10;
+    static constexpr size_t InPlaceHeaderSize = 12;
+
+    void testInPlaceRoundTrip() {
+        CompressionOptions options;
+        options.inPlace = true;
+
+        auto codec = findPayloadCodec("lz4");
+
+        for(bool randomBottom: { false, true }) {
+            std::string name = randomBottom ? "random bottom" : "compressible";
+
+            auto payload = makeTestData(0x25230, 6);
+            if(randomBottom)
+                fillRandom(payload.data() + InPlaceRandomStart, InPlaceRandomEnd - InPlaceRandomStart, 7);
+
+            auto encoded = codec->encode(payload.data(), payload.size(), options);
+
+            bool stored = false;
+            for(const auto &block: encoded.blocks) {
+                stored |= block.stored;
+            }
+
+            size_t displacedSize = encoded.stream.data()[InPlaceDisplacedSizeOffset] |
+                                 (encoded.stream.data()[InPlaceDisplacedSizeOffset + 1] << 8);
+
+            if(randomBottom) {
+                check(stored, name + ": no block is stored");
+                check(displacedSize > InPlaceHeaderSize, name + ": no margin is kept");
+            }
+
+            std::vector<unsigned char> decoded;
+            auto length = codec->decode(encoded.stream.data(), encoded.stream.size(), decoded);
+
+            check(length == encoded.stream.size(), name + ": the stream isn't decoded whole");
+            check(decoded == payload, name + ": the stream doesn't unpack to the payload");
+        }
+    }
+
+    /*
+     * Boots an image compressed in place with the bottom of the payload
+     * random, where the margin the encoder keeps is all that keeps the
+     * extension from overwriting the stream before reading it.
+     */
+    void testInPlaceBoot() {
+        static constexpr size_t PayloadStart = 0x800;
+
+        SyntheticImageOptions generator;
+        generator.payloadSize = 0x22000;
+
+        auto input = generateSyntheticImage(generator);
+        fillRandom(input.data() + PayloadStart + InPlaceRandomStart, InPlaceRandomEnd - InPlaceRandomStart, 8);
+
+        CompressionOptions options;
+        options.inPlace = true;
+
+        WinbootImage image;
+        image.load(std::vector<unsigned char>(input));
+        image.compress(options);
+
+        std::vector<unsigned char> output;
+        image.save(output);
+
+        benchmarkStub(output);
+
+        auto stream = output.data() + PayloadStart;
+        auto streamSize = output.size() - PayloadStart;
+
+        std::vector<unsigned char> decoded;
+        identifyPayloadCodec(stream, streamSize)->decode(stream, streamSize, decoded);
+
+        check(decoded.size() <= input.size() - PayloadStart &&
+              std::equal(decoded.begin(), decoded.end(), input.begin() + PayloadStart),
+              "the image doesn't unpack to the original payload");
+    }
+
+    /*
+     * MS-DOS 8 loses its logo by its bitmap header, found by scanning the DOS
+     * portion back from its end. Plant the header of a bitmap that would run
+     * to the end into the body of the logo, with the pixels right after the
+     * headers though it has a palette, and check that the cut is at the real
+     * logo regardless.
+     */
+    void testLogoDecoy() {
+        static constexpr size_t MSLOADSize = 0x800;
+        static constexpr size_t DecoyDistance = 0x1000;
+
+        SyntheticImageOptions generator;
+        generator.layout = SyntheticLayout::DOS8;
+
+        auto input = generateSyntheticImage(generator);
+        auto logoPos = MSLOADSize + generator.payloadSize;
+
+        auto decoy = input.data() + input.size() - DecoyDistance;
+        memset(decoy, 0, 14 + 40);
+        decoy[0] = 'B';
+        decoy[1] = 'M';
+        decoy[2] = DecoyDistance & 0xFF;
+        decoy[3] = DecoyDistance >> 8;
+        decoy[10] = 14 + 40;
+        decoy[14] = 40;
+        decoy[26] = 1;
+        decoy[28] = 8;
+
+        WinbootImage image;
+        image.load(std::move(input));
+        image.removeLogo();
+
+        std::vector<unsigned char> output;
+        image.save(output);
+
+        check(output.size() == logoPos, "the DOS portion is cut at " + std::to_string(output.size()) +
+                                        " rather than at the logo, at " + std::to_string(logoPos));
+    }
+
+    /*
+     * MS-DOS 7 loses its logo where the layout of its build has IO.SYS end,
+     * if the logo starts there. Make the length of the dynamic portion lie,
+     * as it would in another build, and check that the logo is looked for
+     * instead, and that the image is refused if there's no logo to find.
+     */
+    void testLogoFallback() {
+        static constexpr size_t MSLOADSize = 0x800;
+        static constexpr size_t DynamicPortionLengthOffset = 0x803;
+
+        SyntheticImageOptions generator;
+        generator.payloadSize = 0x18000;
+
+        auto input = generateSyntheticImage(generator);
+        auto logoPos = MSLOADSize + generator.payloadSize;
+        auto dynamicPortionLength = input[DynamicPortionLengthOffset] | (input[DynamicPortionLengthOffset + 1] << 8);
+
+        for(unsigned int shift: { 0, 0x100, 0x1000 }) {
+            std::string name = "dynamic portion " + std::to_string(shift) + " bytes short";
+
+            std::vector<unsigned char> shifted(input);
+            put16(shifted.data() + DynamicPortionLengthOffset, dynamicPortionLength - shift);
+
+            WinbootImage image;
+            image.load(std::move(shifted));
+            image.removeLogo();
+
+            std::vector<unsigned char> output;
+            image.save(output);
+
+            auto dosSize = output.size() - generator.msdcmSize;
+
+            check(dosSize == logoPos, name + ": the DOS portion is cut at " + std::to_string(dosSize) +
+                                      " rather than at the logo, at " + std::to_string(logoPos));
+        }
+
+        std::vector<unsigned char> noLogo(input);
+        put16(noLogo.data() + DynamicPortionLengthOffset, dynamicPortionLength - 0x100);
+        memset(noLogo.data() + logoPos, 0, noLogo.size() - generator.msdcmSize - logoPos);
+
+        WinbootImage image;
+        image.load(std::move(noLogo));
+
+        try {
+            image.removeLogo();
+        } catch(const WinbootError &e) {
+            check(e.code() == WinbootErrorCode::UnsupportedImage,
+                  std::string("no logo: refused with the wrong error: ") + e.what());
+            return;
+        }
+
+        throw std::runtime_error("no logo: the image is cut where its layout doesn't say so");
+    }
+
+    enum class FATType {
+        FAT12,
+        FAT16,
+        FAT32
+    };
+
+    /*
+     * A freshly formatted FAT volume, with WINBOOT.SYS in its root directory
+     * between two other files, and fragmented. Every FAT is written, unless
+     * 'onlyFAT' is given, in which case only that one is, as if the others
+     * had stopped being kept up to date long ago.
+     */
+    class TestFATImage {
+    public:
+        TestFATImage(FATType type, const std::vector<unsigned char> &winboot, uint16_t extendedFlags, int onlyFAT);
+
+        uint32_t fatEntry(unsigned int fat, uint32_t cluster) const;
+
+        uint32_t endOfChain() const {
+            return m_type == FATType::FAT12 ? 0xFFF : m_type == FATType::FAT16 ? 0xFFFF : 0x0FFFFFFF;
+        }
+
+        static constexpr uint32_t BytesPerSector = 512;
+        static constexpr uint32_t FATCount = 2;
+        static constexpr size_t FSInfoFreeClustersOffset = BytesPerSector + 488;
+
+        std::vector<unsigned char> data;
+
+        std::vector<uint32_t> winbootClusters;
+        std::vector<uint32_t> otherClusters;
+        uint32_t bytesPerCluster;
+        size_t entryOffset;
+
+    private:
+        void setFATEntry(std::vector<unsigned char> &fat, uint32_t cluster, uint32_t value) const;
+        std::vector<uint32_t> allocate(size_t bytes, bool fragmented);
+        void writeFile(const std::vector<uint32_t> &clusters, const unsigned char *file, size_t size);
+        size_t clusterOffset(uint32_t cluster) const;
+
+        FATType m_type;
+        uint32_t m_reservedSectors;
+        uint32_t m_sectorsPerFAT;
+        uint32_t m_firstDataSector;
+        uint32_t m_nextCluster = 2;
+        std::vector<uint32_t> m_fat;
+    };
+
+    TestFATImage::TestFATImage(FATType type, const std::vector<unsigned char> &winboot, uint16_t extendedFlags,
+                               int onlyFAT) : m_type(type) {
+        /*
+         * The smallest volumes that still have enough clusters to be of the
+         * type.
+         */
+        uint32_t sectorsPerCluster, totalSectors, rootEntries;
+        switch(type) {
+            case FATType::FAT12:
+                sectorsPerCluster = 4, totalSectors = 16100, rootEntries = 224;
+                break;
+
+            case FATType::FAT16:
+                sectorsPerCluster = 2, totalSectors = 40300, rootEntries = 512;
+                break;
+
+            default:
+                sectorsPerCluster = 1, totalSectors = 71200, rootEntries = 0;
+                break;
+        }
+
+        m_reservedSectors = type == FATType::FAT32 ? 32 : 1;
+        bytesPerCluster = sectorsPerCluster * BytesPerSector;
+
+        uint32_t rootSectors = rootEntries * 32 / BytesPerSector;
+        uint32_t clusterCount;
+
+        for(m_sectorsPerFAT = 1;; m_sectorsPerFAT++) {
+            m_firstDataSector = m_reservedSectors + FATCount * m_sectorsPerFAT + rootSectors;
+            clusterCount = (totalSectors - m_firstDataSector) / sectorsPerCluster;
+
+            size_t fatBytes = type == FATType::FAT12 ? (3 * (clusterCount + 2) + 1) / 2 :
+                              type == FATType::FAT16 ? 2 * (clusterCount + 2) : 4 * (clusterCount + 2);
+            if(fatBytes <= m_sectorsPerFAT * BytesPerSector)
+                break;
+        }
+
+        data.assign(static_cast<size_t>(totalSectors) * BytesPerSector, 0);
+        m_fat.assign(clusterCount + 2, 0);
+        m_fat[0] = endOfChain() & ~7U;
+        m_fat[1] = endOfChain();
+
+        auto boot = data.data();
+        boot[0] = 0xEB;
+        boot[1] = 0x3C;
+        boot[2] = 0x90;
+        memcpy(boot + 3, "MSWIN4.1", 8);
+        put16(boot + 11, BytesPerSector);
+        boot[13] = sectorsPerCluster;
+        put16(boot + 14, m_reservedSectors);
+        boot[16] = FATCount;
+        put16(boot + 17, rootEntries);
+        boot[21] = 0xF8;
+
+        if(totalSectors < 0x10000) {
+            put16(boot + 19, totalSectors);
+        } else {
+            put32(boot + 32, totalSectors);
+        }
+
+        std::vector<uint32_t> rootClusters;
+
+        if(type == FATType::FAT32) {
+            put32(boot + 36, m_sectorsPerFAT);
+            put16(boot + 40, extendedFlags);
+            rootClusters = allocate(bytesPerCluster, false);
+            put32(boot + 44, rootClusters[0]);
+            put16(boot + 48, 1);
+        } else {
+            put16(boot + 22, m_sectorsPerFAT);
+        }
+
+        boot[510] = 0x55;
+        boot[511] = 0xAA;
+
+        std::vector<unsigned char> other(5000, 0x5A);
+        otherClusters = allocate(other.size(), false);
+        writeFile(otherClusters, other.data(), other.size());
+
+        winbootClusters = allocate(winboot.size(), true);
+        writeFile(winbootClusters, winboot.data(), winboot.size());
+
+        auto last = allocate(3000, false);
+        writeFile(last, other.data(), 3000);
+
+        std::vector<unsigned char> directory(3 * 32, 0);
+        auto makeEntry = [&](unsigned char *entry, const char *name, unsigned char attributes,
+                             const std::vector<uint32_t> &clusters, size_t size) {
+            memcpy(entry, name, 11);
+            entry[11] = attributes;
+            put16(entry + 20, clusters[0] >> 16);
+            put16(entry + 26, clusters[0]);
+            put32(entry + 28, size);
+        };
+
+        makeEntry(directory.data(), "OTHER   BIN", 0x20, otherClusters, other.size());
+        makeEntry(directory.data() + 32, "WINBOOT SYS", 0x27, winbootClusters, winboot.size());
+        makeEntry(directory.data() + 64, "LAST    BIN", 0x20, last, 3000);
+
+        if(type == FATType::FAT32) {
+            writeFile(rootClusters, directory.data(), directory.size());
+            entryOffset = clusterOffset(rootClusters[0]) + 32;
+
+            auto fsInfo = data.data() + BytesPerSector;
+            put32(fsInfo, 0x41615252);
+            put32(fsInfo + 484, 0x61417272);
+            put32(fsInfo + 488, clusterCount - (m_nextCluster - 2));
+            put32(fsInfo + 492, m_nextCluster);
+            fsInfo[510] = 0x55;
+            fsInfo[511] = 0xAA;
+        } else {
+            size_t rootOffset = static_cast<size_t>(m_reservedSectors + FATCount * m_sectorsPerFAT) * BytesPerSector;
+            memcpy(data.data() + rootOffset, directory.data(), directory.size());
+            entryOffset = rootOffset + 32;
+        }
+
+        std::vector<unsigned char> fat(m_sectorsPerFAT * BytesPerSector, 0);
+        for(uint32_t cluster = 0; cluster < m_fat.size(); cluster++) {
+            setFATEntry(fat, cluster, m_fat[cluster]);
+        }
+
+        for(unsigned int index = 0; index < FATCount; index++) {
+            if(onlyFAT >= 0 && index != static_cast<unsigned int>(onlyFAT))
+                continue;
+
+            memcpy(data.data() + static_cast<size_t>(m_reservedSectors + index * m_sectorsPerFAT) * BytesPerSector,
+                   fat.data(), fat.size());
+        }
+    }
+
+    uint32_t TestFATImage::fatEntry(unsigned int fat, uint32_t cluster) const {
+        auto table = data.data() + static_cast<size_t>(m_reservedSectors + fat * m_sectorsPerFAT) * BytesPerSector;
+
+        switch(m_type) {
+            case FATType::FAT12:
+            {
+                uint32_t pair = table[cluster + cluster / 2] | (table[cluster + cluster / 2 + 1] << 8);
+                return cluster & 1 ? pair >> 4 : pair & 0xFFF;
+            }
+
+            case FATType::FAT16:
+                return table[2 * cluster] | (table[2 * cluster + 1] << 8);
+
+            default:
+                return (table[4 * cluster] | (table[4 * cluster + 1] << 8) | (table[4 * cluster + 2] << 16) |
+                        (static_cast<uint32_t>(table[4 * cluster + 3]) << 24)) & 0x0FFFFFFF;
+        }
+    }
+
+    void TestFATImage::setFATEntry(std::vector<unsigned char> &fat, uint32_t cluster, uint32_t value) const {
+        switch(m_type) {
+            case FATType::FAT12:
+            {
+                auto entry = fat.data() + cluster + cluster / 2;
+                if(cluster & 1) {
+                    entry[0] = (entry[0] & 0x0F) | (value << 4);
+                    entry[1] = value >> 4;
+                } else {
+                    entry[0] = value;
+                    entry[1] = (entry[1] & 0xF0) | ((value >> 8) & 0x0F);
+                }
+                break;
+            }
+
+            case FATType::FAT16:
+                put16(fat.data() + 2 * cluster, value);
+                break;
+
+            default:
+                put32(fat.data() + 4 * cluster, value);
+                break;
+        }
+    }
+
+    /*
+     * Allocates the clusters of a file of 'bytes', leaving a gap after every
+     * third one if it's to be fragmented.
+     */
+    std::vector<uint32_t> TestFATImage::allocate(size_t bytes, bool fragmented) {
+        std::vector<uint32_t> clusters((bytes + bytesPerCluster - 1) / bytesPerCluster);
+
+        for(size_t index = 0; index < clusters.size(); index++) {
+            clusters[index] = m_nextCluster;
+            m_nextCluster += fragmented && index % 3 == 2 ? 2 : 1;
+        }
+
+        for(size_t index = 0; index + 1 < clusters.size(); index++) {
+            m_fat[clusters[index]] = clusters[index + 1];
+        }
+
+        m_fat[clusters.back()] = endOfChain();
+
+        return clusters;
+    }
+
+    void TestFATImage::writeFile(const std::vector<uint32_t> &clusters, const unsigned char *file, size_t size) {
+        for(size_t index = 0, position = 0; position < size; index++, position += bytesPerCluster) {
+            memcpy(data.data() + clusterOffset(clusters[index]), file + position, std::min<size_t>(bytesPerCluster, size - position));
+        }
+    }
+
+    size_t TestFATImage::clusterOffset(uint32_t cluster) const {
+        return (m_firstDataSector + static_cast<size_t>(cluster - 2) * (bytesPerCluster / BytesPerSector)) * BytesPerSector;
+    }
+
+    std::vector<unsigned char> readBinaryFile(const std::filesystem::path &path) {
+        std::ifstream stream(path, std::ios::in | std::ios::binary);
+        return std::vector<unsigned char>(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+    }
+
+    void writeBinaryFile(const std::filesystem::path &path, const std::vector<unsigned char> &data) {
+        std::ofstream stream(path, std::ios::out | std::ios::trunc | std::ios::binary);
+        stream.write(reinterpret_cast<const char *>(data.data()), data.size());
+        check(stream.good(), "unable to write " + path.string());
+    }
+
+    /*
+     * Shrinks WINBOOT.SYS on generated volumes of every FAT type, and checks
+     * its directory entry, that the clusters past its new end are freed and
+     * the others untouched, and that the FATs that are kept up to date are
+     * all updated. A FAT32 volume that mirrors its FATs uses the first one,
+     * whatever the number of the active one in its flags says, which a stale
+     * second FAT catches; one that doesn't mirror only uses and updates the
+     * active one.
+     */
+    void testFATShrink() {
+        const struct {
+            const char *name;
+            FATType type;
+            uint16_t extendedFlags;
+            int onlyFAT;
+        } volumes[] = {
+            { "FAT12", FATType::FAT12, 0, -1 },
+            { "FAT16", FATType::FAT16, 0, -1 },
+            { "FAT32", FATType::FAT32, 0, -1 },
+            { "FAT32, mirrored, with an active FAT", FATType::FAT32, 0x0001, 0 },
+            { "FAT32, not mirrored", FATType::FAT32, 0x0081, 1 }
+        };
+
+        static constexpr size_t OriginalSize = 20000;
+        static constexpr size_t ShrunkSize = 7000;
+
+        auto path = std::filesystem::temp_directory_path() /
+                    ("trim-winboot-selftest-" + std::to_string(getpid()) + ".img");
+
+        auto winboot = makeTestData(OriginalSize, 9);
+        std::vector<unsigned char> shrunk(winboot.begin(), winboot.begin() + ShrunkSize);
+
+        try {
+            for(const auto &volume: volumes) {
+                std::string name = volume.name;
+
+                TestFATImage image(volume.type, winboot, volume.extendedFlags, volume.onlyFAT);
+                writeBinaryFile(path, image.data);
+
+                {
+                    FATVolume fat(path);
+
+                    FATVolume::RootFile file;
+                    check(fat.findRootFile("WINBOOT.SYS", file), name + ": WINBOOT.SYS isn't found");
+                    check(fat.readFile(file) == winboot, name + ": WINBOOT.SYS doesn't read back");
+
+                    fat.shrinkFile(file, shrunk);
+                }
+
+                auto result = readBinaryFile(path);
+                auto entry = result.data() + image.entryOffset;
+
+                check((entry[28] | (entry[29] << 8) | (entry[30] << 16) | (entry[31] << 24)) == ShrunkSize,
+                      name + ": the size in the directory entry isn't updated");
+
+                TestFATImage after = image;
+                after.data = result;
+
+                auto keptClusters = (ShrunkSize + image.bytesPerCluster - 1) / image.bytesPerCluster;
+
+                bool mirrored = (volume.extendedFlags & 0x80) == 0;
+                unsigned int activeFAT = mirrored ? 0 : volume.extendedFlags & 0x0F;
+
+                for(unsigned int fat = 0; fat < TestFATImage::FATCount; fat++) {
+                    bool updated = mirrored || fat == activeFAT;
+
+                    for(size_t index = 0; index < image.winbootClusters.size(); index++) {
+                        auto cluster = image.winbootClusters[index];
+
+                        uint32_t value;
+                        if(!updated) {
+                            value = image.fatEntry(fat, cluster);
+                        } else if(index + 1 < keptClusters) {
+                            value = image.winbootClusters[index + 1];
+                        } else if(index + 1 == keptClusters) {
+                            value = image.endOfChain();
+                        } else {
+                            value = 0;
+                        }
+
+                        check(after.fatEntry(fat, cluster) == value,
+                              name + ": FAT " + std::to_string(fat) + " has the wrong entry for cluster " +
+                              std::to_string(cluster));
+                    }
+
+                    for(auto cluster: image.otherClusters) {
+                        check(after.fatEntry(fat, cluster) == image.fatEntry(updated ? activeFAT : fat, cluster),
+                              name + ": FAT " + std::to_string(fat) + " has changed for another file");
+                    }
+                }
+
+                if(volume.type == FATType::FAT32) {
+                    auto freeClusters = [](const std::vector<unsigned char> &data) {
+                        auto count = data.data() + TestFATImage::FSInfoFreeClustersOffset;
+                        return count[0] | (count[1] << 8) | (count[2] << 16) | (count[3] << 24);
+                    };
+
+                    check(freeClusters(result) == freeClusters(image.data) +
+                                                  static_cast<int>(image.winbootClusters.size() - keptClusters),
+                          name + ": the free cluster count isn't updated");
+                }
+
+                {
+                    FATVolume fat(path);
+
+                    FATVolume::RootFile file;
+                    check(fat.findRootFile("WINBOOT.SYS", file) && fat.readFile(file) == shrunk,
+                          name + ": the shrunk WINBOOT.SYS doesn't read back");
+                }
+            }
+        } catch(...) {
+            std::filesystem::remove(path);
+            throw;
+        }
+
+        std::filesystem::remove(path);
+    }
+
+    const struct {
+        const char *name;
+        void (*run)();
+    } tests[] = {
+        { "cm-round-trip", testCMRoundTrip },
+        { "stream-round-trip", testStreamRoundTrip },
+        { "stream-boot", testStreamBoot },
+        { "dos8-boot", testDOS8Boot },
+        { "in-place-round-trip", testInPlaceRoundTrip },
+        { "in-place-boot", testInPlaceBoot },
+        { "logo-decoy", testLogoDecoy },
+        { "logo-fallback", testLogoFallback },
+        { "fat-shrink", testFATShrink }
+    };
+}
+
+/*
+ * Runs the test named on the command line, or all of them.
+ */
+int main(int argc, char **argv) {
+    if(argc > 2) {
+        fprintf(stderr, "Usage: %s [TEST]\n", argv[0]);
+        return 1;
+    }
+
+    bool found = false;
+    int failures = 0;
+
+    for(const auto &test: tests) {
+        if(argc == 2 && strcmp(argv[1], test.name) != 0)
+            continue;
+
+        found = true;
+
+        try {
+            test.run();
+            printf("%s: passed\n", test.name);
+        } catch(const std::exception &e) {
+            printf("%s: FAILED: %s\n", test.name, e.what());
+            failures++;
+        }
+    }
+
+    if(!found) {
+        fprintf(stderr, "No such test: %s\n", argv[1]);
+        return 1;
+    }
+
+    return failures == 0 ? 0 : 1;
+}
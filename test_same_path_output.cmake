@@ -0,0 +1,54 @@
+# Processes a synthetic image in place, with the same path for the input and
+# the output, with both kinds of I/O, and checks that the result is the one
+# processing it into another file gives.
+#
+# Expects MICROBENCH, TRIM_WINBOOT and WORK_DIR to be defined.
+
+file(REMOVE_RECURSE ${WORK_DIR})
+
+execute_process(
+    COMMAND ${MICROBENCH} --layout=dos7 --save-images=${WORK_DIR} --filter=no-benchmarks
+    OUTPUT_QUIET
+    RESULT_VARIABLE result
+)
+
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "unable to generate the image: ${result}")
+endif()
+
+execute_process(
+    COMMAND ${TRIM_WINBOOT} --compress --remove-logo ${WORK_DIR}/dos7.sys ${WORK_DIR}/expected.sys
+    OUTPUT_QUIET
+    ERROR_QUIET
+    RESULT_VARIABLE result
+)
+
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "unable to process the image: ${result}")
+endif()
+
+foreach(io stream mmap)
+    set(image ${WORK_DIR}/${io}.sys)
+
+    execute_process(COMMAND ${CMAKE_COMMAND} -E copy ${WORK_DIR}/dos7.sys ${image})
+
+    execute_process(
+        COMMAND ${TRIM_WINBOOT} --io=${io} --compress --remove-logo ${image} ${image}
+        OUTPUT_QUIET
+        ERROR_QUIET
+        RESULT_VARIABLE result
+    )
+
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "--io=${io}: unable to process the image in place: ${result}")
+    endif()
+
+    execute_process(
+        COMMAND ${CMAKE_COMMAND} -E compare_files ${WORK_DIR}/expected.sys ${image}
+        RESULT_VARIABLE result
+    )
+
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "--io=${io}: processing the image in place gives a different result")
+    endif()
+endforeach()